@@ -20,41 +20,65 @@
 
 #include "p_libcrawl.h"
 
+struct cache_rekey_struct
+{
+	CRAWL *crawl;
+	pthread_mutex_t lock;
+	size_t moved;
+	int error;
+};
+
 static int cache_create_dirs_(CRAWL *crawl, const char *path);
 static int cache_copy_filename_(CRAWL *crawl, const CACHEKEY key, const char *type, int temporary);
+static int cache_rekey_cb_(void *userdata, int thread, const CACHEKEY key, const char *path);
+static int cache_rekey_move_(CRAWL *crawl, const CACHEKEY from, const CACHEKEY to, const char *type, char *src, char *dest, size_t len);
 
 CRAWLOBJ *
 crawl_locate(CRAWL *crawl, const char *uristr)
 {
-	URI *uri;
-	CRAWLOBJ *r;
+	CRAWLOBJ *obj;
+	struct stat sbuf;
 	
-	uri = uri_create_str(uristr, NULL);
-	if(!uri)
+	obj = crawl_obj_create_str_(crawl, uristr);
+	if(!obj)
 	{
 		return NULL;
 	}
-	r = crawl_locate_uri(crawl, uri);
-	uri_destroy(uri);
-	return r;
+	if(crawl->index && !crawl_index_lookup(crawl->index, obj->key))
+	{
+		/* The object wasn't present when the index was generated; unless
+		 * its leaf directory has been modified since then, it still isn't.
+		 */
+		if(cache_stat_leaf_(crawl, obj->key, &sbuf) ||
+			sbuf.st_mtime < crawl->index->created)
+		{
+			crawl_obj_destroy(obj);
+			errno = ENOENT;
+			return NULL;
+		}
+	}
+	if(crawl_obj_locate_(obj))
+	{
+		crawl_obj_destroy(obj);
+		return NULL;
+	}
+	return obj;
 }
 
 CRAWLOBJ *
 crawl_locate_uri(CRAWL *crawl, URI *uri)
 {
-	CRAWLOBJ *obj;
+	CRAWLOBJ *r;
+	char *uristr;
 	
-	obj = crawl_obj_create_(crawl, uri);
-	if(!obj)
-	{
-		return NULL;
-	}
-	if(crawl_obj_locate_(obj))
+	uristr = uri_stralloc(uri);
+	if(!uristr)
 	{
-		crawl_obj_destroy(obj);
 		return NULL;
 	}
-	return obj;
+	r = crawl_locate(crawl, uristr);
+	free(uristr);
+	return r;
 }
 
 int
@@ -62,7 +86,10 @@ crawl_cache_key(CRAWL *restrict crawl, const char *restrict uri, char *restrict
 {
 	CACHEKEY k;
 	
-	crawl_cache_key_(crawl, k, uri);
+	if(crawl_cache_key_(crawl, k, uri))
+	{
+		return -1;
+	}
 	if(buflen)
 	{
 		strncpy(buf, k, buflen - 1);
@@ -74,17 +101,12 @@ crawl_cache_key(CRAWL *restrict crawl, const char *restrict uri, char *restrict
 int
 crawl_cache_key_uri(CRAWL *restrict crawl, URI *restrict uri, char *restrict buf, size_t buflen)
 {
-	size_t needed;
 	char *uristr;
 	int r;
 	
-	needed = uri_str(uri, NULL, 0);
-	uristr = NULL;
-	if(!needed ||
-		(uristr = (char *) malloc(needed)) == NULL ||
-		uri_str(uri, uristr, needed) != needed)
+	uristr = uri_stralloc(uri);
+	if(!uristr)
 	{
-		free(uristr);
 		return -1;
 	}
 	r = crawl_cache_key(crawl, uristr, buf, buflen);
@@ -92,16 +114,181 @@ crawl_cache_key_uri(CRAWL *restrict crawl, URI *restrict uri, char *restrict buf
 	return r;
 }
 
+/* Move any object which is stored under a key other than that of the
+ * canonical form of its location: objects cached before URIs were
+ * canonicalised were keyed by the URI as liburi serialised it, which
+ * differs for URIs not already in canonical form
+ */
+int
+crawl_cache_rekey(CRAWL *crawl, int nthreads, size_t *moved)
+{
+	struct cache_rekey_struct rk;
+	int r;
+	
+	memset(&rk, 0, sizeof(rk));
+	rk.crawl = crawl;
+	pthread_mutex_init(&(rk.lock), NULL);
+	r = cache_walk_(crawl, nthreads, cache_rekey_cb_, &rk);
+	pthread_mutex_destroy(&(rk.lock));
+	if(moved)
+	{
+		*moved = rk.moved;
+	}
+	if(r || rk.error)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static int
+cache_rekey_cb_(void *userdata, int thread, const CACHEKEY key, const char *path)
+{
+	struct cache_rekey_struct *rk;
+	jd_var info = JD_INIT;
+	jd_var *value;
+	CACHEKEY newkey;
+	char *src, *dest;
+	size_t len;
+	int r;
+	FILE *f;
+	
+	(void) thread;
+	
+	rk = (struct cache_rekey_struct *) userdata;
+	f = fopen(path, "r");
+	if(!f)
+	{
+		/* The object has been removed since the leaf was listed */
+		return 0;
+	}
+	if(cache_read_info_(f, &info))
+	{
+		return 0;
+	}
+	r = -1;
+	if(info.type != VOID)
+	{
+		JD_SCOPE
+		{
+			value = jd_get_ks(&info, "location", 0);
+			if(value && value->type != VOID)
+			{
+				r = crawl_cache_key_(rk->crawl, newkey, jd_bytes(value, NULL));
+			}
+		}
+	}
+	jd_release(&info);
+	if(r || !strcmp(key, newkey))
+	{
+		return 0;
+	}
+	/* The payload suffix is the longer of the two */
+	len = cache_filename_(rk->crawl, key, CACHE_PAYLOAD_SUFFIX, NULL, 0, 0);
+	src = (char *) malloc(len * 2);
+	if(!src)
+	{
+		pthread_mutex_lock(&(rk->lock));
+		rk->error = -1;
+		pthread_mutex_unlock(&(rk->lock));
+		return -1;
+	}
+	dest = &(src[len]);
+	/* If the object has been fetched again since its key changed, the copy
+	 * under the old key is simply stale
+	 */
+	cache_filename_(rk->crawl, newkey, CACHE_INFO_SUFFIX, dest, len, 0);
+	if(!access(dest, F_OK))
+	{
+		cache_filename_(rk->crawl, key, CACHE_PAYLOAD_SUFFIX, src, len, 0);
+		unlink(src);
+		cache_filename_(rk->crawl, key, CACHE_INFO_SUFFIX, src, len, 0);
+		unlink(src);
+		free(src);
+		return 0;
+	}
+	/* Move the payload first: only sidecars are found by a walk, so if the
+	 * rekey is interrupted, the next one will pick up where it left off
+	 */
+	if(cache_rekey_move_(rk->crawl, key, newkey, CACHE_PAYLOAD_SUFFIX, src, dest, len) ||
+		cache_rekey_move_(rk->crawl, key, newkey, CACHE_INFO_SUFFIX, src, dest, len))
+	{
+		free(src);
+		pthread_mutex_lock(&(rk->lock));
+		rk->error = -1;
+		pthread_mutex_unlock(&(rk->lock));
+		return -1;
+	}
+	free(src);
+	pthread_mutex_lock(&(rk->lock));
+	rk->moved++;
+	pthread_mutex_unlock(&(rk->lock));
+	return 0;
+}
+
+/* Rename one of an object's files from one key to another, creating the
+ * destination leaf directory if needed; a missing source isn't an error
+ */
+static int
+cache_rekey_move_(CRAWL *crawl, const CACHEKEY from, const CACHEKEY to, const char *type, char *src, char *dest, size_t len)
+{
+	char *t;
+	
+	cache_filename_(crawl, from, type, src, len, 0);
+	cache_filename_(crawl, to, type, dest, len, 0);
+	if(!rename(src, dest))
+	{
+		return 0;
+	}
+	if(errno == ENOENT && !access(src, F_OK))
+	{
+		/* The source exists, so it's the destination leaf which doesn't */
+		t = strrchr(dest, '/');
+		*t = 0;
+		*(t - 3) = 0;
+		if(mkdir(dest, 0777) && errno != EEXIST)
+		{
+			return -1;
+		}
+		*(t - 3) = '/';
+		if(mkdir(dest, 0777) && errno != EEXIST)
+		{
+			return -1;
+		}
+		*t = '/';
+		return rename(src, dest);
+	}
+	return (errno == ENOENT ? 0 : -1);
+}
+
+/* The cache key is a truncated SHA-256 of the canonical form of the URI;
+ * strings which aren't absolute URIs are hashed as-is (less any fragment)
+ */
 int
 crawl_cache_key_(CRAWL *crawl, CACHEKEY dest, const char *uri)
 {
 	unsigned char buf[SHA256_DIGEST_LENGTH];
-	size_t c;
-	char *t;
+	size_t c, rootlen;
+	ssize_t len;
+	char *canon, *t;
+	int r;
 	
 	(void) crawl;
-    
-	/* The cache key is a truncated SHA-256 of the URI */
+	
+	c = crawl_canon_size_(uri);
+	canon = (char *) malloc(c);
+	if(!canon)
+	{
+		return -1;
+	}
+	len = crawl_canon_write_(uri, canon, c, &rootlen);
+	if(len >= 0)
+	{
+		r = crawl_canon_hash_(canon, len, rootlen, dest, NULL, NULL);
+		free(canon);
+		return r;
+	}
+	free(canon);
 	c = strlen(uri);
 	/* If there's a fragment, remove it */
 	t = strchr(uri, '#');
@@ -110,10 +297,7 @@ crawl_cache_key_(CRAWL *crawl, CACHEKEY dest, const char *uri)
 		c = t - uri;
 	}
 	SHA256((const unsigned char *) uri, c, buf);
-	for(c = 0; c < (CACHE_KEY_LEN / 2); c++)
-	{
-		dest += sprintf(dest, "%02x", buf[c] & 0xff);
-	}
+	cache_key_hex_(buf, dest);
 	return 0;
 }
 
@@ -253,6 +437,103 @@ cache_close_payload_commit_(CRAWL *crawl, const CACHEKEY key, FILE *f)
 	return rename(crawl->cachefile, crawl->cachetmp);
 }
 
+/* Read and parse the contents of a JSON sidecar, closing the file */
+int
+cache_read_info_(FILE *f, jd_var *dest)
+{
+	char *buf, *p;
+	size_t bufsize;
+	ssize_t count;
+	
+	buf = 0;
+	bufsize = 0;
+	for(;;)
+	{
+		p = realloc(buf, bufsize + OBJ_READ_BLOCK + 1);
+		if(!p)
+		{
+			fclose(f);
+			free(buf);
+			return -1;
+		}
+		buf = p;
+		p = &(buf[bufsize]);
+		count = fread(p, 1, OBJ_READ_BLOCK, f);
+		if(count < 0)
+		{
+			fclose(f);
+			free(buf);
+			return -1;
+		}
+		p[count] = 0;
+		bufsize += count;
+		if(count == 0)
+		{
+			break;
+		}
+	}	
+	fclose(f);
+	jd_from_jsons(dest, buf);
+	free(buf);
+	return 0;
+}
+
+/* Obtain information about the leaf directory which holds a cache key */
+int
+cache_stat_leaf_(CRAWL *crawl, const CACHEKEY key, struct stat *sbuf)
+{
+	char *t;
+	
+	if(cache_copy_filename_(crawl, key, CACHE_INFO_SUFFIX, 0))
+	{
+		return -1;
+	}
+	t = strrchr(crawl->cachefile, '/');
+	if(t)
+	{
+		*t = 0;
+	}
+	return stat(crawl->cachefile, sbuf);
+}
+
+/* Convert a hexadecimal cache key to its binary form */
+int
+cache_key_bin_(const char *key, unsigned char *dest)
+{
+	size_t c;
+	int hi, lo;
+	
+	for(c = 0; c < CACHE_KEY_BINLEN; c++)
+	{
+		hi = key[c * 2];
+		lo = (hi ? key[c * 2 + 1] : 0);
+		if(!isxdigit(hi) || !isxdigit(lo))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		hi = (isdigit(hi) ? hi - '0' : tolower(hi) - 'a' + 10);
+		lo = (isdigit(lo) ? lo - '0' : tolower(lo) - 'a' + 10);
+		dest[c] = (unsigned char) ((hi << 4) | lo);
+	}
+	return 0;
+}
+
+/* Convert a binary cache key to its hexadecimal form */
+void
+cache_key_hex_(const unsigned char *bin, CACHEKEY dest)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t c;
+	
+	for(c = 0; c < CACHE_KEY_BINLEN; c++)
+	{
+		dest[c * 2] = hex[bin[c] >> 4];
+		dest[c * 2 + 1] = hex[bin[c] & 15];
+	}
+	dest[CACHE_KEY_LEN] = 0;
+}
+
 static int
 cache_create_dirs_(CRAWL *crawl, const char *path)
 {
@@ -0,0 +1,402 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcrawl.h"
+
+/* Single-pass URI canonicalisation
+ *
+ * An absolute URI string is written directly in its canonical form (see
+ * RFC 3986 section 6.2.2): the scheme and host are lower-cased, the hex
+ * digits of percent-encoded octets are upper-cased (and unreserved
+ * characters decoded), characters which may not appear in a URI are
+ * percent-encoded, dot-segments are removed from the path, a default port
+ * or empty path is normalised and the fragment is discarded.
+ *
+ * The root of the URI (scheme "://" authority "/") is always a prefix of
+ * the canonical form, so the digests used for the cache key and root key
+ * are produced from the same pass over it.
+ */
+
+static char *canon_copy_(char *d, const char *s, const char *e, int lower);
+static char *canon_path_(char *d, const char *s, const char *e);
+static int canon_default_port_(const char *scheme, size_t schemelen, const char *port, size_t portlen);
+static int canon_hexval_(int ch);
+
+static const char canon_hex_[] = "0123456789ABCDEF";
+
+/* Canonicalise a URI, returning a single allocation holding the canonical
+ * URI, its root and the keys of both
+ */
+CRAWLCANON *
+crawl_canonicalise(const char *uristr)
+{
+	CRAWLCANON *p;
+	size_t needed;
+	ssize_t len;
+	
+	needed = crawl_canon_size_(uristr);
+	p = (CRAWLCANON *) malloc(sizeof(CRAWLCANON) + (needed * 2));
+	if(!p)
+	{
+		return NULL;
+	}
+	memset(p, 0, sizeof(CRAWLCANON));
+	len = crawl_canon_write_(uristr, p->buf, needed, &(p->rootlen));
+	if(len < 0)
+	{
+		free(p);
+		return NULL;
+	}
+	p->uri = p->buf;
+	p->urilen = len;
+	p->root = &(p->buf[len + 1]);
+	memcpy(&(p->buf[len + 1]), p->buf, p->rootlen);
+	p->buf[len + 1 + p->rootlen] = 0;
+	if(crawl_canon_hash_(p->uri, p->urilen, p->rootlen, p->key, p->rootkey, &(p->shortkey)))
+	{
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void
+crawl_canonical_destroy(CRAWLCANON *canon)
+{
+	free(canon);
+}
+
+/* Return the size of the buffer needed to hold the canonical form of a URI:
+ * at worst, every octet is percent-encoded and a path of "/" is added
+ */
+size_t
+crawl_canon_size_(const char *uristr)
+{
+	return (strlen(uristr) * 3) + 2;
+}
+
+/* Write the canonical form of uristr to dest, which must be at least
+ * crawl_canon_size_() bytes long, returning its length; rootlen is set to the
+ * length of the root prefix.
+ */
+ssize_t
+crawl_canon_write_(const char *uristr, char *dest, size_t destlen, size_t *rootlen)
+{
+	const char *s, *e, *t, *host, *port;
+	char *d;
+	size_t schemelen;
+	
+	if(destlen < crawl_canon_size_(uristr))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	s = uristr;
+	while(isspace((unsigned char) *s))
+	{
+		s++;
+	}
+	e = s + strlen(s);
+	while(e > s && isspace((unsigned char) e[-1]))
+	{
+		e--;
+	}
+	/* Discard the fragment */
+	for(t = s; t < e; t++)
+	{
+		if(*t == '#')
+		{
+			e = t;
+			break;
+		}
+	}
+	/* scheme ":" */
+	d = dest;
+	if(s >= e || !isalpha((unsigned char) *s))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	while(s < e && (isalnum((unsigned char) *s) || *s == '+' || *s == '-' || *s == '.'))
+	{
+		*d = tolower((unsigned char) *s);
+		d++;
+		s++;
+	}
+	if(s >= e || *s != ':')
+	{
+		/* Not an absolute URI */
+		errno = EINVAL;
+		return -1;
+	}
+	schemelen = d - dest;
+	*d = ':';
+	d++;
+	s++;
+	*rootlen = d - dest;
+	if(e - s >= 2 && s[0] == '/' && s[1] == '/')
+	{
+		/* "//" [ userinfo "@" ] host [ ":" port ] */
+		*d = '/';
+		d++;
+		*d = '/';
+		d++;
+		s += 2;
+		for(t = s; t < e && *t != '/' && *t != '?'; t++);
+		host = s;
+		for(port = s; port < t; port++)
+		{
+			if(*port == '@')
+			{
+				host = port + 1;
+			}
+		}
+		if(host > s)
+		{
+			/* The userinfo is case-sensitive */
+			d = canon_copy_(d, s, host, 0);
+		}
+		/* The port follows the last colon which isn't part of an IPv6
+		 * literal
+		 */
+		port = NULL;
+		for(s = host; s < t; s++)
+		{
+			if(*s == ']')
+			{
+				port = NULL;
+			}
+			else if(*s == ':')
+			{
+				port = s;
+			}
+		}
+		d = canon_copy_(d, host, (port ? port : t), 1);
+		if(port && t - port > 1 &&
+			!canon_default_port_(dest, schemelen, port + 1, t - port - 1))
+		{
+			d = canon_copy_(d, port, t, 0);
+		}
+		s = t;
+		/* The path of a URI with an authority is always at least "/" */
+		*rootlen = d - dest + 1;
+		if(s >= e || *s != '/')
+		{
+			*d = '/';
+			d++;
+		}
+	}
+	for(t = s; t < e && *t != '?'; t++);
+	if(s < t && *s == '/')
+	{
+		d = canon_path_(d, s, t);
+	}
+	else
+	{
+		d = canon_copy_(d, s, t, 0);
+	}
+	/* The query is copied as-is, other than percent-encoding */
+	d = canon_copy_(d, t, e, 0);
+	*d = 0;
+	return d - dest;
+}
+
+/* Generate the cache key of a canonical URI and (if rootkey is not NULL)
+ * the key of its root, along with the short key used by the queue; the
+ * digest of the root is taken part-way through that of the URI.
+ */
+int
+crawl_canon_hash_(const char *uri, size_t urilen, size_t rootlen, char *key, char *rootkey, uint32_t *shortkey)
+{
+	EVP_MD_CTX *ctx, *rctx;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	int r;
+	
+	if(rootlen > urilen)
+	{
+		rootlen = urilen;
+	}
+	ctx = EVP_MD_CTX_new();
+	rctx = (rootkey ? EVP_MD_CTX_new() : NULL);
+	if(!ctx || (rootkey && !rctx))
+	{
+		EVP_MD_CTX_free(ctx);
+		EVP_MD_CTX_free(rctx);
+		errno = ENOMEM;
+		return -1;
+	}
+	r = (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+		EVP_DigestUpdate(ctx, uri, rootlen));
+	if(r && rootkey)
+	{
+		r = (EVP_MD_CTX_copy_ex(rctx, ctx) &&
+			EVP_DigestFinal_ex(rctx, digest, NULL));
+		if(r)
+		{
+			cache_key_hex_(digest, rootkey);
+		}
+	}
+	r = (r && EVP_DigestUpdate(ctx, uri + rootlen, urilen - rootlen) &&
+		EVP_DigestFinal_ex(ctx, digest, NULL));
+	EVP_MD_CTX_free(ctx);
+	EVP_MD_CTX_free(rctx);
+	if(!r)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	cache_key_hex_(digest, key);
+	if(shortkey)
+	{
+		*shortkey = ((uint32_t) digest[0] << 24) | ((uint32_t) digest[1] << 16) |
+			((uint32_t) digest[2] << 8) | (uint32_t) digest[3];
+	}
+	return 0;
+}
+
+/* Copy part of a URI, normalising percent-encoding and (if lower is set)
+ * lower-casing it
+ */
+static char *
+canon_copy_(char *d, const char *s, const char *e, int lower)
+{
+	int ch, hi, lo;
+	
+	for(; s < e; s++)
+	{
+		ch = (unsigned char) *s;
+		if(ch == '%' && e - s > 2 &&
+			(hi = canon_hexval_(s[1])) >= 0 && (lo = canon_hexval_(s[2])) >= 0)
+		{
+			ch = (hi << 4) | lo;
+			s += 2;
+			if(isalnum(ch) || ch == '-' || ch == '.' || ch == '_' || ch == '~')
+			{
+				*d = (lower ? tolower(ch) : ch);
+				d++;
+				continue;
+			}
+		}
+		else if(ch > 0x20 && ch < 0x7f && !strchr("\"<>\\^`{|}", ch))
+		{
+			*d = (lower ? tolower(ch) : ch);
+			d++;
+			continue;
+		}
+		d[0] = '%';
+		d[1] = canon_hex_[ch >> 4];
+		d[2] = canon_hex_[ch & 15];
+		d += 3;
+	}
+	return d;
+}
+
+/* Copy an absolute path, removing dot-segments as it goes */
+static char *
+canon_path_(char *d, const char *s, const char *e)
+{
+	const char *t;
+	char *base, *seg;
+	int dot;
+	
+	base = d;
+	dot = 0;
+	while(s < e)
+	{
+		/* s points to the slash preceding a segment */
+		*d = '/';
+		d++;
+		s++;
+		for(t = s; t < e && *t != '/'; t++);
+		seg = d;
+		d = canon_copy_(d, s, t, 0);
+		s = t;
+		dot = 0;
+		if(d - seg == 1 && seg[0] == '.')
+		{
+			/* Remove "/." */
+			d = seg - 1;
+			dot = 1;
+		}
+		else if(d - seg == 2 && seg[0] == '.' && seg[1] == '.')
+		{
+			/* Remove "/.." and the segment preceding it */
+			d = seg - 1;
+			while(d > base && d[-1] != '/')
+			{
+				d--;
+			}
+			if(d > base)
+			{
+				d--;
+			}
+			dot = 1;
+		}
+	}
+	if(dot || d == base)
+	{
+		/* A path ending in a dot-segment refers to a directory */
+		*d = '/';
+		d++;
+	}
+	return d;
+}
+
+/* Is the port the default for the scheme? */
+static int
+canon_default_port_(const char *scheme, size_t schemelen, const char *port, size_t portlen)
+{
+	while(portlen > 1 && *port == '0')
+	{
+		port++;
+		portlen--;
+	}
+	if(schemelen == 4 && !strncmp(scheme, "http", 4))
+	{
+		return (portlen == 2 && !strncmp(port, "80", 2));
+	}
+	if(schemelen == 5 && !strncmp(scheme, "https", 5))
+	{
+		return (portlen == 3 && !strncmp(port, "443", 3));
+	}
+	if(schemelen == 3 && !strncmp(scheme, "ftp", 3))
+	{
+		return (portlen == 2 && !strncmp(port, "21", 2));
+	}
+	return 0;
+}
+
+static int
+canon_hexval_(int ch)
+{
+	if(ch >= '0' && ch <= '9')
+	{
+		return ch - '0';
+	}
+	if(ch >= 'a' && ch <= 'f')
+	{
+		return ch - 'a' + 10;
+	}
+	if(ch >= 'A' && ch <= 'F')
+	{
+		return ch - 'A' + 10;
+	}
+	return -1;
+}
@@ -20,12 +20,19 @@
 
 #include "p_libcrawl.h"
 
+static void crawl_global_init_(void);
+
+static pthread_once_t crawl_once = PTHREAD_ONCE_INIT;
+
 CRAWL *
 crawl_create(void)
 {
 	CRAWL *p;
 
-	/* XXX thread-safe curl_global_init() */
+	/* curl_global_init() isn't thread-safe, so ensure it's only invoked
+	 * once, however many threads create contexts
+	 */
+	pthread_once(&crawl_once, crawl_global_init_);
 	p = (CRAWL *) calloc(1, sizeof(CRAWL));
 	p->cache = strdup("cache");
 	p->ua = strdup("User-Agent: Mozilla/5.0 (compatible; libcrawl; +https://github.com/nevali/crawl)");
@@ -38,6 +45,12 @@ crawl_create(void)
 	return p;
 }
 
+static void
+crawl_global_init_(void)
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+}
+
 void
 crawl_destroy(CRAWL *p)
 {
@@ -48,6 +61,8 @@ crawl_destroy(CRAWL *p)
 		free(p->cachetmp);
 		free(p->accept);
 		free(p->ua);
+		crawl_index_close(p->index);
+		crawl_obj_pool_destroy_(p);
 		free(p);
 	}
 }
@@ -33,10 +33,69 @@ typedef struct crawl_struct CRAWL;
 
 /* A crawled object, returned by a cache look-up (crawl_locate) or fetch
  * (crawl_fetch). The same thread restrictions apply to crawled objects
- * as to the context.
+ * as to the context, and objects must be destroyed before the context
+ * which created them.
  */
 typedef struct crawl_object_struct CRAWLOBJ;
 
+/* A sorted index of the objects held in a cache, created by
+ * crawl_cache_index() and opened with crawl_index_open(). Indexes are
+ * memory-mapped and may be shared freely between threads once opened.
+ */
+typedef struct crawl_index_struct CRAWLINDEX;
+
+/* An entry in a cache index. The key is the binary form of the cache key
+ * (see crawl_index_key()); the type is an ID which can be resolved to a
+ * MIME type with crawl_index_type().
+ */
+typedef struct crawl_index_entry_struct CRAWLINDEXENTRY;
+
+/* The canonical form of a URI, produced by crawl_canonicalise(): the URI
+ * (without its fragment) and its root (scheme://authority/), along with their
+ * cache keys and the truncated key used by queues. The strings are held in
+ * the same allocation as the structure, which is freed with
+ * crawl_canonical_destroy().
+ */
+typedef struct crawl_canonical_struct CRAWLCANON;
+
+struct crawl_canonical_struct
+{
+	const char *uri;
+	size_t urilen;
+	const char *root;
+	size_t rootlen;
+	char key[33];
+	char rootkey[33];
+	uint32_t shortkey;
+	char buf[];
+};
+
+struct crawl_index_entry_struct
+{
+	unsigned char key[16];
+	int64_t updated;
+	int32_t status;
+	uint32_t type;
+	uint64_t size;
+};
+
+/* Well-known response headers, which are located once when an object's
+ * information is loaded and can then be obtained with crawl_obj_header()
+ * without a look-up.
+ */
+typedef enum
+{
+	CRAWL_HDR_CONTENT_TYPE,
+	CRAWL_HDR_CONTENT_LENGTH,
+	CRAWL_HDR_ETAG,
+	CRAWL_HDR_LAST_MODIFIED,
+	CRAWL_HDR_CACHE_CONTROL,
+	CRAWL_HDR_EXPIRES,
+	CRAWL_HDR_LOCATION,
+	CRAWL_HDR_DATE,
+	CRAWL_HDR_COUNT_
+} CRAWLHEADER;
+
 /* URI policy callback: invoked before a URI is fetched; returns 1 to proceed,
  * 0 to skip, -1 on error.
  */
@@ -73,6 +132,17 @@ typedef int (*crawl_next_cb)(CRAWL *crawl, URI **next, void *userdata);
  */
 typedef int (*crawl_checkpoint_cb)(CRAWL *crawl, CRAWLOBJ *obj, int *status, void *userdata);
 
+/* Cache iteration filter: invoked by crawl_cache_foreach() with the cache key
+ * of each committed object before it is opened; returns 1 to visit the object,
+ * 0 to skip it.
+ */
+typedef int (*crawl_cache_filter_cb)(CRAWL *crawl, const char *key, void *userdata);
+
+/* Cache iteration callback: invoked by crawl_cache_foreach() for each object
+ * visited. The object is destroyed when the callback returns. If the callback
+ * returns a nonzero result, the iteration will be stopped.
+ */
+typedef int (*crawl_cache_foreach_cb)(CRAWL *crawl, CRAWLOBJ *obj, void *userdata);
 
 /* Create a crawl context */
 CRAWL *crawl_create(void);
@@ -107,6 +177,10 @@ int crawl_set_unchanged(CRAWL *crawl, crawl_unchanged_cb cb);
 FILE *crawl_obj_open(CRAWLOBJ *obj);
 /* Destroy an (in-memory) crawl object */
 int crawl_obj_destroy(CRAWLOBJ *obj);
+/* Copy a crawl object so that it can be passed to, and destroyed by, another
+ * thread
+ */
+CRAWLOBJ *crawl_obj_dup(CRAWLOBJ *obj);
 /* Obtain the cache key for a crawl object */
 const char *crawl_obj_key(CRAWLOBJ *obj);
 /* Obtain the HTTP status for a crawl object */
@@ -127,9 +201,38 @@ const char *crawl_obj_uristr(CRAWLOBJ *obj);
 const char *crawl_obj_type(CRAWLOBJ *obj);
 /* Obtain the redirect target of the resource */
 const char *crawl_obj_redirect(CRAWLOBJ *obj);
+/* Obtain the first value of a well-known response header */
+const char *crawl_obj_header(CRAWLOBJ *obj, CRAWLHEADER header);
+/* Obtain the MIME type of the payload, lower-cased and without parameters */
+const char *crawl_obj_media_type(CRAWLOBJ *obj);
+/* Obtain the (lower-cased) character set of the payload, if specified */
+const char *crawl_obj_charset(CRAWLOBJ *obj);
+/* Obtain the entity tag of the resource */
+const char *crawl_obj_etag(CRAWLOBJ *obj);
+/* Obtain the last-modified timestamp of the resource, or 0 if unknown */
+time_t crawl_obj_last_modified(CRAWLOBJ *obj);
+/* Obtain the Cache-Control header received with the resource */
+const char *crawl_obj_cache_control(CRAWLOBJ *obj);
+/* Obtain the Expires timestamp of the resource, or 0 if unspecified */
+time_t crawl_obj_expires(CRAWLOBJ *obj);
+/* Obtain the Cache-Control max-age of the resource, or -1 if unspecified */
+long crawl_obj_max_age(CRAWLOBJ *obj);
 /* Has this object been freshly-fetched? */
 int crawl_obj_fresh(CRAWLOBJ *obj);
 
+/* Canonicalise an absolute URI and determine its cache key and root */
+CRAWLCANON *crawl_canonicalise(const char *uristr);
+/* Free a canonicalised URI */
+void crawl_canonical_destroy(CRAWLCANON *canon);
+
+/* Begin resolving the host name of a URI in the background, so that a
+ * subsequent fetch needn't wait for it; the results are shared by all
+ * contexts
+ */
+int crawl_resolve_prefetch(const char *uristr);
+/* Is the host name of a URI known not to resolve? */
+int crawl_resolve_failed(const char *uristr);
+
 /* Determine the cache key for a resource */
 int crawl_cache_key(CRAWL *restrict crawl, const char *restrict uri, char *restrict buf, size_t buflen);
 /* Determine the cache key for a resource */
@@ -145,7 +248,53 @@ CRAWLOBJ *crawl_locate(CRAWL *crawl, const char *uristr);
 /* Locate a cached resource specified as a URI */
 CRAWLOBJ *crawl_locate_uri(CRAWL *crawl, URI *uri);
 
+/* Build a sorted index of a cache, walking the cache using nthreads threads
+ * (or one per CPU if nthreads is zero); if path is NULL, the index is written
+ * to the default location within the cache.
+ */
+int crawl_cache_index(CRAWL *crawl, const char *path, int nthreads);
+/* Move any objects stored under the keys used before URIs were
+ * canonicalised to their current keys, walking the cache using nthreads
+ * threads; if moved is non-NULL, it receives the number of objects moved
+ */
+int crawl_cache_rekey(CRAWL *crawl, int nthreads, size_t *moved);
+/* Attach a cache index (or the default index, if path is NULL) to a context,
+ * allowing crawl_locate() to skip disk look-ups for objects known to be
+ * absent from the cache
+ */
+int crawl_set_index(CRAWL *crawl, const char *path);
+/* Iterate the committed objects in the cache using nthreads threads (or one
+ * per CPU if nthreads is zero). Without an index, objects within each leaf
+ * directory are visited in inode order; with one attached, the indexed
+ * objects are visited in key order, followed by any cached since the index
+ * was built. The callbacks are invoked concurrently, each thread passing its
+ * own context; the private user-data pointer is shared.
+ */
+int crawl_cache_foreach(CRAWL *crawl, crawl_cache_filter_cb filter, crawl_cache_foreach_cb cb, int nthreads);
+/* Open a cache index */
+CRAWLINDEX *crawl_index_open(const char *path);
+/* Close a cache index */
+void crawl_index_close(CRAWLINDEX *index);
+/* Obtain the number of entries in a cache index */
+size_t crawl_index_count(CRAWLINDEX *index);
+/* Obtain the time at which a cache index was generated */
+time_t crawl_index_created(CRAWLINDEX *index);
+/* Obtain an entry from a cache index by position */
+const CRAWLINDEXENTRY *crawl_index_entry(CRAWLINDEX *index, size_t n);
+/* Look up an entry in a cache index by cache key */
+const CRAWLINDEXENTRY *crawl_index_lookup(CRAWLINDEX *index, const char *key);
+/* Obtain the MIME type string for a type ID in a cache index */
+const char *crawl_index_type(CRAWLINDEX *index, uint32_t type);
+/* Format the key of an index entry as a cache key */
+int crawl_index_key(const CRAWLINDEXENTRY *entry, char *buf, size_t buflen);
+
 /* Perform a crawling cycle */
 int crawl_perform(CRAWL *crawl);
+/* Perform a crawling cycle within the calling thread, keeping up to maxconn
+ * fetches in flight at once; the callbacks are invoked as each completes.
+ * The next callback is invoked from the same thread, and no fetch makes
+ * progress while it runs.
+ */
+int crawl_perform_multi(CRAWL *crawl, int maxconn);
 
 #endif /*!CRAWL_H_*/
\ No newline at end of file
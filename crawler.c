@@ -23,6 +23,7 @@
 int
 crawl_perform(CRAWL *crawl)
 {
+	struct crawl_fetch_data_struct data;
 	CRAWLOBJ *obj;
 	URI *uri;
 	int r;
@@ -44,7 +45,19 @@ crawl_perform(CRAWL *crawl)
 		{
 			break;
 		}
-		obj = crawl_fetch_uri(crawl, uri);
+		r = crawl_fetch_prepare_(crawl, uri, &data, &obj);
+		if(r < 0)
+		{
+			/* No object could be created, so the URI couldn't be passed to
+			 * any callback
+			 */
+			uri_destroy(uri);
+			return -1;
+		}
+		if(r > 0)
+		{
+			obj = crawl_fetch_complete_(&data, curl_easy_perform(data.ch));
+		}
 		if(!obj)
 		{
 			/* Check whether there was a failed callback that would have been
@@ -0,0 +1,523 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* crawld module which stages queue updates in memory and writes them
+ * behind to another queue module
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define QUEUE_STRUCT_DEFINED           1
+
+#include "p_crawld.h"
+
+/* Additions and status updates are appended to a bounded list belonging to
+ * the crawl thread's queue, and applied to the underlying queue by a pool of
+ * flush threads (queue:writers); these wake every BUFFER_FLUSH_INTERVAL
+ * milliseconds, or sooner once a buffer is half full, and each flushes
+ * whichever buffers aren't already being flushed by another. A crawl thread
+ * which fills its buffer waits for it to be flushed.
+ *
+ * A buffer is detached before it's flushed, so that crawl threads can carry
+ * on staging updates while the flush is in progress; at most twice the
+ * capacity of a buffer is therefore held at once.
+ *
+ * Calls which must see the underlying queue (next and due) are passed
+ * straight through, serialised with flushes by qlock.
+ */
+
+enum
+{
+	BUFFER_ADD,
+	BUFFER_UPDATED,
+	BUFFER_UNCHANGED
+};
+
+struct buffer_op
+{
+	struct buffer_op *next;
+	int type;
+	time_t updated;
+	time_t last_modified;
+	int status;
+	time_t ttl;
+	char uristr[1];
+};
+
+struct queue_struct
+{
+	struct queue_api_struct *api;
+	unsigned long refcount;
+	QUEUE *inner;
+	QUEUE *next;
+	size_t capacity;
+	size_t count;
+	struct buffer_op *head;
+	struct buffer_op *tail;
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+	pthread_mutex_t qlock;
+};
+
+static unsigned long buffer_addref(QUEUE *me);
+static unsigned long buffer_release(QUEUE *me);
+static int buffer_next(QUEUE *me, URI **next);
+static int buffer_add_uri(QUEUE *me, URI *uri);
+static int buffer_add_uristr(QUEUE *me, const char *uristr);
+static int buffer_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl);
+static int buffer_updated_uristr(QUEUE *me, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl);
+static int buffer_unchanged_uri(QUEUE *me, URI *uri, int error);
+static int buffer_unchanged_uristr(QUEUE *me, const char *uristr, int error);
+static long buffer_due(QUEUE *me);
+static int buffer_add_uristrs(QUEUE *me, const char **uristrs, size_t count);
+static int buffer_stage_(QUEUE *me, int type, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl);
+static int buffer_flush_(QUEUE *me, int wait);
+static int buffer_start_(void);
+static void buffer_wake_(void);
+static void *buffer_thread_(void *arg);
+
+static struct queue_api_struct buffer_api = {
+	NULL,
+	buffer_addref,
+	buffer_release,
+	buffer_next,
+	buffer_add_uri,
+	buffer_add_uristr,
+	buffer_updated_uri,
+	buffer_updated_uristr,
+	buffer_unchanged_uri,
+	buffer_unchanged_uristr,
+	buffer_due,
+	buffer_add_uristrs
+};
+
+/* The list of buffers, which is walked by the flush threads */
+static QUEUE *buffers;
+static pthread_rwlock_t buffer_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t buffer_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t *buffer_threads;
+static int buffer_started;
+
+/* Used to wake the flush threads */
+static pthread_mutex_t buffer_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_wake_cond = PTHREAD_COND_INITIALIZER;
+static int buffer_wakeup;
+static int buffer_stop;
+
+/* Create a buffer in front of inner, which it takes ownership of */
+QUEUE *
+buffer_create(QUEUE *inner, size_t capacity)
+{
+	QUEUE *p;
+	
+	p = (QUEUE *) calloc(1, sizeof(QUEUE));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->api = &buffer_api;
+	p->refcount = 1;
+	p->inner = inner;
+	p->capacity = (capacity ? capacity : 1);
+	pthread_mutex_init(&(p->lock), NULL);
+	pthread_cond_init(&(p->space), NULL);
+	pthread_mutex_init(&(p->qlock), NULL);
+	if(buffer_start_())
+	{
+		pthread_mutex_destroy(&(p->qlock));
+		pthread_cond_destroy(&(p->space));
+		pthread_mutex_destroy(&(p->lock));
+		free(p);
+		return NULL;
+	}
+	pthread_rwlock_wrlock(&buffer_list_lock);
+	p->next = buffers;
+	buffers = p;
+	pthread_rwlock_unlock(&buffer_list_lock);
+	return p;
+}
+
+/* Stop the flush threads once all of the buffers have been released */
+int
+buffer_cleanup(void)
+{
+	int c;
+	
+	pthread_mutex_lock(&buffer_start_lock);
+	if(!buffer_started)
+	{
+		pthread_mutex_unlock(&buffer_start_lock);
+		return 0;
+	}
+	pthread_mutex_lock(&buffer_wake_lock);
+	buffer_stop = 1;
+	pthread_cond_broadcast(&buffer_wake_cond);
+	pthread_mutex_unlock(&buffer_wake_lock);
+	for(c = 0; c < buffer_started; c++)
+	{
+		pthread_join(buffer_threads[c], NULL);
+	}
+	free(buffer_threads);
+	buffer_threads = NULL;
+	buffer_started = 0;
+	buffer_stop = 0;
+	pthread_mutex_unlock(&buffer_start_lock);
+	return 0;
+}
+
+/* Start the flush threads, if they're not already running */
+static int
+buffer_start_(void)
+{
+	int c, nthreads, e;
+	
+	pthread_mutex_lock(&buffer_start_lock);
+	if(buffer_started)
+	{
+		pthread_mutex_unlock(&buffer_start_lock);
+		return 0;
+	}
+	nthreads = config_get_int("queue:writers", 1);
+	if(nthreads < 1)
+	{
+		nthreads = 1;
+	}
+	buffer_threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+	if(!buffer_threads)
+	{
+		pthread_mutex_unlock(&buffer_start_lock);
+		return -1;
+	}
+	for(c = 0; c < nthreads; c++)
+	{
+		e = pthread_create(&(buffer_threads[c]), NULL, buffer_thread_, NULL);
+		if(e)
+		{
+			log_printf(LOG_CRIT, "Failed to create queue flush thread: %s\n", strerror(e));
+			break;
+		}
+		buffer_started++;
+	}
+	pthread_mutex_unlock(&buffer_start_lock);
+	return (buffer_started ? 0 : -1);
+}
+
+static unsigned long
+buffer_addref(QUEUE *me)
+{
+	me->refcount++;
+	return me->refcount;
+}
+
+static unsigned long
+buffer_release(QUEUE *me)
+{
+	QUEUE **p;
+	
+	me->refcount--;
+	if(!me->refcount)
+	{
+		pthread_rwlock_wrlock(&buffer_list_lock);
+		for(p = &buffers; *p; p = &((*p)->next))
+		{
+			if(*p == me)
+			{
+				*p = me->next;
+				break;
+			}
+		}
+		pthread_rwlock_unlock(&buffer_list_lock);
+		/* Write out anything still staged before releasing the underlying
+		 * queue
+		 */
+		buffer_flush_(me, 1);
+		me->inner->api->release(me->inner);
+		pthread_mutex_destroy(&(me->qlock));
+		pthread_cond_destroy(&(me->space));
+		pthread_mutex_destroy(&(me->lock));
+		free(me);
+		return 0;
+	}
+	return me->refcount;
+}
+
+static int
+buffer_next(QUEUE *me, URI **next)
+{
+	int r;
+	
+	pthread_mutex_lock(&(me->qlock));
+	r = me->inner->api->next(me->inner, next);
+	pthread_mutex_unlock(&(me->qlock));
+	return r;
+}
+
+static long
+buffer_due(QUEUE *me)
+{
+	long r;
+	
+	if(!me->inner->api->due)
+	{
+		return -1;
+	}
+	pthread_mutex_lock(&(me->qlock));
+	r = me->inner->api->due(me->inner);
+	pthread_mutex_unlock(&(me->qlock));
+	return r;
+}
+
+static int
+buffer_add_uri(QUEUE *me, URI *uri)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = buffer_add_uristr(me, uristr);
+	free(uristr);
+	return r;
+}
+
+static int
+buffer_add_uristr(QUEUE *me, const char *uristr)
+{
+	return buffer_stage_(me, BUFFER_ADD, uristr, 0, 0, 0, 0);
+}
+
+/* Each URI is staged separately; consecutive additions are applied together
+ * when the buffer is flushed
+ */
+static int
+buffer_add_uristrs(QUEUE *me, const char **uristrs, size_t count)
+{
+	size_t c;
+	
+	for(c = 0; c < count; c++)
+	{
+		if(buffer_stage_(me, BUFFER_ADD, uristrs[c], 0, 0, 0, 0))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+buffer_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = buffer_updated_uristr(me, uristr, updated, last_modified, status, ttl);
+	free(uristr);
+	return r;
+}
+
+static int
+buffer_updated_uristr(QUEUE *me, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	return buffer_stage_(me, BUFFER_UPDATED, uristr, updated, last_modified, status, ttl);
+}
+
+static int
+buffer_unchanged_uri(QUEUE *me, URI *uri, int error)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = buffer_unchanged_uristr(me, uristr, error);
+	free(uristr);
+	return r;
+}
+
+static int
+buffer_unchanged_uristr(QUEUE *me, const char *uristr, int error)
+{
+	return buffer_stage_(me, BUFFER_UNCHANGED, uristr, 0, 0, error, 0);
+}
+
+/* Append an operation to a buffer, waiting for space if it's full */
+static int
+buffer_stage_(QUEUE *me, int type, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	struct buffer_op *op;
+	size_t len;
+	int wake;
+	
+	len = strlen(uristr);
+	op = (struct buffer_op *) malloc(sizeof(struct buffer_op) + len);
+	if(!op)
+	{
+		return -1;
+	}
+	op->next = NULL;
+	op->type = type;
+	op->updated = updated;
+	op->last_modified = last_modified;
+	op->status = status;
+	op->ttl = ttl;
+	memcpy(op->uristr, uristr, len + 1);
+	pthread_mutex_lock(&(me->lock));
+	while(me->count >= me->capacity)
+	{
+		buffer_wake_();
+		pthread_cond_wait(&(me->space), &(me->lock));
+	}
+	if(me->tail)
+	{
+		me->tail->next = op;
+	}
+	else
+	{
+		me->head = op;
+	}
+	me->tail = op;
+	me->count++;
+	wake = (me->count == (me->capacity + 1) / 2);
+	pthread_mutex_unlock(&(me->lock));
+	if(wake)
+	{
+		buffer_wake_();
+	}
+	return 0;
+}
+
+/* Detach the staged operations from a buffer and apply them, in order, to
+ * the underlying queue; if wait is zero and the underlying queue is in use,
+ * returns immediately
+ */
+static int
+buffer_flush_(QUEUE *me, int wait)
+{
+	struct buffer_op *op, *ops, *next;
+	const char *adds[BUFFER_ADD_BATCH];
+	size_t nadds;
+	QUEUE *q;
+	
+	if(wait)
+	{
+		pthread_mutex_lock(&(me->qlock));
+	}
+	else if(pthread_mutex_trylock(&(me->qlock)))
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&(me->lock));
+	ops = me->head;
+	me->head = NULL;
+	me->tail = NULL;
+	me->count = 0;
+	pthread_cond_broadcast(&(me->space));
+	pthread_mutex_unlock(&(me->lock));
+	q = me->inner;
+	while(ops)
+	{
+		op = ops;
+		if(op->type == BUFFER_ADD)
+		{
+			/* Apply a run of additions at once */
+			for(nadds = 0; ops && ops->type == BUFFER_ADD && nadds < BUFFER_ADD_BATCH; ops = ops->next)
+			{
+				adds[nadds] = ops->uristr;
+				nadds++;
+			}
+			q->api->add_uristrs(q, adds, nadds);
+			while(op != ops)
+			{
+				next = op->next;
+				free(op);
+				op = next;
+			}
+			continue;
+		}
+		ops = op->next;
+		switch(op->type)
+		{
+		case BUFFER_UPDATED:
+			q->api->updated_uristr(q, op->uristr, op->updated, op->last_modified, op->status, op->ttl);
+			break;
+		case BUFFER_UNCHANGED:
+			q->api->unchanged_uristr(q, op->uristr, op->status);
+			break;
+		}
+		free(op);
+	}
+	pthread_mutex_unlock(&(me->qlock));
+	return 0;
+}
+
+static void
+buffer_wake_(void)
+{
+	pthread_mutex_lock(&buffer_wake_lock);
+	buffer_wakeup = 1;
+	pthread_cond_signal(&buffer_wake_cond);
+	pthread_mutex_unlock(&buffer_wake_lock);
+}
+
+static void *
+buffer_thread_(void *arg)
+{
+	struct timespec ts;
+	QUEUE *p;
+	int stop;
+	
+	(void) arg;
+	
+	for(;;)
+	{
+		pthread_mutex_lock(&buffer_wake_lock);
+		if(!buffer_wakeup && !buffer_stop)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += BUFFER_FLUSH_INTERVAL * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&buffer_wake_cond, &buffer_wake_lock, &ts);
+		}
+		buffer_wakeup = 0;
+		stop = buffer_stop;
+		pthread_mutex_unlock(&buffer_wake_lock);
+		pthread_rwlock_rdlock(&buffer_list_lock);
+		for(p = buffers; p; p = p->next)
+		{
+			buffer_flush_(p, 0);
+		}
+		pthread_rwlock_unlock(&buffer_list_lock);
+		if(stop)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
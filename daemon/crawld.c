@@ -21,10 +21,12 @@
 #include "p_crawld.h"
 
 static int config_defaults(void);
+static void signal_handler(int sig);
 
 int
 main(int argc, char **argv)
 {
+	struct sigaction sa;
 	char *t;
 	
 	t = strrchr(argv[0], '/');
@@ -55,8 +57,21 @@ main(int argc, char **argv)
 	queue_init();
 	processor_init();
 
-	/* Perform a single thread's crawl actions */
-	thread_create(0);
+	/* Stop crawling cleanly when asked to terminate */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	/* Start the crawl threads and supervise them until shutdown */
+	if(thread_init())
+	{
+		return 1;
+	}
+	thread_supervise();
+	thread_cleanup();
 	
 	processor_cleanup();
 	queue_cleanup();
@@ -74,3 +89,11 @@ config_defaults(void)
 	config_set_default("global:configFile", SYSCONFDIR "/crawl.conf");
 	return 0;
 }
+
+static void
+signal_handler(int sig)
+{
+	(void) sig;
+	
+	thread_shutdown();
+}
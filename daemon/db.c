@@ -22,25 +22,124 @@
 
 #define QUEUE_STRUCT_DEFINED           1
 #define TXN_MAX_RETRIES                10
+/* The maximum number of resources loaded into the scheduler at once */
+#define FILL_BATCH_SIZE                64
+/* The minimum interval, in milliseconds, between queries for more resources
+ * when the previous query didn't return a full batch
+ */
+#define FILL_INTERVAL                  1000
+/* The number of the most overdue resources in the refresh lane from which
+ * each batch is chosen in order of priority
+ */
+#define FILL_REFRESH_WINDOW            1024
+/* The default length of time, in seconds, for which a crawler holds a lease
+ * on the resources it has loaded
+ */
+#define LEASE_DEFAULT_DURATION         600
+/* Leases held by a crawler are renewed each time this fraction of their
+ * duration has passed
+ */
+#define LEASE_RENEW_FRACTION           4
+/* The default number of seconds by which a resource in another crawler's
+ * bucket must be overdue before it may be taken
+ */
+#define STEAL_DEFAULT_GRACE            60
+/* The interval, in seconds, between fetches of a resource whose rate of
+ * change isn't yet known, and the default bounds on it
+ */
+#define REVISIT_DEFAULT_INTERVAL       7200
+#define REVISIT_DEFAULT_MIN            900
+#define REVISIT_DEFAULT_MAX            604800
+/* The default percentage of each batch reserved for newly-discovered
+ * resources; whatever either lane doesn't use is given to the other
+ */
+#define DISCOVERY_DEFAULT_SHARE        50
+/* Resources which have never been fetched are in the discovery lane; those
+ * which have are in the refresh lane
+ */
+#define LANE_DISCOVERY                 0
+#define LANE_REFRESH                   1
+/* Weights from which a resource's priority is calculated: each path segment
+ * counts against it; each link to it (up to PRIORITY_INLINK_MAX) counts
+ * for it, as does each halving of its change interval below revisit-max
+ */
+#define PRIORITY_DEPTH_WEIGHT          10
+#define PRIORITY_INLINK_WEIGHT         1
+#define PRIORITY_INLINK_MAX            100
+#define PRIORITY_CHANGE_WEIGHT         10
+/* The default interval, in seconds, between snapshots of the scheduler */
+#define SNAPSHOT_DEFAULT_INTERVAL      60
+/* The first line of a snapshot */
+#define SNAPSHOT_MAGIC                 "crawld-snapshot 1"
+/* The maximum number of rows inserted by a single statement */
+#define INSERT_BATCH_ROWS              128
+/* The default number of fetch outcomes committed together, and the
+ * default maximum time in milliseconds for which an outcome may wait
+ */
+#define COMMIT_DEFAULT_BATCH           64
+#define COMMIT_DEFAULT_INTERVAL        1000
+/* The length of a key (the first 16 bytes of the SHA-256 digest of a
+ * canonical URI), which is stored as binary
+ */
+#define DB_KEY_LEN                     16
+/* The maximum length of a prepared statement */
+#define STMT_TEXT_LEN                  2048
 
 #include "p_crawld.h"
 
+#include <stdarg.h>
 #include <libsql.h>
 
+struct fill_batch;
+struct snapshot_load;
+struct insert_batch;
+struct db_buffer;
+struct db_outcome;
+
 static int db_migrate(SQL *restrict, const char *identifier, int newversion, void *restrict userdata);
 static unsigned long db_addref(QUEUE *me);
 static unsigned long db_release(QUEUE *me);
 static int db_next(QUEUE *me, URI **next);
+static long db_due(QUEUE *me);
+static long db_due_(QUEUE *me);
+static int db_fill_(QUEUE *me);
+static int db_fill_txn_(SQL *db, void *userdata);
+static int db_fill_lane_(SQL *db, struct fill_batch *batch, int lane, int limit, int offset, size_t *keylen);
+static int db_fill_rows_(struct fill_batch *batch, SQL_STATEMENT *rs, size_t *keylen);
+static int db_fill_rekey_(SQL *db, struct fill_batch *batch);
+static void db_fill_reset_(struct fill_batch *batch);
+static int db_release_leases_(QUEUE *me);
+static int db_renew_leases_(QUEUE *me);
+static int db_snapshot_save_(QUEUE *me);
+static int db_snapshot_load_(QUEUE *me);
+static int db_snapshot_txn_(SQL *db, void *userdata);
+static int db_snapshot_keep_(const char *uristr, void *userdata);
+static int db_snapshot_keycmp_(const void *a, const void *b);
 static int db_add_uri(QUEUE *me, URI *uristr);
 static int db_add_uristr(QUEUE *me, const char *uristr);
+static int db_add_uristrs(QUEUE *me, const char **uristrs, size_t count);
 static int db_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl);
 static int db_updated_uristr(QUEUE *me, const char *uri, time_t updated, time_t last_modified, int status, time_t ttl);
 static int db_unchanged_uri(QUEUE *me, URI *uri, int error);
 static int db_unchanged_uristr(QUEUE *me, const char *uristr, int error);
+static int db_stage_(QUEUE *me, const char *uristr, struct db_outcome *outcome);
+static long db_commit_due_(QUEUE *me);
+static int db_commit_(QUEUE *me);
+static int db_commit_txn_(SQL *db, void *userdata);
+static int db_outcome_apply_(QUEUE *me, SQL *db, struct db_outcome *outcome);
 static int db_insert_resource(QUEUE *me, const char *cachekey, uint32_t shortkey, const char *uri, const char *rootkey);
 static int db_insert_root(QUEUE *me, const char *rootkey, const char *uri);
 static int db_insert_resource_txn(SQL *db, void *userdata);
+static int db_uri_depth_(const char *uri);
 static int db_insert_root_txn(SQL *db, void *userdata);
+static int db_insert_batch_txn_(SQL *db, void *userdata);
+static int db_insert_safe_(CRAWLCANON *canon);
+static int db_append_(struct db_buffer *buf, const char *fmt, ...);
+static int db_append_hex_(struct db_buffer *buf, const unsigned char *s);
+static int db_prepare_(QUEUE *me, SQL *db, int stmt);
+static int db_run_(QUEUE *me, SQL *db, int stmt, SQL_STATEMENT **rs, const char *types, va_list ap);
+static int db_execute_(QUEUE *me, SQL *db, int stmt, const char *types, ...);
+static SQL_STATEMENT *db_query_(QUEUE *me, SQL *db, int stmt, const char *types, ...);
 static int db_log_query(SQL *restrict db, const char *restrict statement);
 static int db_log_error(SQL *restrict db, const char *restrict sqlstate, const char *restrict message);
 
@@ -54,7 +153,195 @@ static struct queue_api_struct db_api = {
 	db_updated_uri,
 	db_updated_uristr,
 	db_unchanged_uri,
-	db_unchanged_uristr
+	db_unchanged_uristr,
+	db_due,
+	db_add_uristrs
+};
+
+/* The statements which are executed repeatedly are prepared once for each
+ * connection and executed with parameters; see db_run_(). Where a statement
+ * contains %s, it's replaced by the refresh priority clause.
+ */
+enum
+{
+	STMT_DUE,
+	STMT_STEALABLE,
+	STMT_FILL,
+	STMT_FILL_REFRESH,
+	STMT_STEAL,
+	STMT_RESOURCE_FIND,
+	STMT_RESOURCE_INSERT,
+	STMT_RESOURCE_RELINK,
+	STMT_RESOURCE_REKEY,
+	STMT_RESOURCE_DELETE,
+	STMT_ROOT_FIND,
+	STMT_ROOT_INSERT,
+	STMT_UPDATED,
+	STMT_UPDATED_STATUS,
+	STMT_UNCHANGED,
+	STMT_UNCHANGED_ERROR,
+	STMT_COUNT
+};
+
+/* Follows the assignment of status in an update: a 4xx response counts as a
+ * hard error and a 5xx as a soft one; anything else resets both counts
+ */
+#define STMT_ERROR_COUNTS \
+	"\"error_count\" = IF(\"status\" >= 400 AND \"status\" < 499, \"error_count\" + 1, 0), " \
+	"\"soft_error_count\" = IF(\"status\" >= 500 AND \"status\" < 599, \"soft_error_count\" + 1, " \
+	"IF(\"status\" >= 400 AND \"status\" < 499, \"soft_error_count\", 0)), "
+
+/* The number of seconds until a root may next be fetched from, which may
+ * have been pushed back by another crawler fetching from it
+ */
+#define STMT_ROOT_DEFER \
+	"IFNULL(GREATEST(TIMESTAMPDIFF(SECOND, NOW(), \"root\".\"earliest_update\"), 0), 0) "
+
+static const char *db_statements[STMT_COUNT] = {
+	/* STMT_DUE: crawl_bucket, lane, crawl_bucket, lane
+	 *
+	 * The earliest of each lane, so that each is read from the start of
+	 * crawl_resource_lane_due rather than by scanning the whole bucket
+	 */
+	"SELECT TIMESTAMPDIFF(SECOND, NOW(), MIN(\"due\".\"next_fetch\")) "
+	" FROM ("
+	"  (SELECT \"next_fetch\" FROM \"crawl_resource\" "
+	"   WHERE \"crawl_bucket\" = ? AND \"lane\" = ? AND "
+	"   (\"crawl_instance\" IS NULL OR \"lease_expires\" < NOW()) "
+	"   ORDER BY \"next_fetch\" ASC LIMIT 1) "
+	"  UNION ALL "
+	"  (SELECT \"next_fetch\" FROM \"crawl_resource\" "
+	"   WHERE \"crawl_bucket\" = ? AND \"lane\" = ? AND "
+	"   (\"crawl_instance\" IS NULL OR \"lease_expires\" < NOW()) "
+	"   ORDER BY \"next_fetch\" ASC LIMIT 1) "
+	" ) \"due\"",
+	/* STMT_STEALABLE: crawl_bucket, grace */
+	"SELECT 1 "
+	" FROM \"crawl_resource\" "
+	" WHERE "
+	" \"crawl_bucket\" <> ? AND "
+	" (\"crawl_instance\" IS NULL OR \"lease_expires\" < NOW()) AND "
+	" \"next_fetch\" < DATE_SUB(NOW(), INTERVAL ? SECOND) "
+	" LIMIT 1",
+	/* STMT_FILL: crawl_bucket, lane, limit, offset
+	 *
+	 * Read in crawl_resource_lane_priority order, so that the scan stops
+	 * once it has enough; resources are due as soon as they're discovered,
+	 * so few are passed over
+	 */
+	"SELECT \"res\".\"uri\", LOWER(HEX(\"res\".\"hash\")), LOWER(HEX(\"res\".\"root\")), \"root\".\"rate\", "
+	STMT_ROOT_DEFER
+	" FROM "
+	" \"crawl_resource\" \"res\", \"crawl_root\" \"root\" "
+	" WHERE "
+	" \"res\".\"crawl_bucket\" = ? AND "
+	" \"res\".\"lane\" = ? AND "
+	" (\"res\".\"crawl_instance\" IS NULL OR \"res\".\"lease_expires\" < NOW()) AND "
+	" \"root\".\"hash\" = \"res\".\"root\" AND "
+	" \"res\".\"next_fetch\" < NOW() "
+	" ORDER BY \"res\".\"priority\" DESC "
+	" LIMIT ? OFFSET ? "
+	" FOR UPDATE",
+	/* STMT_FILL_REFRESH: crawl_bucket, lane, window, limit, offset
+	 *
+	 * Most of the refresh lane isn't due, so rather than pass over it in
+	 * order of priority, the most overdue are read from
+	 * crawl_resource_lane_due and only those are sorted
+	 */
+	"SELECT \"res\".\"uri\", LOWER(HEX(\"res\".\"hash\")), LOWER(HEX(\"res\".\"root\")), \"root\".\"rate\", "
+	STMT_ROOT_DEFER
+	" FROM "
+	" (SELECT \"hash\" FROM \"crawl_resource\" "
+	"  WHERE \"crawl_bucket\" = ? AND \"lane\" = ? AND \"next_fetch\" < NOW() AND "
+	"  (\"crawl_instance\" IS NULL OR \"lease_expires\" < NOW()) "
+	"  ORDER BY \"next_fetch\" ASC LIMIT ?) \"due\", "
+	" \"crawl_resource\" \"res\", \"crawl_root\" \"root\" "
+	" WHERE "
+	" \"res\".\"hash\" = \"due\".\"hash\" AND "
+	" (\"res\".\"crawl_instance\" IS NULL OR \"res\".\"lease_expires\" < NOW()) AND "
+	" \"root\".\"hash\" = \"res\".\"root\" "
+	" ORDER BY \"res\".\"priority\" DESC, \"res\".\"next_fetch\" ASC "
+	" LIMIT ? OFFSET ? "
+	" FOR UPDATE",
+	/* STMT_STEAL: crawl_bucket, grace, limit */
+	"SELECT \"res\".\"uri\", LOWER(HEX(\"res\".\"hash\")), LOWER(HEX(\"res\".\"root\")), \"root\".\"rate\", "
+	STMT_ROOT_DEFER
+	" FROM "
+	" \"crawl_resource\" \"res\", \"crawl_root\" \"root\" "
+	" WHERE "
+	" \"res\".\"crawl_bucket\" <> ? AND "
+	" (\"res\".\"crawl_instance\" IS NULL OR \"res\".\"lease_expires\" < NOW()) AND "
+	" \"root\".\"hash\" = \"res\".\"root\" AND "
+	" \"res\".\"next_fetch\" < DATE_SUB(NOW(), INTERVAL ? SECOND) "
+	" ORDER BY \"res\".\"next_fetch\" ASC "
+	" LIMIT ? "
+	" FOR UPDATE",
+	/* STMT_RESOURCE_FIND: hash */
+	"SELECT \"hash\" FROM \"crawl_resource\" WHERE \"hash\" = ?",
+	/* STMT_RESOURCE_INSERT: hash, shorthash, crawl_bucket, cache_bucket,
+	 * root, uri, depth, priority
+	 */
+	"INSERT INTO \"crawl_resource\" (\"hash\", \"shorthash\", \"crawl_bucket\", \"cache_bucket\", \"root\", \"uri\", \"depth\", \"priority\", \"added\", \"next_fetch\") VALUES (?, ?, ?, ?, ?, ?, ?, ?, NOW(), NOW())",
+	/* STMT_RESOURCE_RELINK: crawl_bucket, cache_bucket, inlink max, inlink
+	 * weight, hash
+	 */
+	"UPDATE \"crawl_resource\" SET \"crawl_bucket\" = ?, \"cache_bucket\" = ?, \"priority\" = \"priority\" + IF(\"inlinks\" < ?, ?, 0), \"inlinks\" = \"inlinks\" + 1 WHERE \"hash\" = ?",
+	/* STMT_RESOURCE_REKEY: hash, shorthash, crawl_bucket, cache_bucket,
+	 * root, uri, old hash
+	 *
+	 * Ignored if there's already a row with the new key, in which case
+	 * STMT_RESOURCE_DELETE removes the old one
+	 */
+	"UPDATE IGNORE \"crawl_resource\" SET \"hash\" = ?, \"shorthash\" = ?, \"crawl_bucket\" = ?, \"cache_bucket\" = ?, \"root\" = ?, \"uri\" = ? WHERE \"hash\" = ?",
+	/* STMT_RESOURCE_DELETE: hash */
+	"DELETE FROM \"crawl_resource\" WHERE \"hash\" = ?",
+	/* STMT_ROOT_FIND: hash */
+	"SELECT \"hash\" FROM \"crawl_root\" WHERE \"hash\" = ?",
+	/* STMT_ROOT_INSERT: hash, uri */
+	"INSERT INTO \"crawl_root\" (\"hash\", \"uri\", \"added\", \"earliest_update\", \"rate\") VALUES (?, ?, NOW(), NOW(), 1000)",
+	/* STMT_UPDATED: updated, last_modified, status, revisit-min, default
+	 * interval, freshness, revisit-max, hash
+	 */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?, \"last_modified\" = ?, \"status\" = ?, "
+	STMT_ERROR_COUNTS
+	"\"change_interval\" = GREATEST(?, IF(\"change_interval\" = 0, ?, \"change_interval\" DIV 2)), "
+	"\"freshness\" = ?, "
+	"\"next_fetch\" = DATE_ADD(NOW(), INTERVAL LEAST(?, GREATEST(\"change_interval\", \"freshness\")) SECOND), "
+	"%s, \"crawl_instance\" = NULL, \"lease_expires\" = NULL WHERE \"hash\" = ?",
+	/* STMT_UPDATED_STATUS: updated, last_modified, status, next_fetch, hash */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?, \"last_modified\" = ?, \"status\" = ?, "
+	STMT_ERROR_COUNTS
+	"\"next_fetch\" = ?, %s, \"crawl_instance\" = NULL, \"lease_expires\" = NULL WHERE \"hash\" = ?",
+	/* STMT_UNCHANGED: updated, revisit-min, revisit-max, default interval,
+	 * revisit-max, hash
+	 */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?, "
+	"\"change_interval\" = GREATEST(?, LEAST(?, IF(\"change_interval\" = 0, ?, \"change_interval\" + \"change_interval\" DIV 2))), "
+	"\"next_fetch\" = DATE_ADD(NOW(), INTERVAL LEAST(?, GREATEST(\"change_interval\", \"freshness\")) SECOND), "
+	"%s, \"crawl_instance\" = NULL, \"lease_expires\" = NULL, \"error_count\" = 0 WHERE \"hash\" = ?",
+	/* STMT_UNCHANGED_ERROR: updated, next_fetch, hash */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?, \"next_fetch\" = ?, %s, \"crawl_instance\" = NULL, \"lease_expires\" = NULL, \"error_count\" = \"error_count\" + 1 WHERE \"hash\" = ?"
+};
+
+struct db_buffer
+{
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* The outcome of a fetch, staged until it's committed */
+struct db_outcome
+{
+	int unchanged;
+	int status;
+	int error;
+	time_t updated;
+	time_t last_modified;
+	time_t next_fetch;
+	time_t ttl;
+	char key[(DB_KEY_LEN * 2) + 1];
+	char rootkey[(DB_KEY_LEN * 2) + 1];
 };
 
 struct queue_struct
@@ -68,8 +355,31 @@ struct queue_struct
 	int cache_id;
 	int ncrawlers;
 	int ncaches;
-	char *buf;
-	size_t buflen;
+	SCHED *sched;
+	uint64_t lastfill;
+	unsigned long fillgen;
+	int filled;
+	int lease;
+	time_t renewed;
+	int steal;
+	int revisit_min;
+	int revisit_max;
+	int discovery;
+	/* The SET clause which recalculates a refreshed resource's priority */
+	char refresh_priority[256];
+	char *snapshot;
+	int snapshot_interval;
+	time_t snapshotted;
+	/* Which statements have been prepared on this connection */
+	unsigned char prepared[STMT_COUNT];
+	struct db_buffer stmtbuf;
+	/* Fetch outcomes waiting to be committed */
+	struct db_outcome *outcomes;
+	int noutcomes;
+	int commit_batch;
+	int commit_interval;
+	uint64_t pending_since;
+	struct db_buffer commitbuf;
 };
 
 struct resource_insert
@@ -81,6 +391,56 @@ struct resource_insert
 	const char *rootkey;
 };
 
+struct fill_entry
+{
+	char *uri;
+	char root[SCHED_KEY_LEN + 1];
+	int rate;
+	/* Seconds until the root may be fetched from */
+	int defer;
+};
+
+/* A queue entry whose key isn't that of its canonical URI */
+struct fill_stale
+{
+	char key[(DB_KEY_LEN * 2) + 1];
+	CRAWLCANON *canon;
+};
+
+struct fill_batch
+{
+	QUEUE *me;
+	int count;
+	struct fill_entry entries[FILL_BATCH_SIZE];
+	int nstale;
+	struct fill_stale stale[FILL_BATCH_SIZE];
+	/* Each key is quoted and followed by a comma */
+	char keys[(FILL_BATCH_SIZE * (SCHED_KEY_LEN + 4)) + 1];
+};
+
+struct snapshot_load
+{
+	QUEUE *me;
+	FILE *f;
+	long start;
+	int count;
+	/* The keys of the resources leased to this crawler, sorted */
+	char (*leased)[(DB_KEY_LEN * 2) + 1];
+	size_t nleased;
+	size_t size;
+	/* The keys of those being kept, each quoted and followed by a comma */
+	struct db_buffer kept;
+};
+
+struct insert_batch
+{
+	QUEUE *me;
+	size_t count;
+	CRAWLCANON **canon;
+	/* The statement being built */
+	struct db_buffer sql;
+};
+
 struct root_insert
 {
 	QUEUE *me;
@@ -92,6 +452,7 @@ QUEUE *
 db_create(CONTEXT *ctx)
 {
 	QUEUE *p;
+	const char *s;
 	
 	p = (QUEUE *) calloc(1, sizeof(QUEUE));
 	if(!p)
@@ -118,9 +479,99 @@ db_create(CONTEXT *ctx)
 		free(p);
 		return NULL;
 	}	
+	p->lease = config_get_int("db:lease", LEASE_DEFAULT_DURATION);
+	if(p->lease < 1)
+	{
+		p->lease = LEASE_DEFAULT_DURATION;
+	}
+	/* steal is the grace period for other crawlers' work, or 0 if it
+	 * shouldn't be taken at all
+	 */
+	p->steal = config_get_int("db:steal", STEAL_DEFAULT_GRACE);
+	if(p->steal < 0)
+	{
+		p->steal = 0;
+	}
+	/* The interval between fetches of a successfully-fetched resource is
+	 * adjusted according to how often it changes, within these bounds
+	 */
+	p->revisit_min = config_get_int("db:revisit-min", REVISIT_DEFAULT_MIN);
+	if(p->revisit_min < 1)
+	{
+		p->revisit_min = REVISIT_DEFAULT_MIN;
+	}
+	p->revisit_max = config_get_int("db:revisit-max", REVISIT_DEFAULT_MAX);
+	if(p->revisit_max < p->revisit_min)
+	{
+		p->revisit_max = p->revisit_min;
+	}
+	p->discovery = config_get_int("db:discovery", DISCOVERY_DEFAULT_SHARE);
+	if(p->discovery < 0 || p->discovery > 100)
+	{
+		p->discovery = DISCOVERY_DEFAULT_SHARE;
+	}
+	/* This follows the assignment of change_interval, if any, and so sees
+	 * its new value
+	 */
+	snprintf(p->refresh_priority, sizeof(p->refresh_priority),
+		"\"lane\" = %d, "
+		"\"priority\" = LEAST(\"inlinks\", %d) * %d - \"depth\" * %d + "
+		"FLOOR(LOG2(%d / IF(\"change_interval\" = 0, %d, \"change_interval\"))) * %d",
+		LANE_REFRESH, PRIORITY_INLINK_MAX, PRIORITY_INLINK_WEIGHT, PRIORITY_DEPTH_WEIGHT,
+		p->revisit_max, REVISIT_DEFAULT_INTERVAL, PRIORITY_CHANGE_WEIGHT);
+	/* If a snapshot directory is configured, the scheduler's contents are
+	 * written to it periodically and on shutdown, and reloaded on startup
+	 */
+	s = ctx->api->config_get(ctx, "db:snapshot", NULL);
+	if(s && s[0])
+	{
+		p->snapshot = (char *) malloc(strlen(s) + 32);
+		if(!p->snapshot)
+		{
+			free(p);
+			return NULL;
+		}
+		sprintf(p->snapshot, "%s/crawler-%d.snapshot", s, p->crawler_id);
+	}
+	p->snapshot_interval = config_get_int("db:snapshot-interval", SNAPSHOT_DEFAULT_INTERVAL);
+	if(p->snapshot_interval < 1)
+	{
+		p->snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;
+	}
+	/* The outcomes of fetches are committed in batches, rather than each
+	 * in a transaction of its own
+	 */
+	p->commit_batch = config_get_int("db:commit-batch", COMMIT_DEFAULT_BATCH);
+	if(p->commit_batch < 1)
+	{
+		p->commit_batch = 1;
+	}
+	p->commit_interval = config_get_int("db:commit-interval", COMMIT_DEFAULT_INTERVAL);
+	if(p->commit_interval < 0)
+	{
+		p->commit_interval = 0;
+	}
+	p->outcomes = (struct db_outcome *) calloc(p->commit_batch, sizeof(struct db_outcome));
+	if(!p->outcomes)
+	{
+		free(p->snapshot);
+		free(p);
+		return NULL;
+	}
+	p->sched = sched_create();
+	if(!p->sched)
+	{
+		free(p->outcomes);
+		free(p->snapshot);
+		free(p);
+		return NULL;
+	}
 	p->db = sql_connect(ctx->api->config_get(ctx, "db:uri", "mysql://localhost/crawl"));
 	if(!p->db)
 	{
+		sched_destroy(p->sched);
+		free(p->outcomes);
+		free(p->snapshot);
 		free(p);
 		return NULL;
 	}
@@ -137,6 +588,22 @@ db_create(CONTEXT *ctx)
 	{
 		log_printf(LOG_CRIT, "DB: Database migration failed\n");
 		sql_disconnect(p->db);
+		sched_destroy(p->sched);
+		free(p->outcomes);
+		free(p->snapshot);
+		free(p);
+		return NULL;
+	}
+	/* Any resources still leased to this crawler were held by a previous
+	 * incarnation of it: if it left a snapshot, carry on where it left off;
+	 * otherwise, hand them back
+	 */
+	if(db_snapshot_load_(p) < 1 && (!p->sched || db_release_leases_(p)))
+	{
+		sql_disconnect(p->db);
+		sched_destroy(p->sched);
+		free(p->outcomes);
+		free(p->snapshot);
 		free(p);
 		return NULL;
 	}
@@ -171,7 +638,7 @@ db_migrate(SQL *restrict sql, const char *identifier, int newversion, void *rest
 	if(newversion == 0)
 	{
 		/* Return target version */
-		return 2;
+		return 7;
 	}
 	log_printf(LOG_NOTICE, "DB: Migrating database to version %d\n", newversion);
 	if(newversion == 1)
@@ -230,6 +697,93 @@ db_migrate(SQL *restrict sql, const char *identifier, int newversion, void *rest
 		}
 		return 0;
 	}
+	if(newversion == 3)
+	{
+		if(sql_execute(sql, "ALTER TABLE \"crawl_resource\" "
+			"ADD \"lease_expires\" DATETIME DEFAULT NULL COMMENT 'Time at which the lease held by crawl_instance expires' AFTER \"crawl_instance\","
+			"ADD KEY \"crawl_resource_lease_expires\" (\"lease_expires\")"))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 4)
+	{
+		if(sql_execute(sql, "ALTER TABLE \"crawl_resource\" "
+			"ADD \"change_interval\" INT NOT NULL DEFAULT 0 COMMENT 'Estimated interval between changes in seconds' AFTER \"next_fetch\","
+			"ADD \"freshness\" INT NOT NULL DEFAULT 0 COMMENT 'Freshness lifetime from Cache-Control or Expires in seconds' AFTER \"change_interval\""))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 5)
+	{
+		if(sql_execute(sql, "ALTER TABLE \"crawl_resource\" "
+			"ADD \"lane\" TINYINT NOT NULL DEFAULT 0 COMMENT '0 if never fetched, 1 if being refreshed' AFTER \"crawl_instance\","
+			"ADD \"depth\" INT NOT NULL DEFAULT 0 COMMENT 'Number of path segments in the URI' AFTER \"uri\","
+			"ADD \"inlinks\" INT NOT NULL DEFAULT 0 COMMENT 'Number of times the resource has been discovered again' AFTER \"depth\","
+			"ADD \"priority\" INT NOT NULL DEFAULT 0 COMMENT 'Fetch priority, highest first' AFTER \"inlinks\","
+			"ADD KEY \"crawl_resource_lane_priority\" (\"crawl_bucket\", \"lane\", \"priority\")"))
+		{
+			return -1;
+		}
+		/* Anything which has been fetched before is being refreshed */
+		if(sql_execute(sql, "UPDATE \"crawl_resource\" SET \"lane\" = 1 WHERE \"updated\" IS NOT NULL"))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 6)
+	{
+		/* Indexes which match the queue queries, so that each is a
+		 * bounded range scan of one lane of one bucket; the index on
+		 * crawl_bucket alone is a prefix of both
+		 */
+		if(sql_execute(sql, "ALTER TABLE \"crawl_resource\" "
+			"DROP KEY \"crawl_resource_crawl_bucket\","
+			"ADD KEY \"crawl_resource_lane_due\" (\"crawl_bucket\", \"lane\", \"next_fetch\")"))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 7)
+	{
+		/* Store keys as the 16 bytes of the digest rather than as 32 hex
+		 * digits in utf8, which InnoDB reserves 96 bytes for in every
+		 * index; the old columns are copied and then replaced
+		 */
+		if(sql_execute(sql, "ALTER TABLE \"crawl_root\" "
+			"ADD \"hash_bin\" BINARY(16) NOT NULL AFTER \"hash\"") ||
+			sql_execute(sql, "UPDATE \"crawl_root\" SET \"hash_bin\" = UNHEX(\"hash\")") ||
+			sql_execute(sql, "ALTER TABLE \"crawl_root\" "
+			"DROP PRIMARY KEY,"
+			"DROP \"hash\","
+			"CHANGE \"hash_bin\" \"hash\" BINARY(16) NOT NULL COMMENT 'Truncated SHA-256 of canonical root URI',"
+			"ADD PRIMARY KEY (\"hash\")"))
+		{
+			return -1;
+		}
+		if(sql_execute(sql, "ALTER TABLE \"crawl_resource\" "
+			"ADD \"hash_bin\" BINARY(16) NOT NULL AFTER \"hash\","
+			"ADD \"root_bin\" BINARY(16) NOT NULL AFTER \"root\"") ||
+			sql_execute(sql, "UPDATE \"crawl_resource\" SET \"hash_bin\" = UNHEX(\"hash\"), \"root_bin\" = UNHEX(\"root\")") ||
+			sql_execute(sql, "ALTER TABLE \"crawl_resource\" "
+			"DROP PRIMARY KEY,"
+			"DROP KEY \"crawl_resource_root\","
+			"DROP \"hash\","
+			"DROP \"root\","
+			"CHANGE \"hash_bin\" \"hash\" BINARY(16) NOT NULL COMMENT 'Truncated SHA-256 of canonical URI',"
+			"CHANGE \"root_bin\" \"root\" BINARY(16) NOT NULL COMMENT 'Truncated SHA-256 of canonical root URI',"
+			"ADD PRIMARY KEY (\"hash\"),"
+			"ADD KEY \"crawl_resource_root\" (\"root\")"))
+		{
+			return -1;
+		}
+		return 0;
+	}
 	return -1;
 }
 
@@ -248,63 +802,90 @@ db_release(QUEUE *me)
 	{
 		if(me->db)
 		{
+			db_commit_(me);
+			/* Hand back anything which was loaded but not fetched,
+			 * unless it's been saved for next time
+			 */
+			if(!me->snapshot || db_snapshot_save_(me))
+			{
+				db_release_leases_(me);
+			}
 			sql_disconnect(me->db);
 		}
-		free(me->buf);
+		sched_destroy(me->sched);
+		free(me->stmtbuf.buf);
+		free(me->commitbuf.buf);
+		free(me->outcomes);
+		free(me->snapshot);
 		free(me);
 		return 0;
 	}
 	return me->refcount;
 }
 
+/* Obtain the next URI whose root is ready to be fetched from; politeness is
+ * enforced by the scheduler, which is topped up from the database in batches
+ */
 static int
 db_next(QUEUE *me, URI **next)
 {
-	SQL_STATEMENT *rs;
-	size_t needed;
-	char *p;
+	char *uristr;
+	uint64_t now, wait;
+	unsigned long gen;
+	int r;
 	
 	*next = NULL;
-	rs = sql_queryf(me->db,
-		"SELECT \"res\".\"uri\" "
-		" FROM "
-		" \"crawl_resource\" \"res\", \"crawl_root\" \"root\" "
-		" WHERE "
-		" \"res\".\"crawl_bucket\" = %d AND "
-		" \"root\".\"hash\" = \"res\".\"root\" AND "
-		" \"root\".\"earliest_update\" < NOW() AND "
-		" \"res\".\"next_fetch\" < NOW() "
-		" ORDER BY \"root\".\"earliest_update\" ASC, \"res\".\"next_fetch\" ASC", me->crawler_id);
-	if(!rs)
+	db_commit_due_(me);
+	if(db_renew_leases_(me))
 	{
-		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
-		exit(1);
+		return -1;
 	}
-	if(sql_stmt_eof(rs))
+	if(me->snapshot && time(NULL) - me->snapshotted >= me->snapshot_interval)
 	{
-		log_printf(LOG_DEBUG, "db_next: queue query returned no results\n");
-		sql_stmt_destroy(rs);
-		return 0;
+		db_snapshot_save_(me);
 	}
-	needed = sql_stmt_value(rs, 0, NULL, 0);
-	if(needed > me->buflen)
+	for(;;)
 	{
-		p = (char *) realloc(me->buf, needed + 1);
-		if(!p)
+		if(!sched_next(me->sched, &uristr, &wait))
 		{
-			sql_stmt_destroy(rs);
-			return -1;
+			/* Only query for more resources when the scheduler is running low,
+			 * and not more often than every FILL_INTERVAL milliseconds unless
+			 * the last query returned a full batch or URIs have been added since
+			 */
+			now = sched_now();
+			gen = queue_generation();
+			if(sched_pending(me->sched) >= FILL_BATCH_SIZE / 2 ||
+				(me->filled < FILL_BATCH_SIZE && gen == me->fillgen && now - me->lastfill < FILL_INTERVAL))
+			{
+				return 0;
+			}
+			me->lastfill = now;
+			me->fillgen = gen;
+			r = db_fill_(me);
+			if(r < 0)
+			{
+				return -1;
+			}
+			me->filled = r;
+			if(!sched_next(me->sched, &uristr, &wait))
+			{
+				log_printf(LOG_DEBUG, "db_next: no resources are ready to be fetched\n");
+				return 0;
+			}
 		}
-		me->buf = p;
-		me->buflen = needed + 1;
-	}
-	if(sql_stmt_value(rs, 0, me->buf, me->buflen) != needed)
-	{
-		sql_stmt_destroy(rs);
-		return -1;
+		/* Don't hand out resources on hosts which are known not to
+		 * resolve; treat them as having failed without fetching them
+		 */
+		if(!crawl_resolve_failed(uristr))
+		{
+			break;
+		}
+		log_printf(LOG_DEBUG, "db_next: skipping <%s> (host does not resolve)\n", uristr);
+		db_unchanged_uristr(me, uristr, 1);
+		free(uristr);
 	}
-	*next = uri_create_str(me->buf, NULL);
-	sql_stmt_destroy(rs);
+	*next = uri_create_str(uristr, NULL);
+	free(uristr);
 	if(!*next)
 	{
 		return -1;
@@ -312,203 +893,749 @@ db_next(QUEUE *me, URI **next)
 	return 0;
 }
 
-static int
-db_uristr_key_root(QUEUE *me, const char *uristr, char **uri, char *urikey, uint32_t *shortkey, char **root, char *rootkey)
+/* Obtain the number of milliseconds until db_next() is expected to have
+ * something to return, or -1 if there is nothing waiting to be fetched;
+ * if fetch outcomes are waiting to be committed, this is no later than
+ * they're due to be
+ */
+static long
+db_due(QUEUE *me)
 {
-	URI *u_resource, *u_root;
-	char *str, *t;
-	char skey[9];
+	long due, commit;
 	
-	str = strdup(uristr);
-	if(!str)
+	commit = db_commit_due_(me);
+	db_renew_leases_(me);
+	due = db_due_(me);
+	if(commit >= 0 && (due < 0 || commit < due))
 	{
-		free(str);
-		return -1;
-	}
-	t = strchr(str, '#');
-	if(t)
-	{
-		*t = 0;
+		return commit;
 	}
-	u_resource = uri_create_str(str, NULL);
-	if(!u_resource)
+	return due;
+}
+
+static long
+db_due_(QUEUE *me)
+{
+	SQL_STATEMENT *rs;
+	uint64_t now;
+	long due, fill;
+	char buf[32];
+	
+	if(sched_pending(me->sched))
 	{
-		free(str);
-		return -1;
+		return (long) sched_wait(me->sched);
 	}
-	/* Ensure we have the canonical form of the URI */
-	free(str);
-	str = uri_stralloc(u_resource);
-	if(!str)
+	rs = db_query_(me, me->db, STMT_DUE, "dddd", me->crawler_id, LANE_DISCOVERY, me->crawler_id, LANE_REFRESH);
+	if(!rs)
 	{
-		uri_destroy(u_resource);
-		return -1;
+		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
+		exit(1);
 	}
-	if(uri)
+	if(sql_stmt_eof(rs) || !sql_stmt_value(rs, 0, NULL, 0) ||
+		sql_stmt_value(rs, 0, buf, sizeof(buf)) >= sizeof(buf))
 	{
-		*uri = str;
+		/* MIN() of no rows is NULL */
+		due = -1;
 	}
-	if(crawl_cache_key(me->crawl, str, urikey, 48))
+	else
 	{
-		uri_destroy(u_resource);
-		free(str);
-		return -1;
+		due = atol(buf);
+		/* next_fetch must have passed before a resource is returned */
+		due = (due < 0 ? 0 : (due + 1) * 1000);
 	}
-	strncpy(skey, urikey, 8);
-	skey[8] = 0;
-	*shortkey = (uint32_t) strtoul(skey, NULL, 16);
-	
-	u_root = uri_create_str("/", u_resource);
-	if(crawl_cache_key_uri(me->crawl, u_root, rootkey, 48))
+	sql_stmt_destroy(rs);
+	if(due && me->steal)
 	{
-		uri_destroy(u_resource);
-		uri_destroy(u_root);
-		free(str);
-		return -1;		
+		/* Check whether there's work which could be taken from other
+		 * crawlers
+		 */
+		rs = db_query_(me, me->db, STMT_STEALABLE, "dd", me->crawler_id, me->steal);
+		if(!rs)
+		{
+			log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
+			exit(1);
+		}
+		if(!sql_stmt_eof(rs))
+		{
+			due = 0;
+		}
+		sql_stmt_destroy(rs);
 	}
-	if(root)
+	if(due < 0)
 	{
-		*root = uri_stralloc(u_root);
+		return -1;
 	}
-	if(!uri)
+	now = sched_now();
+	if(now - me->lastfill < FILL_INTERVAL)
 	{
-		free(str);
+		fill = (long) (FILL_INTERVAL - (now - me->lastfill));
+		if(fill > due)
+		{
+			due = fill;
+		}
 	}
-	uri_destroy(u_resource);
-	uri_destroy(u_root);
-	return 0;
+	return due;
 }
 
+/* Lease a batch of resources which are due to be fetched and load them into
+ * the scheduler, returning the number loaded
+ */
 static int
-db_add_uri(QUEUE *me, URI *uri)
+db_fill_(QUEUE *me)
 {
-	char *uristr;
-	int r;
+	struct fill_batch *batch;
+	int c, count;
 	
-	uristr = uri_stralloc(uri);
-	if(!uristr)
+	batch = (struct fill_batch *) calloc(1, sizeof(struct fill_batch));
+	if(!batch)
 	{
 		return -1;
 	}
-	r = db_add_uristr(me, uristr);
-	free(uristr);
-	return r;
-}
-
-static int
-db_add_uristr(QUEUE *me, const char *uristr)
-{
-	char *canonical, *root;
-	char cachekey[48], rootkey[48];
-	uint32_t shortkey;
-	
-	if(db_uristr_key_root(me, uristr, &canonical, cachekey, &shortkey, &root, rootkey))
+	batch->me = me;
+	if(sql_perform(me->db, db_fill_txn_, batch, TXN_MAX_RETRIES))
 	{
-		return -1;
+		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
+		exit(1);
 	}
-	
-	db_insert_resource(me, cachekey, shortkey, canonical, rootkey);
-	db_insert_root(me, rootkey, root);
-	
-	free(root);
-	free(canonical);
-	return 0;
-	
-}
-
-static int
-db_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl)
-{
-	char *uristr;
-	int r;
-	
-	uristr = uri_stralloc(uri);
-	if(!uristr)
+	for(c = 0; c < batch->nstale; c++)
 	{
-		return -1;
+		/* A re-keyed entry's root may not have been seen before */
+		db_insert_root(me, batch->stale[c].canon->rootkey, batch->stale[c].canon->root);
 	}
-	r = db_updated_uristr(me, uristr, updated, last_modified, status, ttl);
-	free(uristr);
-	return r;
+	for(c = 0; c < batch->count; c++)
+	{
+		/* Honour fetches from the root by other crawlers; fetches by this
+		 * process are already accounted for by the scheduler
+		 */
+		if((batch->entries[c].defer && sched_defer(batch->entries[c].root, (uint64_t) batch->entries[c].defer * 1000)) ||
+			sched_add(me->sched, batch->entries[c].root, batch->entries[c].rate, batch->entries[c].uri))
+		{
+			db_fill_reset_(batch);
+			free(batch);
+			return -1;
+		}
+		/* Resolve the host while the resource waits its turn */
+		crawl_resolve_prefetch(batch->entries[c].uri);
+	}
+	count = batch->count;
+	if(batch->nstale)
+	{
+		log_printf(LOG_NOTICE, "db_next: re-keyed %d resources\n", batch->nstale);
+	}
+	db_fill_reset_(batch);
+	free(batch);
+	log_printf(LOG_DEBUG, "db_next: leased %d resources\n", count);
+	return count;
 }
 
+/* A transaction callback returns 0 for commit, -1 for rollback and retry, 1 for rollback successfully */
 static int
-db_updated_uristr(QUEUE *me, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl)
+db_fill_txn_(SQL *db, void *userdata)
 {
-	char *canonical, *root;
-	char cachekey[48], rootkey[48], updatedstr[32], lastmodstr[32], nextfetchstr[32];
-	uint32_t shortkey;
-	struct tm tm;
-	time_t now;
+	struct fill_batch *batch;
+	SQL_STATEMENT *rs;
+	size_t keylen;
+	int limit, share, discovered, r;
 	
-	if(db_uristr_key_root(me, uristr, &canonical, cachekey, &shortkey, &root, rootkey))
+	batch = (struct fill_batch *) userdata;
+	/* Discard anything from a previous attempt */
+	db_fill_reset_(batch);
+	keylen = 0;
+	/* Fill the discovery lane's share of the batch, then as much of the
+	 * rest as the refresh lane can; if that falls short, the discovery lane
+	 * may have more
+	 */
+	share = (FILL_BATCH_SIZE * batch->me->discovery) / 100;
+	if(share && (r = db_fill_lane_(db, batch, LANE_DISCOVERY, share, 0, &keylen)))
 	{
-		return -1;
+		return r;
 	}
-	gmtime_r(&updated, &tm);
-	strftime(updatedstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	gmtime_r(&last_modified, &tm);
-	strftime(lastmodstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	if(status != 200)
+	discovered = batch->count;
+	if((r = db_fill_lane_(db, batch, LANE_REFRESH, FILL_BATCH_SIZE - batch->count, 0, &keylen)))
 	{
-		if(ttl < 86400)
-		{
-			ttl = 86400;
-		}
+		return r;
 	}
-	else
+	if(batch->count < FILL_BATCH_SIZE && discovered == share &&
+		(r = db_fill_lane_(db, batch, LANE_DISCOVERY, FILL_BATCH_SIZE - batch->count, discovered, &keylen)))
+	{
+		return r;
+	}
+	/* If this crawler is running short of work, take the most overdue
+	 * resources from other buckets, which will be those of crawlers which
+	 * are falling behind; the lease prevents their owners from fetching
+	 * them too
+	 */
+	if(batch->me->steal && batch->count < FILL_BATCH_SIZE / 2)
 	{
-		if(ttl < 3600)
+		limit = FILL_BATCH_SIZE - batch->count;
+		rs = db_query_(batch->me, db, STMT_STEAL, "ddd", batch->me->crawler_id, batch->me->steal, limit);
+		if(!rs)
+		{
+			return (sql_deadlocked(db) ? -1 : -2);
+		}
+		limit = batch->count;
+		if(db_fill_rows_(batch, rs, &keylen))
+		{
+			return -2;
+		}
+		if(batch->count > limit)
 		{
-			ttl = 3600;
+			log_printf(LOG_DEBUG, "db_next: taking %d overdue resources from other crawlers\n", batch->count - limit);
 		}
 	}
-	ttl += time(NULL);
-	gmtime_r(&ttl, &tm);
-	strftime(nextfetchstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"updated\" = %Q, \"last_modified\" = %Q, \"status\" = %d, \"next_fetch\" = %Q, \"crawl_instance\" = NULL WHERE \"hash\" = %Q",
-		updatedstr, lastmodstr, status, nextfetchstr, cachekey))
+	if((r = db_fill_rekey_(db, batch)))
 	{
-		log_printf(LOG_CRIT, "%s\n", sql_error(me->db));
-		exit(1);
+		return r;
 	}
-	now = time(NULL);
-	gmtime_r(&now, &tm);
-	strftime(lastmodstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	now += 2;
-	strftime(nextfetchstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	if(sql_executef(me->db, "UPDATE \"crawl_root\" SET \"last_updated\" = %Q, \"earliest_update\" = %Q WHERE \"hash\" = %Q", lastmodstr, nextfetchstr, rootkey))
+	if(!keylen)
 	{
-		log_printf(LOG_CRIT, "%s\n", sql_error(me->db));
-		exit(1);
+		return 0;
 	}
-	if(status >= 400 && status < 499)
+	/* Drop the trailing comma; the keys have been checked to consist only
+	 * of hex digits, so can be interpolated directly
+	 */
+	batch->keys[keylen - 1] = 0;
+	if(sql_executef(db, "UPDATE \"crawl_resource\" SET \"crawl_instance\" = %d, \"lease_expires\" = DATE_ADD(NOW(), INTERVAL %d SECOND) WHERE \"hash\" IN (%s)",
+		batch->me->crawler_id, batch->me->lease, batch->keys))
 	{
-		if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"error_count\" = \"error_count\" + 1 WHERE \"hash\" = %Q", cachekey))
-		{
-			log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
-			exit(1);
+		return (sql_deadlocked(db) ? -1 : -2);
+	}
+	return 0;
+}
+
+/* Add up to limit resources from one lane to a batch, highest priority
+ * first, skipping the first offset; resources in the refresh lane are chosen
+ * from the FILL_REFRESH_WINDOW most overdue
+ */
+static int
+db_fill_lane_(SQL *db, struct fill_batch *batch, int lane, int limit, int offset, size_t *keylen)
+{
+	SQL_STATEMENT *rs;
+	
+	if(limit < 1)
+	{
+		return 0;
+	}
+	if(lane == LANE_REFRESH)
+	{
+		rs = db_query_(batch->me, db, STMT_FILL_REFRESH, "ddddd", batch->me->crawler_id, lane, FILL_REFRESH_WINDOW, limit, offset);
+	}
+	else
+	{
+		rs = db_query_(batch->me, db, STMT_FILL, "dddd", batch->me->crawler_id, lane, limit, offset);
+	}
+	if(!rs)
+	{
+		return (sql_deadlocked(db) ? -1 : -2);
+	}
+	if(db_fill_rows_(batch, rs, keylen))
+	{
+		return -2;
+	}
+	return 0;
+}
+
+/* Add the rows of a queue query to a batch, then destroy the statement;
+ * rows whose key isn't that of their canonical URI are set aside to be
+ * re-keyed instead
+ */
+static int
+db_fill_rows_(struct fill_batch *batch, SQL_STATEMENT *rs, size_t *keylen)
+{
+	struct fill_entry *entry;
+	CRAWLCANON *canon;
+	size_t needed;
+	char hash[48], rate[16];
+	
+	for(; !sql_stmt_eof(rs) && batch->count < FILL_BATCH_SIZE; sql_stmt_next(rs))
+	{
+		entry = &(batch->entries[batch->count]);
+		needed = sql_stmt_value(rs, 0, NULL, 0);
+		entry->uri = (char *) malloc(needed + 1);
+		if(!entry->uri)
+		{
+			sql_stmt_destroy(rs);
+			return -1;
+		}
+		if(sql_stmt_value(rs, 0, entry->uri, needed + 1) != needed ||
+			sql_stmt_value(rs, 1, hash, sizeof(hash)) != SCHED_KEY_LEN ||
+			sql_stmt_value(rs, 2, entry->root, sizeof(entry->root)) != SCHED_KEY_LEN ||
+			strspn(hash, "0123456789abcdef") != SCHED_KEY_LEN)
+		{
+			log_printf(LOG_ERR, "DB: skipping malformed queue entry\n");
+			free(entry->uri);
+			entry->uri = NULL;
+			continue;
+		}
+		/* Entries added before URIs were canonicalised were keyed by the URI
+		 * as liburi serialised it, which differs for some; left alone, their
+		 * outcomes would be recorded against the new key and they would be
+		 * fetched again each time their lease expired
+		 */
+		canon = crawl_canonicalise(entry->uri);
+		if(canon && strcmp(canon->key, hash))
+		{
+			if(batch->nstale < FILL_BATCH_SIZE)
+			{
+				strcpy(batch->stale[batch->nstale].key, hash);
+				batch->stale[batch->nstale].canon = canon;
+				batch->nstale++;
+			}
+			else
+			{
+				crawl_canonical_destroy(canon);
+			}
+			free(entry->uri);
+			entry->uri = NULL;
+			continue;
+		}
+		crawl_canonical_destroy(canon);
+		if(sql_stmt_value(rs, 3, rate, sizeof(rate)) >= sizeof(rate))
+		{
+			rate[0] = 0;
+		}
+		entry->rate = atoi(rate);
+		if(sql_stmt_value(rs, 4, rate, sizeof(rate)) >= sizeof(rate))
+		{
+			rate[0] = 0;
 		}
+		entry->defer = atoi(rate);
+		batch->keys[*keylen] = 'X';
+		batch->keys[*keylen + 1] = '\'';
+		memcpy(&(batch->keys[*keylen + 2]), hash, SCHED_KEY_LEN);
+		batch->keys[*keylen + 2 + SCHED_KEY_LEN] = '\'';
+		batch->keys[*keylen + 3 + SCHED_KEY_LEN] = ',';
+		*keylen += SCHED_KEY_LEN + 4;
+		batch->count++;
 	}
-	else if(status >= 500 && status < 599)
+	sql_stmt_destroy(rs);
+	return 0;
+}
+
+/* Move the stale entries found while filling a batch to their canonical
+ * keys; they're left unleased, to be picked up by a later fill
+ */
+static int
+db_fill_rekey_(SQL *db, struct fill_batch *batch)
+{
+	QUEUE *me;
+	CRAWLCANON *canon;
+	int c;
+	
+	me = batch->me;
+	for(c = 0; c < batch->nstale; c++)
 	{
-		if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"error_count\" = 0, \"soft_error_count\" = \"soft_error_count\" + 1 WHERE \"hash\" = %Q", cachekey))
+		canon = batch->stale[c].canon;
+		if(db_execute_(me, db, STMT_RESOURCE_REKEY, "KuddKQK", canon->key, (unsigned long) canon->shortkey, (int) (canon->shortkey % me->ncrawlers) + 1, (int) (canon->shortkey % me->ncaches) + 1, canon->rootkey, canon->uri, batch->stale[c].key) ||
+			db_execute_(me, db, STMT_RESOURCE_DELETE, "K", batch->stale[c].key))
 		{
-			log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
-			exit(1);
+			return (sql_deadlocked(db) ? -1 : -2);
 		}
 	}
-	else
+	return 0;
+}
+
+static void
+db_fill_reset_(struct fill_batch *batch)
+{
+	int c;
+	
+	for(c = 0; c < batch->count; c++)
+	{
+		free(batch->entries[c].uri);
+		batch->entries[c].uri = NULL;
+	}
+	batch->count = 0;
+	for(c = 0; c < batch->nstale; c++)
+	{
+		crawl_canonical_destroy(batch->stale[c].canon);
+		batch->stale[c].canon = NULL;
+	}
+	batch->nstale = 0;
+	batch->keys[0] = 0;
+}
+
+/* Release any leases held by this crawler */
+static int
+db_release_leases_(QUEUE *me)
+{
+	if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"crawl_instance\" = NULL, \"lease_expires\" = NULL WHERE \"crawl_instance\" = %d", me->crawler_id))
+	{
+		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
+		return -1;
+	}
+	return 0;
+}
+
+/* Extend the leases held by this crawler if they're due to be renewed:
+ * resources wait in the scheduler (and their outcomes wait to be committed)
+ * for as long as they need to, and mustn't be taken meanwhile by another
+ * crawler, or loaded a second time by this one
+ */
+static int
+db_renew_leases_(QUEUE *me)
+{
+	time_t now;
+	
+	now = time(NULL);
+	if(now - me->renewed < me->lease / LEASE_RENEW_FRACTION)
+	{
+		return 0;
+	}
+	if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"lease_expires\" = DATE_ADD(NOW(), INTERVAL %d SECOND) WHERE \"crawl_instance\" = %d", me->lease, me->crawler_id))
+	{
+		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
+		return -1;
+	}
+	me->renewed = now;
+	return 0;
+}
+
+/* Write the contents of the scheduler to the snapshot file, replacing any
+ * previous snapshot atomically
+ */
+static int
+db_snapshot_save_(QUEUE *me)
+{
+	FILE *f;
+	char *tmp;
+	int r;
+	
+	me->snapshotted = time(NULL);
+	tmp = (char *) malloc(strlen(me->snapshot) + 8);
+	if(!tmp)
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.new", me->snapshot);
+	f = fopen(tmp, "w");
+	if(!f)
+	{
+		log_printf(LOG_ERR, "DB: %s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	r = 0;
+	if(fprintf(f, "%s %d %ld\n", SNAPSHOT_MAGIC, me->crawler_id, (long) me->snapshotted) < 0 ||
+		sched_save(me->sched, f))
+	{
+		r = -1;
+	}
+	if(fclose(f))
+	{
+		r = -1;
+	}
+	if(!r && rename(tmp, me->snapshot))
+	{
+		r = -1;
+	}
+	if(r)
+	{
+		log_printf(LOG_ERR, "DB: failed to write snapshot %s: %s\n", me->snapshot, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+	return r;
+}
+
+/* Reload the scheduler from a snapshot left by a previous incarnation of
+ * this crawler, returning the number of URIs loaded. Only those resources
+ * which are still leased to this crawler are loaded: others may have been
+ * taken by another crawler once their leases expired, or had their
+ * outcomes committed after the snapshot was written. The leases on those
+ * loaded are extended, and any others held by this crawler are released.
+ */
+static int
+db_snapshot_load_(QUEUE *me)
+{
+	struct snapshot_load data;
+	char buf[64];
+	int crawler_id;
+	long when;
+	
+	if(!me->snapshot)
+	{
+		return 0;
+	}
+	memset(&data, 0, sizeof(data));
+	data.me = me;
+	data.f = fopen(me->snapshot, "r");
+	if(!data.f)
+	{
+		return 0;
+	}
+	data.count = -1;
+	if(fgets(buf, sizeof(buf), data.f) &&
+		!strncmp(buf, SNAPSHOT_MAGIC " ", sizeof(SNAPSHOT_MAGIC)) &&
+		sscanf(buf + sizeof(SNAPSHOT_MAGIC), "%d %ld", &crawler_id, &when) == 2 &&
+		crawler_id == me->crawler_id)
 	{
-		if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"error_count\" = 0, \"soft_error_count\" = 0 WHERE \"hash\" = %Q", cachekey))
+		data.start = ftell(data.f);
+		if(sql_perform(me->db, db_snapshot_txn_, &data, TXN_MAX_RETRIES))
 		{
 			log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
 			exit(1);
-		}	
-	}	
-	free(root);
-	free(canonical);
+		}
+	}
+	fclose(data.f);
+	free(data.leased);
+	free(data.kept.buf);
+	/* A snapshot is only used once; another is written soon enough */
+	unlink(me->snapshot);
+	if(data.count < 0)
+	{
+		log_printf(LOG_ERR, "DB: snapshot %s is invalid\n", me->snapshot);
+		sched_destroy(me->sched);
+		me->sched = sched_create();
+		return (me->sched ? 0 : -1);
+	}
+	if(data.count)
+	{
+		log_printf(LOG_NOTICE, "DB: resumed %d resources from snapshot\n", data.count);
+		me->filled = data.count;
+		me->lastfill = sched_now();
+		me->snapshotted = time(NULL);
+		me->renewed = time(NULL);
+	}
+	return data.count;
+}
+
+/* A transaction callback returns 0 for commit, -1 for rollback and retry, 1 for rollback successfully */
+static int
+db_snapshot_txn_(SQL *db, void *userdata)
+{
+	struct snapshot_load *data;
+	SQL_STATEMENT *rs;
+	QUEUE *me;
+	void *p;
+	
+	data = (struct snapshot_load *) userdata;
+	me = data->me;
+	/* Discard anything from a previous attempt */
+	data->nleased = 0;
+	data->kept.len = 0;
+	data->count = -1;
+	if(sched_pending(me->sched))
+	{
+		sched_destroy(me->sched);
+		me->sched = sched_create();
+		if(!me->sched)
+		{
+			return -2;
+		}
+	}
+	/* Lock the rows leased to this crawler, so that none can be taken by
+	 * another crawler before the leases are extended
+	 */
+	rs = sql_queryf(db, "SELECT LOWER(HEX(\"hash\")) FROM \"crawl_resource\" WHERE \"crawl_instance\" = %d FOR UPDATE", me->crawler_id);
+	if(!rs)
+	{
+		return (sql_deadlocked(db) ? -1 : -2);
+	}
+	for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+	{
+		if(data->nleased + 1 > data->size)
+		{
+			p = realloc(data->leased, sizeof(*(data->leased)) * (data->size + FILL_BATCH_SIZE));
+			if(!p)
+			{
+				sql_stmt_destroy(rs);
+				return -2;
+			}
+			data->leased = p;
+			data->size += FILL_BATCH_SIZE;
+		}
+		if(sql_stmt_value(rs, 0, data->leased[data->nleased], DB_KEY_LEN * 2 + 1) == DB_KEY_LEN * 2)
+		{
+			data->nleased++;
+		}
+	}
+	sql_stmt_destroy(rs);
+	qsort(data->leased, data->nleased, sizeof(*(data->leased)), db_snapshot_keycmp_);
+	if(fseek(data->f, data->start, SEEK_SET))
+	{
+		return 1;
+	}
+	data->count = sched_load(me->sched, data->f, db_snapshot_keep_, data);
+	if(data->count < 1)
+	{
+		/* Nothing to keep: the caller releases the leases */
+		return 1;
+	}
+	/* Drop the trailing comma; the keys have been checked to consist only
+	 * of hex digits, so can be interpolated directly
+	 */
+	data->kept.buf[data->kept.len - 1] = 0;
+	if(sql_executef(db, "UPDATE \"crawl_resource\" SET \"crawl_instance\" = NULL, \"lease_expires\" = NULL WHERE \"crawl_instance\" = %d AND \"hash\" NOT IN (%s)", me->crawler_id, data->kept.buf) ||
+		sql_executef(db, "UPDATE \"crawl_resource\" SET \"lease_expires\" = DATE_ADD(NOW(), INTERVAL %d SECOND) WHERE \"crawl_instance\" = %d", me->lease, me->crawler_id))
+	{
+		return (sql_deadlocked(db) ? -1 : -2);
+	}
+	return 0;
+}
+
+/* Load a URI from a snapshot only if it's still leased to this crawler */
+static int
+db_snapshot_keep_(const char *uristr, void *userdata)
+{
+	struct snapshot_load *data;
+	CRAWLCANON *canon;
+	int keep;
+	
+	data = (struct snapshot_load *) userdata;
+	canon = crawl_canonicalise(uristr);
+	if(!canon)
+	{
+		return 0;
+	}
+	keep = (bsearch(canon->key, data->leased, data->nleased, sizeof(*(data->leased)), db_snapshot_keycmp_) != NULL);
+	if(keep && db_append_(&(data->kept), "X'%s',", canon->key))
+	{
+		keep = 0;
+	}
+	crawl_canonical_destroy(canon);
+	return keep;
+}
+
+static int
+db_snapshot_keycmp_(const void *a, const void *b)
+{
+	return strcmp((const char *) a, (const char *) b);
+}
+
+static int
+db_add_uri(QUEUE *me, URI *uri)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = db_add_uristr(me, uristr);
+	free(uristr);
+	return r;
+}
+
+static int
+db_add_uristr(QUEUE *me, const char *uristr)
+{
+	CRAWLCANON *canon;
+	
+	canon = crawl_canonicalise(uristr);
+	if(!canon)
+	{
+		return -1;
+	}
+	db_insert_resource(me, canon->key, canon->shortkey, canon->uri, canon->rootkey);
+	db_insert_root(me, canon->rootkey, canon->root);
+	crawl_canonical_destroy(canon);
+	/* Wake any idle crawl threads */
+	queue_notify();
 	return 0;
+	
+}
+
+/* Add a set of URIs in a single transaction, using multi-row inserts */
+static int
+db_add_uristrs(QUEUE *me, const char **uristrs, size_t count)
+{
+	struct insert_batch batch;
+	CRAWLCANON *canon;
+	size_t c;
+	int r;
+	
+	if(!count)
+	{
+		return 0;
+	}
+	memset(&batch, 0, sizeof(batch));
+	batch.me = me;
+	batch.canon = (CRAWLCANON **) calloc(count, sizeof(CRAWLCANON *));
+	if(!batch.canon)
+	{
+		return -1;
+	}
+	r = 0;
+	for(c = 0; c < count; c++)
+	{
+		canon = crawl_canonicalise(uristrs[c]);
+		if(!canon)
+		{
+			r = -1;
+			continue;
+		}
+		if(!db_insert_safe_(canon))
+		{
+			/* This can't be interpolated into a statement, so must be
+			 * inserted by itself
+			 */
+			db_insert_resource(me, canon->key, canon->shortkey, canon->uri, canon->rootkey);
+			db_insert_root(me, canon->rootkey, canon->root);
+			crawl_canonical_destroy(canon);
+			continue;
+		}
+		batch.canon[batch.count] = canon;
+		batch.count++;
+	}
+	if(batch.count && sql_perform(me->db, db_insert_batch_txn_, &batch, TXN_MAX_RETRIES))
+	{
+		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
+		exit(1);
+	}
+	for(c = 0; c < batch.count; c++)
+	{
+		crawl_canonical_destroy(batch.canon[c]);
+	}
+	free(batch.canon);
+	free(batch.sql.buf);
+	/* Wake any idle crawl threads */
+	queue_notify();
+	return r;
+}
+
+static int
+db_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = db_updated_uristr(me, uristr, updated, last_modified, status, ttl);
+	free(uristr);
+	return r;
+}
+
+/* The outcome of a fetch is staged, and committed along with others */
+static int
+db_updated_uristr(QUEUE *me, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	struct db_outcome outcome;
+	
+	memset(&outcome, 0, sizeof(outcome));
+	outcome.updated = updated;
+	outcome.last_modified = last_modified;
+	outcome.status = status;
+	if(status != 200)
+	{
+		if(ttl < 86400)
+		{
+			ttl = 86400;
+		}
+		outcome.next_fetch = time(NULL) + ttl;
+	}
+	else
+	{
+		/* The freshness lifetime given by the server, if any */
+		outcome.ttl = (ttl < 0 ? 0 : ttl);
+	}
+	return db_stage_(me, uristr, &outcome);
 }
 
 static int
@@ -530,53 +1657,175 @@ db_unchanged_uri(QUEUE *me, URI *uri, int error)
 static int
 db_unchanged_uristr(QUEUE *me, const char *uristr, int error)
 {
-	char *canonical, *root;
-	char cachekey[48], rootkey[48], updatedstr[32], nextfetchstr[32];
-	uint32_t shortkey;
-	struct tm tm;
-	time_t now, ttl;
+	struct db_outcome outcome;
 	
-	if(db_uristr_key_root(me, uristr, &canonical, cachekey, &shortkey, &root, rootkey))
+	memset(&outcome, 0, sizeof(outcome));
+	outcome.unchanged = 1;
+	outcome.error = error;
+	outcome.updated = time(NULL);
+	if(error)
+	{
+		outcome.next_fetch = outcome.updated + (86400 * 7);
+	}
+	return db_stage_(me, uristr, &outcome);
+}
+
+/* Add a fetch outcome to those waiting to be committed, committing them if
+ * there are enough
+ */
+static int
+db_stage_(QUEUE *me, const char *uristr, struct db_outcome *outcome)
+{
+	CRAWLCANON *canon;
+	
+	canon = crawl_canonicalise(uristr);
+	if(!canon)
 	{
 		return -1;
-	}	
-	now = time(NULL);
-	gmtime_r(&now, &tm);
-	strftime(updatedstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	now += 2;
-	strftime(nextfetchstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-	if(sql_executef(me->db, "UPDATE \"crawl_root\" SET \"last_updated\" = %Q, \"earliest_update\" = %Q WHERE \"hash\" = %Q", updatedstr, nextfetchstr, rootkey))
+	}
+	if(strlen(canon->key) != DB_KEY_LEN * 2 || strspn(canon->key, "0123456789abcdef") != DB_KEY_LEN * 2 ||
+		strlen(canon->rootkey) != DB_KEY_LEN * 2 || strspn(canon->rootkey, "0123456789abcdef") != DB_KEY_LEN * 2)
+	{
+		log_printf(LOG_ERR, "DB: <%s> has a malformed key\n", uristr);
+		crawl_canonical_destroy(canon);
+		return -1;
+	}
+	strcpy(outcome->key, canon->key);
+	strcpy(outcome->rootkey, canon->rootkey);
+	crawl_canonical_destroy(canon);
+	if(!me->noutcomes)
+	{
+		me->pending_since = sched_now();
+	}
+	me->outcomes[me->noutcomes] = *outcome;
+	me->noutcomes++;
+	if(me->noutcomes >= me->commit_batch)
+	{
+		return db_commit_(me);
+	}
+	return 0;
+}
+
+/* Commit any fetch outcomes which have waited for commit-interval, returning
+ * the number of milliseconds until those still waiting will have, or -1 if
+ * there are none
+ */
+static long
+db_commit_due_(QUEUE *me)
+{
+	uint64_t now;
+	
+	if(!me->noutcomes)
 	{
-		log_printf(LOG_CRIT, "%s\n", sql_error(me->db));
+		return -1;
+	}
+	now = sched_now();
+	if(now - me->pending_since < (uint64_t) me->commit_interval)
+	{
+		return (long) (me->commit_interval - (now - me->pending_since));
+	}
+	db_commit_(me);
+	return -1;
+}
+
+/* Commit the fetch outcomes which are waiting, in a single transaction */
+static int
+db_commit_(QUEUE *me)
+{
+	if(!me->noutcomes)
+	{
+		return 0;
+	}
+	if(sql_perform(me->db, db_commit_txn_, me, TXN_MAX_RETRIES))
+	{
+		log_printf(LOG_CRIT, "DB: %s\n", sql_error(me->db));
 		exit(1);
 	}
-	if(error)
+	log_printf(LOG_DEBUG, "DB: committed %d fetch outcomes\n", me->noutcomes);
+	me->noutcomes = 0;
+	return 0;
+}
+
+/* A transaction callback returns 0 for commit, -1 for rollback and retry, 1 for rollback successfully */
+static int
+db_commit_txn_(SQL *db, void *userdata)
+{
+	QUEUE *me;
+	int c, r;
+	
+	me = (QUEUE *) userdata;
+	for(c = 0; c < me->noutcomes; c++)
 	{
-		ttl = (86400 * 7) + now;
-		gmtime_r(&ttl, &tm);
-		strftime(nextfetchstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-		if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"updated\" = %Q, \"next_fetch\" = %Q, \"crawl_instance\" = NULL, \"error_count\" = \"error_count\" + 1 WHERE \"hash\" = %Q",
-			updatedstr, nextfetchstr, cachekey))
+		if(db_outcome_apply_(me, db, &(me->outcomes[c])))
 		{
-			log_printf(LOG_CRIT, "%s\n", sql_error(me->db));
-			exit(1);
-		}		
+			return (sql_deadlocked(db) ? -1 : -2);
+		}
 	}
-	else
+	/* Each root is marked as fetched from once, however many of its
+	 * resources were fetched, and may not be fetched from again by another
+	 * crawler for 'rate' milliseconds (to the resolution of earliest_update,
+	 * and from the time of the commit rather than of the fetch); the keys
+	 * have been checked to consist only of hex digits, so can be
+	 * interpolated directly
+	 */
+	me->commitbuf.len = 0;
+	r = db_append_(&(me->commitbuf), "UPDATE \"crawl_root\" SET \"last_updated\" = NOW(), \"earliest_update\" = DATE_ADD(NOW(), INTERVAL \"rate\" * 1000 MICROSECOND) WHERE \"hash\" IN (");
+	for(c = 0; c < me->noutcomes && !r; c++)
 	{
-		ttl = (3600 * 2) + now;
-		gmtime_r(&ttl, &tm);
-		strftime(nextfetchstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
-		if(sql_executef(me->db, "UPDATE \"crawl_resource\" SET \"updated\" = %Q, \"next_fetch\" = %Q, \"crawl_instance\" = NULL, \"error_count\" = 0 WHERE \"hash\" = %Q",
-			updatedstr, nextfetchstr, cachekey))
-		{
-			log_printf(LOG_CRIT, "%s\n", sql_error(me->db));
-			exit(1);
-		}		
+		r = db_append_(&(me->commitbuf), "%sX'%s'", (c ? ", " : ""), me->outcomes[c].rootkey);
+	}
+	if(r || db_append_(&(me->commitbuf), ")"))
+	{
+		return -2;
+	}
+	if(sql_execute(db, me->commitbuf.buf))
+	{
+		return (sql_deadlocked(db) ? -1 : -2);
 	}
 	return 0;
 }
 
+/* Apply a fetch outcome to a resource with a single statement */
+static int
+db_outcome_apply_(QUEUE *me, SQL *db, struct db_outcome *outcome)
+{
+	char updatedstr[32], lastmodstr[32], nextfetchstr[32];
+	struct tm tm;
+	
+	gmtime_r(&(outcome->updated), &tm);
+	strftime(updatedstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
+	gmtime_r(&(outcome->next_fetch), &tm);
+	strftime(nextfetchstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
+	if(outcome->unchanged)
+	{
+		if(outcome->error)
+		{
+			return db_execute_(me, db, STMT_UNCHANGED_ERROR, "QQK", updatedstr, nextfetchstr, outcome->key);
+		}
+		/* The resource hasn't changed, so lengthen the estimated interval
+		 * between changes by half
+		 */
+		return db_execute_(me, db, STMT_UNCHANGED, "QddddK",
+			updatedstr, me->revisit_min, me->revisit_max, REVISIT_DEFAULT_INTERVAL, me->revisit_max, outcome->key);
+	}
+	gmtime_r(&(outcome->last_modified), &tm);
+	strftime(lastmodstr, 32, "%Y-%m-%d %H:%M:%S", &tm);
+	if(outcome->status != 200)
+	{
+		return db_execute_(me, db, STMT_UPDATED_STATUS, "QQdQK", updatedstr, lastmodstr, outcome->status, nextfetchstr, outcome->key);
+	}
+	/* The resource has changed since it was last fetched (or it's new), so
+	 * halve the estimated interval between changes; ttl is the freshness
+	 * lifetime given by the server, before which there's no point in
+	 * fetching it again. Assignments are made from left to right, so
+	 * next_fetch sees the new estimate.
+	 */
+	return db_execute_(me, db, STMT_UPDATED, "QQdddddK",
+		updatedstr, lastmodstr, outcome->status,
+		me->revisit_min, REVISIT_DEFAULT_INTERVAL,
+		(int) (outcome->ttl < me->revisit_max ? outcome->ttl : me->revisit_max),
+		me->revisit_max, outcome->key);
+}
 
 static int
 db_insert_resource(QUEUE *me, const char *cachekey, uint32_t shortkey, const char *uri, const char *rootkey)
@@ -627,17 +1876,19 @@ db_insert_resource_txn(SQL *db, void *userdata)
 {
 	struct resource_insert *data;
 	SQL_STATEMENT *rs;
+	int depth;
 	
 	data = (struct resource_insert *) userdata;
 	
-	rs = sql_queryf(db, "SELECT * FROM \"crawl_resource\" WHERE \"hash\" = %Q", data->cachekey);
+	rs = db_query_(data->me, db, STMT_RESOURCE_FIND, "K", data->cachekey);
 	if(!rs)
 	{
 		return -2;
 	}
 	if(sql_stmt_eof(rs))
 	{
-		if(sql_executef(db, "INSERT INTO \"crawl_resource\" (\"hash\", \"shorthash\", \"crawl_bucket\", \"cache_bucket\", \"root\", \"uri\", \"added\", \"next_fetch\") VALUES (%Q, %lu, %d, %d, %Q, %Q, NOW(), NOW())", data->cachekey, data->shortkey, (data->shortkey % data->me->ncrawlers) + 1, (data->shortkey % data->me->ncaches) + 1, data->rootkey, data->uri))
+		depth = db_uri_depth_(data->uri);
+		if(db_execute_(data->me, db, STMT_RESOURCE_INSERT, "KuddKQdd", data->cachekey, (unsigned long) data->shortkey, (int) (data->shortkey % data->me->ncrawlers) + 1, (int) (data->shortkey % data->me->ncaches) + 1, data->rootkey, data->uri, depth, -(depth * PRIORITY_DEPTH_WEIGHT)))
 		{
 			if(sql_deadlocked(db))
 			{
@@ -649,7 +1900,10 @@ db_insert_resource_txn(SQL *db, void *userdata)
 	else
 	{
 		/* XXX only update if values differ */
-		if(sql_executef(db, "UPDATE \"crawl_resource\" SET \"crawl_bucket\" = %d, \"cache_bucket\" = %d WHERE \"hash\" = %Q", (data->shortkey % data->me->ncrawlers) + 1, (data->shortkey % data->me->ncaches) + 1, data->cachekey))
+		/* Each rediscovery is another link to the resource; the priority
+		 * is updated before the count, and so sees its old value
+		 */
+		if(db_execute_(data->me, db, STMT_RESOURCE_RELINK, "ddddK", (int) (data->shortkey % data->me->ncrawlers) + 1, (int) (data->shortkey % data->me->ncaches) + 1, PRIORITY_INLINK_MAX, PRIORITY_INLINK_WEIGHT, data->cachekey))
 		{
 			if(sql_deadlocked(db))
 			{
@@ -671,7 +1925,7 @@ db_insert_root_txn(SQL *db, void *userdata)
 	
 	data = (struct root_insert *) userdata;
 	
-	rs = sql_queryf(db, "SELECT * FROM \"crawl_root\" WHERE \"hash\" = %Q", data->rootkey);
+	rs = db_query_(data->me, db, STMT_ROOT_FIND, "K", data->rootkey);
 	if(!rs)
 	{
 		return -2;
@@ -681,7 +1935,7 @@ db_insert_root_txn(SQL *db, void *userdata)
 		return 0;
 	}
 	sql_stmt_destroy(rs);
-	if(sql_executef(db, "INSERT INTO \"crawl_root\" (\"hash\", \"uri\", \"added\", \"earliest_update\", \"rate\") VALUES (%Q, %Q, NOW(), NOW(), 1000)", data->rootkey, data->uri))
+	if(db_execute_(data->me, db, STMT_ROOT_INSERT, "KQ", data->rootkey, data->uri))
 	{
 		if(sql_deadlocked(db))
 		{
@@ -691,3 +1945,336 @@ db_insert_root_txn(SQL *db, void *userdata)
 	}
 	return 1;
 }
+
+/* Determine the number of path segments in a URI, which stands in for its
+ * distance from the seed: a resource deep within a site is generally less
+ * valuable than one near the top
+ */
+static int
+db_uri_depth_(const char *uri)
+{
+	const char *s;
+	int depth;
+	
+	s = strstr(uri, "://");
+	if(!s)
+	{
+		return 0;
+	}
+	s = strchr(s + 3, '/');
+	for(depth = 0; s && *s && *s != '?' && *s != '#'; s++)
+	{
+		if(*s == '/' && s[1] && s[1] != '?' && s[1] != '#')
+		{
+			depth++;
+		}
+	}
+	return depth;
+}
+
+/* A transaction callback returns 0 for commit, -1 for rollback and retry, 1 for rollback successfully */
+static int
+db_insert_batch_txn_(SQL *db, void *userdata)
+{
+	struct insert_batch *batch;
+	CRAWLCANON *canon;
+	size_t start, end, c;
+	int depth;
+	
+	batch = (struct insert_batch *) userdata;
+	for(start = 0; start < batch->count; start = end)
+	{
+		end = start + INSERT_BATCH_ROWS;
+		if(end > batch->count)
+		{
+			end = batch->count;
+		}
+		batch->sql.len = 0;
+		if(db_append_(&(batch->sql), "INSERT INTO \"crawl_root\" (\"hash\", \"uri\", \"added\", \"earliest_update\", \"rate\") VALUES "))
+		{
+			return -2;
+		}
+		for(c = start; c < end; c++)
+		{
+			canon = batch->canon[c];
+			if(db_append_(&(batch->sql), "%s(X'%s', '%s', NOW(), NOW(), 1000)", (c > start ? ", " : ""), canon->rootkey, canon->root))
+			{
+				return -2;
+			}
+		}
+		if(db_append_(&(batch->sql), " ON DUPLICATE KEY UPDATE \"hash\" = \"hash\"") ||
+			sql_execute(db, batch->sql.buf))
+		{
+			return (sql_deadlocked(db) ? -1 : -2);
+		}
+		/* As with db_insert_resource_txn(), a resource which already exists
+		 * is reassigned to its buckets and gains another inlink
+		 */
+		batch->sql.len = 0;
+		if(db_append_(&(batch->sql), "INSERT INTO \"crawl_resource\" (\"hash\", \"shorthash\", \"crawl_bucket\", \"cache_bucket\", \"root\", \"uri\", \"depth\", \"priority\", \"added\", \"next_fetch\") VALUES "))
+		{
+			return -2;
+		}
+		for(c = start; c < end; c++)
+		{
+			canon = batch->canon[c];
+			depth = db_uri_depth_(canon->uri);
+			if(db_append_(&(batch->sql), "%s(X'%s', %lu, %d, %d, X'%s', '%s', %d, %d, NOW(), NOW())", (c > start ? ", " : ""),
+				canon->key, (unsigned long) canon->shortkey,
+				(int) (canon->shortkey % batch->me->ncrawlers) + 1, (int) (canon->shortkey % batch->me->ncaches) + 1,
+				canon->rootkey, canon->uri, depth, -(depth * PRIORITY_DEPTH_WEIGHT)))
+			{
+				return -2;
+			}
+		}
+		if(db_append_(&(batch->sql), " ON DUPLICATE KEY UPDATE "
+			"\"crawl_bucket\" = VALUES(\"crawl_bucket\"), \"cache_bucket\" = VALUES(\"cache_bucket\"), "
+			"\"priority\" = \"priority\" + IF(\"inlinks\" < %d, %d, 0), \"inlinks\" = \"inlinks\" + 1",
+			PRIORITY_INLINK_MAX, PRIORITY_INLINK_WEIGHT) ||
+			sql_execute(db, batch->sql.buf))
+		{
+			return (sql_deadlocked(db) ? -1 : -2);
+		}
+	}
+	return 0;
+}
+
+/* Can a canonical URI be interpolated directly into a statement? Keys are
+ * hex digests; URIs are accepted if they contain no quotes, backslashes or
+ * control characters
+ */
+static int
+db_insert_safe_(CRAWLCANON *canon)
+{
+	const unsigned char *s;
+	const char *uris[2];
+	int c;
+	
+	if(strlen(canon->key) != DB_KEY_LEN * 2 || strspn(canon->key, "0123456789abcdef") != DB_KEY_LEN * 2 ||
+		strlen(canon->rootkey) != DB_KEY_LEN * 2 || strspn(canon->rootkey, "0123456789abcdef") != DB_KEY_LEN * 2)
+	{
+		return 0;
+	}
+	uris[0] = canon->uri;
+	uris[1] = canon->root;
+	for(c = 0; c < 2; c++)
+	{
+		for(s = (const unsigned char *) uris[c]; *s; s++)
+		{
+			if(*s < 32 || *s == 127 || *s == '\'' || *s == '\\')
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Append to a statement being built */
+static int
+db_append_(struct db_buffer *buf, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	size_t size;
+	int r;
+	
+	for(;;)
+	{
+		va_start(ap, fmt);
+		r = vsnprintf(buf->buf + buf->len, buf->size - buf->len, fmt, ap);
+		va_end(ap);
+		if(r < 0)
+		{
+			return -1;
+		}
+		if(buf->len + r < buf->size)
+		{
+			buf->len += r;
+			return 0;
+		}
+		size = buf->size + r + 4096;
+		p = (char *) realloc(buf->buf, size);
+		if(!p)
+		{
+			return -1;
+		}
+		buf->buf = p;
+		buf->size = size;
+	}
+}
+
+/* Append the hex encoding of a string to a statement being built */
+static int
+db_append_hex_(struct db_buffer *buf, const unsigned char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t needed;
+	char *p;
+	
+	needed = buf->len + (strlen((const char *) s) * 2) + 1;
+	if(needed > buf->size)
+	{
+		p = (char *) realloc(buf->buf, needed + 4096);
+		if(!p)
+		{
+			return -1;
+		}
+		buf->buf = p;
+		buf->size = needed + 4096;
+	}
+	for(; *s; s++)
+	{
+		buf->buf[buf->len] = hex[*s >> 4];
+		buf->buf[buf->len + 1] = hex[*s & 15];
+		buf->len += 2;
+	}
+	buf->buf[buf->len] = 0;
+	return 0;
+}
+
+/* Prepare a statement on a connection, unless it already has been */
+static int
+db_prepare_(QUEUE *me, SQL *db, int stmt)
+{
+	char text[STMT_TEXT_LEN];
+	
+	if(me->prepared[stmt])
+	{
+		return 0;
+	}
+	if(snprintf(text, sizeof(text), db_statements[stmt], me->refresh_priority) >= (int) sizeof(text))
+	{
+		return -1;
+	}
+	if(sql_executef(db, "PREPARE crawld_%d FROM %Q", stmt, text))
+	{
+		return -1;
+	}
+	me->prepared[stmt] = 1;
+	return 0;
+}
+
+/* Execute a prepared statement, preparing it first if needed. Each
+ * character of types describes a parameter: 'd' is an int, 'u' an unsigned
+ * long, 'Q' a string (or NULL) and 'K' a key, given as hex and stored as
+ * binary. The parameters are assigned to session variables, from which
+ * they're passed to the statement; strings are sent hex-encoded, so need no
+ * escaping.
+ *
+ * If a statement which was prepared earlier fails, the connection may have
+ * been re-established since, so it's prepared again and retried once.
+ */
+static int
+db_run_(QUEUE *me, SQL *db, int stmt, SQL_STATEMENT **rs, const char *types, va_list ap)
+{
+	const unsigned char *s;
+	char exec[STMT_TEXT_LEN];
+	size_t c, n, len;
+	int retry, r;
+	
+	retry = me->prepared[stmt];
+	n = strlen(types);
+	me->stmtbuf.len = 0;
+	r = 0;
+	for(c = 0; c < n && !r; c++)
+	{
+		r = db_append_(&(me->stmtbuf), "%s@crawld_p%d = ", (c ? ", " : "SET "), (int) c);
+		switch(types[c])
+		{
+		case 'd':
+			r = r || db_append_(&(me->stmtbuf), "%d", va_arg(ap, int));
+			break;
+		case 'u':
+			r = r || db_append_(&(me->stmtbuf), "%lu", va_arg(ap, unsigned long));
+			break;
+		case 'Q':
+			s = va_arg(ap, const unsigned char *);
+			if(!s)
+			{
+				r = r || db_append_(&(me->stmtbuf), "NULL");
+				break;
+			}
+			r = r || db_append_(&(me->stmtbuf), "CONVERT(X'") ||
+				db_append_hex_(&(me->stmtbuf), s) ||
+				db_append_(&(me->stmtbuf), "' USING utf8) COLLATE utf8_unicode_ci");
+			break;
+		case 'K':
+			s = va_arg(ap, const unsigned char *);
+			if(strlen((const char *) s) != DB_KEY_LEN * 2 ||
+				strspn((const char *) s, "0123456789abcdef") != DB_KEY_LEN * 2)
+			{
+				r = -1;
+				break;
+			}
+			r = r || db_append_(&(me->stmtbuf), "X'%s'", (const char *) s);
+			break;
+		default:
+			r = -1;
+		}
+	}
+	if(r)
+	{
+		return -1;
+	}
+	len = snprintf(exec, sizeof(exec), "EXECUTE crawld_%d", stmt);
+	for(c = 0; c < n && len < sizeof(exec); c++)
+	{
+		len += snprintf(exec + len, sizeof(exec) - len, "%s@crawld_p%d", (c ? ", " : " USING "), (int) c);
+	}
+	if(len >= sizeof(exec))
+	{
+		return -1;
+	}
+	for(;;)
+	{
+		if(db_prepare_(me, db, stmt) || (n && sql_execute(db, me->stmtbuf.buf)))
+		{
+			r = -1;
+		}
+		else if(rs)
+		{
+			*rs = sql_query(db, exec);
+			r = (*rs ? 0 : -1);
+		}
+		else
+		{
+			r = (sql_execute(db, exec) ? -1 : 0);
+		}
+		if(!r || !retry || sql_deadlocked(db))
+		{
+			return r;
+		}
+		/* Prepare everything afresh */
+		retry = 0;
+		memset(me->prepared, 0, sizeof(me->prepared));
+	}
+}
+
+static int
+db_execute_(QUEUE *me, SQL *db, int stmt, const char *types, ...)
+{
+	va_list ap;
+	int r;
+	
+	va_start(ap, types);
+	r = db_run_(me, db, stmt, NULL, types, ap);
+	va_end(ap);
+	return r;
+}
+
+static SQL_STATEMENT *
+db_query_(QUEUE *me, SQL *db, int stmt, const char *types, ...)
+{
+	SQL_STATEMENT *rs;
+	va_list ap;
+	
+	rs = NULL;
+	va_start(ap, types);
+	if(db_run_(me, db, stmt, &rs, types, ap))
+	{
+		rs = NULL;
+	}
+	va_end(ap);
+	return rs;
+}
@@ -27,14 +27,67 @@
 # include <fcntl.h>
 # include <unistd.h>
 # include <syslog.h>
+# include <signal.h>
 # include <pthread.h>
+# include <semaphore.h>
 
 # include "crawl.h"
 # include "libsupport.h"
 
+/* The maximum delay before restarting a crawl thread which keeps exiting */
+# define THREAD_BACKOFF_MAX            60
+/* The default number of fetches in flight per thread in event-driven mode */
+# define THREAD_DEFAULT_CONNECTIONS    256
+/* The initial and maximum intervals, in milliseconds, that an idle crawl
+ * thread waits before checking an empty queue again
+ */
+# define THREAD_IDLE_MIN               1000
+# define THREAD_IDLE_MAX               60000
+
+/* The default number of queue updates staged by each crawl thread */
+# define QUEUE_DEFAULT_BUFFER          1024
+/* The interval, in milliseconds, between flushes of staged queue updates */
+# define BUFFER_FLUSH_INTERVAL         500
+/* The maximum number of staged additions applied at once */
+# define BUFFER_ADD_BATCH              256
+/* The number of links the RDF processor's list grows by */
+# define RDF_LINKS_BLOCK               256
+/* The default number of recently-added URIs remembered by each thread */
+# define RECENT_DEFAULT_SIZE           65536
+/* The number of entries in each set of the recently-added URI filter */
+# define RECENT_WAYS                   8
+/* The number of additions between reports of the filter's hit rate */
+# define RECENT_REPORT_INTERVAL        100000
+
+/* The default number of objects waiting to be processed by a pipeline */
+# define PIPELINE_DEFAULT_DEPTH        64
+/* The size of a cache line, used to separate a pipeline's counters */
+# define PIPELINE_CACHE_LINE           64
+
+/* The length of a root key held by the politeness scheduler */
+# define SCHED_KEY_LEN                 32
+/* The number of hash buckets used to locate roots, and the initial number
+ * used to locate hosts
+ */
+# define SCHED_BUCKETS                 1024
+/* The mean number of hosts per bucket at which the host table is swept of
+ * idle entries, and grown if that doesn't free enough of them
+ */
+# define SCHED_HOST_LOAD               2
+/* The number of roots the scheduler's heap grows by */
+# define SCHED_HEAP_BLOCK              64
+/* The maximum length of a line in a scheduler snapshot */
+# define SCHED_LINE_LEN                4096
+
 typedef struct context_struct CONTEXT;
 typedef struct processor_struct PROCESSOR;
 typedef struct queue_struct QUEUE;
+typedef struct sched_struct SCHED;
+typedef struct recent_struct RECENT;
+typedef struct pipeline_struct PIPELINE;
+
+/* Invoked by sched_load() for each URI: return nonzero to load it */
+typedef int (*sched_keep_cb)(const char *uristr, void *userdata);
 
 struct context_struct
 {
@@ -45,6 +98,7 @@ struct context_struct
 	int crawler_id;
 	int cache_id;
 	PROCESSOR *processor;
+	PIPELINE *pipeline;
 	QUEUE *queue;
 	size_t cfgbuflen;
 	char *cfgbuf;
@@ -81,6 +135,8 @@ struct queue_api_struct
 	int (*updated_uristr)(QUEUE *me, const char *uri, time_t updated, time_t last_modified, int status, time_t ttl);
 	int (*unchanged_uri)(QUEUE *me, URI *uri, int error);
 	int (*unchanged_uristr)(QUEUE *me, const char *uri, int error);
+	long (*due)(QUEUE *me);
+	int (*add_uristrs)(QUEUE *me, const char **uristrs, size_t count);
 };
 
 #ifndef PROCESSOR_STRUCT_DEFINED
@@ -100,13 +156,22 @@ struct processor_api_struct
 
 CONTEXT *context_create(int crawler_offset);
 
-int thread_create(int crawler_offset);
+int thread_init(void);
+int thread_supervise(void);
+int thread_cleanup(void);
+void thread_shutdown(void);
+int thread_stopping(void);
 void *thread_handler(void *arg);
 
 int processor_init(void);
 int processor_cleanup(void);
 int processor_init_crawler(CRAWL *crawler, CONTEXT *data);
 int processor_cleanup_crawler(CRAWL *crawl, CONTEXT *data);
+int processor_process(CRAWL *crawl, PROCESSOR *processor, CRAWLOBJ *obj);
+
+PIPELINE *pipeline_create(CRAWL *crawl, int nthreads, size_t depth);
+void pipeline_destroy(PIPELINE *pipeline);
+int pipeline_push(PIPELINE *pipeline, CRAWLOBJ *obj);
 
 int queue_init(void);
 int queue_cleanup(void);
@@ -114,17 +179,46 @@ int queue_init_crawler(CRAWL *crawler, CONTEXT *data);
 int queue_cleanup_crawler(CRAWL *crawler, CONTEXT *data);
 int queue_add_uristr(CRAWL *crawler, const char *str);
 int queue_add_uri(CRAWL *crawler, URI *uri);
+int queue_add_uristrs(CRAWL *crawler, const char **uristrs, size_t count);
 int queue_updated_uri(CRAWL *crawl, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl);
 int queue_updated_uristr(CRAWL *crawl, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl);
 int queue_unchanged_uri(CRAWL *crawl, URI *uri, int error);
 int queue_unchanged_uristr(CRAWL *crawl, const char *uristr, int error);
+long queue_due(CRAWL *crawl);
+unsigned long queue_generation(void);
+void queue_notify(void);
+int queue_wait(unsigned long generation, long maxwait);
 
 int policy_init(void);
 int policy_cleanup(void);
 int policy_init_crawler(CRAWL *crawler, CONTEXT *data);
 
+SCHED *sched_create(void);
+void sched_destroy(SCHED *sched);
+void sched_cleanup(void);
+uint64_t sched_now(void);
+size_t sched_pending(SCHED *sched);
+int sched_add(SCHED *sched, const char *rootkey, int rate, const char *uristr);
+int sched_next(SCHED *sched, char **uristr, uint64_t *wait);
+int sched_defer(const char *rootkey, uint64_t delay);
+uint64_t sched_wait(SCHED *sched);
+int sched_save(SCHED *sched, FILE *f);
+int sched_load(SCHED *sched, FILE *f, sched_keep_cb keep, void *userdata);
+
+RECENT *recent_create(size_t size);
+void recent_destroy(RECENT *recent);
+int recent_check(RECENT *recent, const char *uristr);
+void recent_add(RECENT *recent, const char *uristr);
+void recent_stats(RECENT *recent, unsigned long *lookups, unsigned long *hits);
+
 PROCESSOR *rdf_create(CRAWL *crawler);
 
 QUEUE *db_create(CONTEXT *ctx);
+# ifdef WITH_SQLITE3
+QUEUE *sqlite_create(CONTEXT *ctx);
+# endif
+
+QUEUE *buffer_create(QUEUE *inner, size_t capacity);
+int buffer_cleanup(void);
 
 #endif /*!P_CRAWLD_H_*/
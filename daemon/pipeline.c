@@ -0,0 +1,263 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_crawld.h"
+
+/* Pipelined processing
+ *
+ * When a crawl thread has a pipeline, updated objects are copied and pushed
+ * onto a bounded queue rather than being processed by the thread which
+ * fetched them; a pool of processing threads, each with its own processor,
+ * pops them off, processes them and passes the results to the (buffered)
+ * queue module, which writes them to the database from its own threads.
+ * Fetching, processing and enqueueing therefore overlap, and each stage has
+ * its own thread count.
+ *
+ * The queue itself is a fixed-size ring of cells, each carrying a sequence
+ * number, which producers and consumers claim with compare-and-swap; a pair
+ * of semaphores counts the free and occupied cells, so that a full or empty
+ * queue blocks rather than spins. Whoever pops an object owns it.
+ */
+
+struct pipeline_worker
+{
+	PIPELINE *pipeline;
+	PROCESSOR *processor;
+};
+
+struct pipeline_cell
+{
+	size_t seq;
+	CRAWLOBJ *obj;
+};
+
+struct pipeline_struct
+{
+	CRAWL *crawl;
+	struct pipeline_cell *cells;
+	size_t mask;
+	/* Kept apart so that producers and consumers don't share a line */
+	char pad0[PIPELINE_CACHE_LINE];
+	size_t enqpos;
+	char pad1[PIPELINE_CACHE_LINE];
+	size_t deqpos;
+	char pad2[PIPELINE_CACHE_LINE];
+	sem_t slots;
+	sem_t items;
+	int nthreads;
+	int started;
+	pthread_t *threads;
+	struct pipeline_worker *workers;
+};
+
+static void pipeline_put_(PIPELINE *p, CRAWLOBJ *obj);
+static CRAWLOBJ *pipeline_get_(PIPELINE *p);
+static void *pipeline_thread_(void *arg);
+
+/* Create a pipeline with nthreads processing threads, the processors for
+ * which are created up-front by the calling (crawl) thread
+ */
+PIPELINE *
+pipeline_create(CRAWL *crawl, int nthreads, size_t depth)
+{
+	PIPELINE *p;
+	size_t size, c;
+	int e;
+	
+	p = (PIPELINE *) calloc(1, sizeof(PIPELINE));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->crawl = crawl;
+	for(size = 2; size < depth; size <<= 1);
+	p->cells = (struct pipeline_cell *) calloc(size, sizeof(struct pipeline_cell));
+	p->threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+	p->workers = (struct pipeline_worker *) calloc(nthreads, sizeof(struct pipeline_worker));
+	if(!p->cells || !p->threads || !p->workers)
+	{
+		free(p->workers);
+		free(p->threads);
+		free(p->cells);
+		free(p);
+		return NULL;
+	}
+	for(c = 0; c < size; c++)
+	{
+		p->cells[c].seq = c;
+	}
+	p->mask = size - 1;
+	sem_init(&(p->slots), 0, (unsigned int) size);
+	sem_init(&(p->items), 0, 0);
+	p->nthreads = nthreads;
+	for(c = 0; c < (size_t) nthreads; c++)
+	{
+		p->workers[c].pipeline = p;
+		p->workers[c].processor = rdf_create(crawl);
+		if(!p->workers[c].processor)
+		{
+			pipeline_destroy(p);
+			return NULL;
+		}
+	}
+	for(c = 0; c < (size_t) nthreads; c++)
+	{
+		e = pthread_create(&(p->threads[c]), NULL, pipeline_thread_, (void *) &(p->workers[c]));
+		if(e)
+		{
+			log_printf(LOG_CRIT, "Failed to create processing thread: %s\n", strerror(e));
+			pipeline_destroy(p);
+			return NULL;
+		}
+		p->started++;
+	}
+	return p;
+}
+
+/* Process everything which has been queued, then stop the processing
+ * threads and free the pipeline
+ */
+void
+pipeline_destroy(PIPELINE *p)
+{
+	int c;
+	
+	if(!p)
+	{
+		return;
+	}
+	/* Each thread exits when it pops a NULL object */
+	for(c = 0; c < p->started; c++)
+	{
+		pipeline_put_(p, NULL);
+	}
+	for(c = 0; c < p->started; c++)
+	{
+		pthread_join(p->threads[c], NULL);
+	}
+	for(c = 0; c < p->nthreads; c++)
+	{
+		if(p->workers[c].processor)
+		{
+			p->workers[c].processor->api->release(p->workers[c].processor);
+		}
+	}
+	sem_destroy(&(p->items));
+	sem_destroy(&(p->slots));
+	free(p->workers);
+	free(p->threads);
+	free(p->cells);
+	free(p);
+}
+
+/* Pass an object to the processing threads, waiting if the queue is full;
+ * the pipeline takes ownership of a copy of obj, not obj itself
+ */
+int
+pipeline_push(PIPELINE *p, CRAWLOBJ *obj)
+{
+	CRAWLOBJ *copy;
+	
+	copy = crawl_obj_dup(obj);
+	if(!copy)
+	{
+		return -1;
+	}
+	pipeline_put_(p, copy);
+	return 0;
+}
+
+static void
+pipeline_put_(PIPELINE *p, CRAWLOBJ *obj)
+{
+	struct pipeline_cell *cell;
+	size_t pos, seq;
+	
+	while(sem_wait(&(p->slots)) && errno == EINTR);
+	/* A cell is known to be free, so this only contends with other
+	 * producers
+	 */
+	pos = __atomic_load_n(&(p->enqpos), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		cell = &(p->cells[pos & p->mask]);
+		seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		if(seq == pos)
+		{
+			if(__atomic_compare_exchange_n(&(p->enqpos), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else
+		{
+			pos = __atomic_load_n(&(p->enqpos), __ATOMIC_RELAXED);
+		}
+	}
+	cell->obj = obj;
+	__atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+	sem_post(&(p->items));
+}
+
+static CRAWLOBJ *
+pipeline_get_(PIPELINE *p)
+{
+	struct pipeline_cell *cell;
+	CRAWLOBJ *obj;
+	size_t pos, seq;
+	
+	while(sem_wait(&(p->items)) && errno == EINTR);
+	pos = __atomic_load_n(&(p->deqpos), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		cell = &(p->cells[pos & p->mask]);
+		seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		if(seq == pos + 1)
+		{
+			if(__atomic_compare_exchange_n(&(p->deqpos), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else
+		{
+			pos = __atomic_load_n(&(p->deqpos), __ATOMIC_RELAXED);
+		}
+	}
+	obj = cell->obj;
+	__atomic_store_n(&(cell->seq), pos + p->mask + 1, __ATOMIC_RELEASE);
+	sem_post(&(p->slots));
+	return obj;
+}
+
+static void *
+pipeline_thread_(void *arg)
+{
+	struct pipeline_worker *worker;
+	CRAWLOBJ *obj;
+	
+	worker = (struct pipeline_worker *) arg;
+	while((obj = pipeline_get_(worker->pipeline)))
+	{
+		processor_process(worker->pipeline->crawl, worker->processor, obj);
+		crawl_obj_destroy(obj);
+	}
+	return NULL;
+}
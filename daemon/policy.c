@@ -208,7 +208,6 @@ policy_checkpoint(CRAWL *crawl, CRAWLOBJ *obj, int *status, void *userdata)
 {
 	int n, c;
 	const char *type;
-	char *s, *t;
 	
 	(void) crawl;
 	(void) userdata;
@@ -217,38 +216,19 @@ policy_checkpoint(CRAWL *crawl, CRAWLOBJ *obj, int *status, void *userdata)
 	{
 		return 0;
 	}
-	type = crawl_obj_type(obj);
+	/* The media type is lower-cased and stripped of its parameters */
+	type = crawl_obj_media_type(obj);
 	if(!type)
 	{
 		type = "";
 	}
-	s = strdup(type);
-	if(!s)
-	{
-		return -1;
-	}
-	t = strchr(s, ';');
-	if(t)
-	{
-		*t = 0;
-		t--;
-		while(t > s)
-		{
-			if(!isspace(*t))
-			{
-				break;
-			}
-			*t = 0;
-			t--;
-		}
-	}
-	log_printf(LOG_DEBUG, "Policy: content type is '%s', status is '%d'\n", s, *status);
+	log_printf(LOG_DEBUG, "Policy: content type is '%s', status is '%d'\n", type, *status);
 	if(types_whitelist && types_whitelist[0])
 	{
 		n = 0;
 		for(c = 0; types_whitelist[c]; c++)
 		{
-			if(!strcasecmp(types_whitelist[c], s))
+			if(!strcasecmp(types_whitelist[c], type))
 			{
 				n = c;
 				break;
@@ -256,8 +236,7 @@ policy_checkpoint(CRAWL *crawl, CRAWLOBJ *obj, int *status, void *userdata)
 		}
 		if(!n)
 		{
-			log_printf(LOG_DEBUG, "Policy: type '%s' not matched by whitelist\n", s);
-			free(s);
+			log_printf(LOG_DEBUG, "Policy: type '%s' not matched by whitelist\n", type);
 			*status = 406;
 			return 1;
 		}
@@ -266,15 +245,13 @@ policy_checkpoint(CRAWL *crawl, CRAWLOBJ *obj, int *status, void *userdata)
 	{
 		for(c = 0; types_blacklist[c]; c++)
 		{
-			if(!strcasecmp(types_blacklist[c], s))
+			if(!strcasecmp(types_blacklist[c], type))
 			{
-				log_printf(LOG_DEBUG, "Policy: type '%s' is blacklisted\n", s);
-				free(s);
+				log_printf(LOG_DEBUG, "Policy: type '%s' is blacklisted\n", type);
 				*status = 406;
 				return 1;
 			}
 		}
 	}
-	free(s);
 	return 0;
 }
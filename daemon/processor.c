@@ -23,6 +23,7 @@
 static int processor_handler(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata);
 static int processor_unchanged_handler(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata);
 static int processor_failed_handler(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata);
+static time_t processor_freshness_(CRAWLOBJ *obj);
 
 int
 processor_init(void)
@@ -39,16 +40,37 @@ processor_cleanup(void)
 int
 processor_init_crawler(CRAWL *crawl, CONTEXT *data)
 {
+	int nthreads, depth;
+	
 	data->processor = rdf_create(crawl);
 	if(!data->processor)
 	{
 		return -1;
 	}
+	/* Hand updated objects to a pool of processing threads, if configured;
+	 * their updates can only be passed to the queue safely if it's buffered
+	 */
+	nthreads = config_get_int("crawl:processors", 0);
+	if(nthreads > 0 && config_get_int("queue:buffer", QUEUE_DEFAULT_BUFFER) < 1)
+	{
+		log_printf(LOG_WARNING, "crawl:processors requires queue:buffer to be non-zero; objects will be processed by the crawl thread\n");
+		nthreads = 0;
+	}
+	if(nthreads > 0)
+	{
+		depth = config_get_int("crawl:pipeline-depth", PIPELINE_DEFAULT_DEPTH);
+		data->pipeline = pipeline_create(crawl, nthreads, (depth > 0 ? depth : PIPELINE_DEFAULT_DEPTH));
+		if(!data->pipeline)
+		{
+			data->processor->api->release(data->processor);
+			data->processor = NULL;
+			return -1;
+		}
+	}
 	crawl_set_updated(crawl, processor_handler);
 	crawl_set_unchanged(crawl, processor_unchanged_handler);
 	crawl_set_failed(crawl, processor_failed_handler);
 	return 0;
-	return 0;
 }
 
 int
@@ -56,6 +78,9 @@ processor_cleanup_crawler(CRAWL *crawl, CONTEXT *data)
 {
 	(void) crawl;
 	
+	/* Wait for anything still in the pipeline to be processed */
+	pipeline_destroy(data->pipeline);
+	data->pipeline = NULL;
 	if(!data->processor)
 	{
 		return 0;
@@ -69,17 +94,29 @@ static int
 processor_handler(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata)
 {
 	CONTEXT *data;
-	PROCESSOR *pdata;
-	const char *content_type, *uri, *location;
-	int r, status;
 	
 	(void) prevtime;
 	
 	data = (CONTEXT *) userdata;
-	pdata = data->processor;
+	if(data->pipeline)
+	{
+		return pipeline_push(data->pipeline, obj);
+	}
+	return processor_process(crawl, data->processor, obj);
+}
+
+/* Process an updated object and record the outcome; this may be invoked
+ * either by the crawl thread or by a pipeline's processing threads
+ */
+int
+processor_process(CRAWL *crawl, PROCESSOR *pdata, CRAWLOBJ *obj)
+{
+	const char *content_type, *uri, *location;
+	int r, status;
+	
 	uri = crawl_obj_uristr(obj);
 	location = crawl_obj_redirect(obj);
-	content_type = crawl_obj_type(obj);
+	content_type = crawl_obj_media_type(obj);
 	log_printf(LOG_DEBUG, "processor_handler: URI is '%s', Content-Type is '%s'\n", uri, content_type);
 	status = crawl_obj_status(obj);
 	/* If there's a redirect, ensure the redirect target will be crawled */
@@ -89,10 +126,33 @@ processor_handler(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata)
 	}
 	log_printf(LOG_DEBUG, "processor_handler: object has been updated\n");
 	r = pdata->api->process(pdata, obj, uri, content_type);
-	queue_updated_uristr(crawl, uri, crawl_obj_updated(obj), crawl_obj_updated(obj), crawl_obj_status(obj), 3600);
+	queue_updated_uristr(crawl, uri, crawl_obj_updated(obj), crawl_obj_updated(obj), crawl_obj_status(obj), processor_freshness_(obj));
 	return r;
 }
 
+/* Determine the freshness lifetime of an object from its Cache-Control
+ * max-age or, failing that, its Expires header; the queue won't schedule
+ * another fetch before this has elapsed
+ */
+static time_t
+processor_freshness_(CRAWLOBJ *obj)
+{
+	time_t expires;
+	long max_age;
+	
+	max_age = crawl_obj_max_age(obj);
+	if(max_age >= 0)
+	{
+		return (time_t) max_age;
+	}
+	expires = crawl_obj_expires(obj);
+	if(expires > crawl_obj_updated(obj))
+	{
+		return expires - crawl_obj_updated(obj);
+	}
+	return 0;
+}
+
 static int
 processor_unchanged_handler(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata)
 {
@@ -21,11 +21,43 @@
 #include "p_crawld.h"
 
 static int queue_handler(CRAWL *crawl, URI **next, void *userdata);
+static RECENT *queue_recent_get_(void);
+static int queue_recent_(const char *uristr);
+static void queue_recent_add_(const char *uristr);
+static void queue_recent_report_(RECENT *recent);
+static void queue_recent_destroy_(void *recent);
+
+/* Idle crawl threads wait on queue_cond until either the time their queue
+ * expects work to be due, or until the generation is advanced by
+ * queue_notify() (when a queue module has stored new URIs, or on shutdown).
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long queue_gen;
+static int queue_waiters;
+
+/* Each thread which adds URIs to a queue (crawl and processing threads
+ * alike) remembers those it added recently, and drops repeated additions
+ * of them without passing them to the queue module
+ */
+static pthread_key_t queue_recent_key;
+static size_t queue_recent_size;
 
 /* Global initialisation */
 int
 queue_init(void)
 {
+	int size;
+	
+	size = config_get_int("queue:recent", RECENT_DEFAULT_SIZE);
+	if(size > 0)
+	{
+		if(pthread_key_create(&queue_recent_key, queue_recent_destroy_))
+		{
+			return -1;
+		}
+		queue_recent_size = size;
+	}
 	return 0;
 }
 
@@ -33,6 +65,8 @@ queue_init(void)
 int
 queue_cleanup(void)
 {
+	buffer_cleanup();
+	sched_cleanup();
 	return 0;
 }
 
@@ -40,11 +74,43 @@ queue_cleanup(void)
 int
 queue_init_crawler(CRAWL *crawler, CONTEXT *ctx)
 {
-	ctx->queue = db_create(ctx);
+	QUEUE *buffer;
+	const char *module;
+	int capacity;
+	
+	module = ctx->api->config_get(ctx, "global:queue", "db");
+	if(!strcmp(module, "db"))
+	{
+		ctx->queue = db_create(ctx);
+	}
+#ifdef WITH_SQLITE3
+	else if(!strcmp(module, "sqlite"))
+	{
+		ctx->queue = sqlite_create(ctx);
+	}
+#endif
+	else
+	{
+		log_printf(LOG_CRIT, "Unsupported queue module '%s' specified in [global] section of the configuration file\n", module);
+		return -1;
+	}
 	if(!ctx->queue)
 	{
 		return -1;
 	}
+	/* Stage updates in memory so that crawling doesn't wait on them */
+	capacity = config_get_int("queue:buffer", QUEUE_DEFAULT_BUFFER);
+	if(capacity > 0)
+	{
+		buffer = buffer_create(ctx->queue, capacity);
+		if(!buffer)
+		{
+			ctx->queue->api->release(ctx->queue);
+			ctx->queue = NULL;
+			return -1;
+		}
+		ctx->queue = buffer;
+	}
 	crawl_set_next(crawler, queue_handler);
 	return 0;
 }
@@ -68,18 +134,92 @@ int
 queue_add_uristr(CRAWL *crawl, const char *uristr)
 {
 	CONTEXT *data;
+	int r;
 	
+	if(queue_recent_(uristr))
+	{
+		return 0;
+	}
 	data = crawl_userdata(crawl);	
-	return data->queue->api->add_uristr(data->queue, uristr);
+	r = data->queue->api->add_uristr(data->queue, uristr);
+	if(!r)
+	{
+		queue_recent_add_(uristr);
+	}
+	return r;
 }
 
 int
 queue_add_uri(CRAWL *crawl, URI *uri)
 {
 	CONTEXT *data;
+	char *uristr;
+	int r;
 	
+	/* The filter works on strings, so a URI is only flattened if it's
+	 * enabled
+	 */
+	uristr = NULL;
+	if(queue_recent_size)
+	{
+		uristr = uri_stralloc(uri);
+		if(!uristr)
+		{
+			return -1;
+		}
+		if(queue_recent_(uristr))
+		{
+			free(uristr);
+			return 0;
+		}
+	}
 	data = crawl_userdata(crawl);	
-	return data->queue->api->add_uri(data->queue, uri);
+	r = data->queue->api->add_uri(data->queue, uri);
+	if(!r && uristr)
+	{
+		queue_recent_add_(uristr);
+	}
+	free(uristr);
+	return r;
+}
+
+/* Add a set of URIs (such as the links found in a document) at once */
+int
+queue_add_uristrs(CRAWL *crawl, const char **uristrs, size_t count)
+{
+	CONTEXT *data;
+	const char **list;
+	size_t c, n;
+	int r;
+	
+	list = (const char **) malloc(sizeof(const char *) * (count ? count : 1));
+	if(!list)
+	{
+		return -1;
+	}
+	for(c = 0, n = 0; c < count; c++)
+	{
+		if(!queue_recent_(uristrs[c]))
+		{
+			list[n] = uristrs[c];
+			n++;
+		}
+	}
+	r = 0;
+	if(n)
+	{
+		data = crawl_userdata(crawl);
+		r = data->queue->api->add_uristrs(data->queue, list, n);
+	}
+	/* Only once they've been stored are the URIs remembered, so that a
+	 * failed addition doesn't cause later ones to be dropped
+	 */
+	for(c = 0; !r && c < n; c++)
+	{
+		queue_recent_add_(list[c]);
+	}
+	free(list);
+	return r;
 }
 
 int
@@ -118,6 +258,81 @@ queue_unchanged_uri(CRAWL *crawl, URI *uri, int error)
 	return data->queue->api->unchanged_uri(data->queue, uri, error);
 }
 
+/* Obtain the number of milliseconds until the crawler's queue expects work
+ * to be due, or -1 if it's empty
+ */
+long
+queue_due(CRAWL *crawl)
+{
+	CONTEXT *data;
+	
+	data = crawl_userdata(crawl);
+	if(!data->queue->api->due)
+	{
+		return -1;
+	}
+	return data->queue->api->due(data->queue);
+}
+
+/* Obtain the current generation, to be passed to queue_wait() */
+unsigned long
+queue_generation(void)
+{
+	unsigned long gen;
+	
+	pthread_mutex_lock(&queue_lock);
+	gen = queue_gen;
+	pthread_mutex_unlock(&queue_lock);
+	return gen;
+}
+
+/* Wake any threads waiting in queue_wait() */
+void
+queue_notify(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	queue_gen++;
+	if(queue_waiters)
+	{
+		pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Wait for up to maxwait milliseconds, returning early if queue_notify() is
+ * invoked (or has been since the generation was obtained)
+ */
+int
+queue_wait(unsigned long generation, long maxwait)
+{
+	struct timespec ts;
+	
+	if(maxwait <= 0)
+	{
+		return 0;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += maxwait / 1000;
+	ts.tv_nsec += (maxwait % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&queue_lock);
+	queue_waiters++;
+	while(queue_gen == generation)
+	{
+		if(pthread_cond_timedwait(&queue_cond, &queue_lock, &ts) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	queue_waiters--;
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
 static int
 queue_handler(CRAWL *crawl, URI **next, void *userdata)
 {
@@ -126,6 +341,95 @@ queue_handler(CRAWL *crawl, URI **next, void *userdata)
 	(void) crawl;
 	
 	data = (CONTEXT *) userdata;
-	
+	/* Once a shutdown has been requested, hand out nothing more, so that
+	 * crawl_perform() and crawl_perform_multi() return as soon as the
+	 * fetches already under way have completed
+	 */
+	if(thread_stopping())
+	{
+		*next = NULL;
+		return 0;
+	}
 	return data->queue->api->next(data->queue, next);
 }
+
+/* Obtain the calling thread's filter, creating it if needed; returns NULL
+ * if the filter is disabled or can't be created
+ */
+static RECENT *
+queue_recent_get_(void)
+{
+	RECENT *recent;
+	
+	if(!queue_recent_size)
+	{
+		return NULL;
+	}
+	recent = (RECENT *) pthread_getspecific(queue_recent_key);
+	if(!recent)
+	{
+		recent = recent_create(queue_recent_size);
+		if(!recent || pthread_setspecific(queue_recent_key, recent))
+		{
+			recent_destroy(recent);
+			return NULL;
+		}
+	}
+	return recent;
+}
+
+/* Returns 1 if the calling thread has added a URI recently */
+static int
+queue_recent_(const char *uristr)
+{
+	RECENT *recent;
+	unsigned long lookups, hits;
+	int r;
+	
+	recent = queue_recent_get_();
+	if(!recent)
+	{
+		return 0;
+	}
+	r = recent_check(recent, uristr);
+	recent_stats(recent, &lookups, &hits);
+	if(!(lookups % RECENT_REPORT_INTERVAL))
+	{
+		queue_recent_report_(recent);
+	}
+	return r;
+}
+
+/* Remember a URI which the calling thread has successfully added */
+static void
+queue_recent_add_(const char *uristr)
+{
+	RECENT *recent;
+	
+	recent = queue_recent_get_();
+	if(recent)
+	{
+		recent_add(recent, uristr);
+	}
+}
+
+static void
+queue_recent_report_(RECENT *recent)
+{
+	unsigned long lookups, hits;
+	
+	recent_stats(recent, &lookups, &hits);
+	if(lookups)
+	{
+		log_printf(LOG_INFO, "queue: %lu of %lu additions (%.1f%%) were of recently-added URIs\n",
+			hits, lookups, (hits * 100.0) / lookups);
+	}
+}
+
+/* Invoked on thread exit */
+static void
+queue_recent_destroy_(void *recent)
+{
+	queue_recent_report_((RECENT *) recent);
+	recent_destroy((RECENT *) recent);
+}
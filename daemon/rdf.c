@@ -34,6 +34,9 @@ static int rdf_preprocess(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const c
 static int rdf_postprocess(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *content_type);
 static int rdf_process_obj(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *content_type);
 static int rdf_process_node(PROCESSOR *me, CRAWLOBJ *obj, librdf_node *node);
+static int rdf_add_links_(PROCESSOR *me);
+static void rdf_free_links_(PROCESSOR *me);
+static int rdf_compare_links_(const void *a, const void *b);
 
 static struct processor_api_struct rdf_api = {
 	NULL,
@@ -51,9 +54,12 @@ struct processor_struct
 	librdf_storage *storage;
 	librdf_model *model;
 	librdf_uri *uri;
-	char *content_type;
 	const char *parser_type;
 	FILE *fobj;
+	/* The URIs found in the document being processed */
+	char **links;
+	size_t nlinks;
+	size_t linksize;
 };
 
 PROCESSOR *
@@ -98,7 +104,8 @@ rdf_release(PROCESSOR *me)
 		{
 			librdf_free_world(me->world);
 		}
-		free(me->content_type);
+		rdf_free_links_(me);
+		free(me->links);
 		free(me);
 		return 0;
 	}
@@ -126,9 +133,6 @@ static int
 rdf_preprocess(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *content_type)
 {
 	int status;
-	char *t;
-	
-	(void) obj;
 	
 	status = crawl_obj_status(obj);
 	if(status < 200 || status > 299)
@@ -143,22 +147,6 @@ rdf_preprocess(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *conten
 		errno = EINVAL;
 		return -1;
 	}
-	me->content_type = strdup(content_type);
-	t = strchr(me->content_type, ';');
-	if(t)
-	{
-		*t = 0;
-		t--;
-		while(t > me->content_type)
-		{
-			if(!isspace(*t))
-			{
-				break;
-			}
-			*t = 0;
-			t--;
-		}
-	}
 	me->model = librdf_new_model(me->world, me->storage, NULL);
 	if(!me->model)
 	{
@@ -170,26 +158,26 @@ rdf_preprocess(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *conten
 		return -1;
 	}
 	me->parser_type = NULL;
-	if(!strcmp(me->content_type, "text/turtle"))
+	if(!strcmp(content_type, "text/turtle"))
 	{
 		me->parser_type = "turtle";
 	}
-	else if(!strcmp(me->content_type, "application/rdf+xml"))
+	else if(!strcmp(content_type, "application/rdf+xml"))
 	{
 		me->parser_type = "rdfxml";
 	}
-	else if(!strcmp(me->content_type, "text/n3"))
+	else if(!strcmp(content_type, "text/n3"))
 	{
 		me->parser_type = "turtle";
 	}
-	else if(!strcmp(me->content_type, "text/plain"))
+	else if(!strcmp(content_type, "text/plain"))
 	{
 		me->parser_type = "ntriples";
 	}
-	log_printf(LOG_DEBUG, "rdf_preprocess: content_type='%s', parser_type='%s'\n", me->content_type, me->parser_type);
+	log_printf(LOG_DEBUG, "rdf_preprocess: content_type='%s', parser_type='%s'\n", content_type, me->parser_type);
 	if(!me->parser_type)
 	{
-		log_printf(LOG_WARNING, "RDF: No suitable parser type found for '%s'\n", me->content_type);
+		log_printf(LOG_WARNING, "RDF: No suitable parser type found for '%s'\n", content_type);
 		errno = EINVAL;
 		return -1;
 	}
@@ -218,8 +206,7 @@ rdf_postprocess(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *conte
 		librdf_free_model(me->model);
 		me->model = NULL;
 	}
-	free(me->content_type);
-	me->content_type = NULL;
+	rdf_free_links_(me);
 	return 0;
 }
 
@@ -267,13 +254,15 @@ rdf_process_obj(PROCESSOR *me, CRAWLOBJ *obj, const char *uri, const char *conte
 		librdf_stream_next(stream);
 	}
 	librdf_free_stream(stream);
-	return 0;
+	return rdf_add_links_(me);
 }
 
+/* Add a resource node's URI to the list of links found in the document */
 static int
 rdf_process_node(PROCESSOR *me, CRAWLOBJ *obj, librdf_node *node)
 {
 	librdf_uri *uri;
+	char **p, *s;
 	
 	(void) obj;
 	
@@ -286,5 +275,73 @@ rdf_process_node(PROCESSOR *me, CRAWLOBJ *obj, librdf_node *node)
 	{
 		return -1;
 	}
-	return queue_add_uristr(me->crawl, (const char *) librdf_uri_as_string(uri));
+	if(me->nlinks + 1 > me->linksize)
+	{
+		p = (char **) realloc(me->links, sizeof(char *) * (me->linksize + RDF_LINKS_BLOCK));
+		if(!p)
+		{
+			return -1;
+		}
+		me->links = p;
+		me->linksize += RDF_LINKS_BLOCK;
+	}
+	s = strdup((const char *) librdf_uri_as_string(uri));
+	if(!s)
+	{
+		return -1;
+	}
+	me->links[me->nlinks] = s;
+	me->nlinks++;
+	return 0;
+}
+
+/* Add the links found in a document to the queue all at once, each only
+ * once however many times it appeared
+ */
+static int
+rdf_add_links_(PROCESSOR *me)
+{
+	size_t c, n;
+	int r;
+	
+	if(!me->nlinks)
+	{
+		return 0;
+	}
+	qsort(me->links, me->nlinks, sizeof(char *), rdf_compare_links_);
+	for(c = 1, n = 1; c < me->nlinks; c++)
+	{
+		if(strcmp(me->links[c], me->links[n - 1]))
+		{
+			me->links[n] = me->links[c];
+			n++;
+		}
+		else
+		{
+			free(me->links[c]);
+		}
+	}
+	me->nlinks = n;
+	log_printf(LOG_DEBUG, "rdf_process_obj: adding %lu distinct links\n", (unsigned long) n);
+	r = queue_add_uristrs(me->crawl, (const char **) me->links, me->nlinks);
+	rdf_free_links_(me);
+	return r;
+}
+
+static void
+rdf_free_links_(PROCESSOR *me)
+{
+	size_t c;
+	
+	for(c = 0; c < me->nlinks; c++)
+	{
+		free(me->links[c]);
+	}
+	me->nlinks = 0;
+}
+
+static int
+rdf_compare_links_(const void *a, const void *b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
 }
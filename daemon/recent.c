@@ -0,0 +1,187 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_crawld.h"
+
+/* Recently-added URI filter
+ *
+ * A fixed-size, set-associative table of 128-bit hashes of the URIs which
+ * have recently been added to the queue. The set for a URI is chosen by its
+ * hash; within a set, entries are replaced in CLOCK order: each entry has a
+ * reference bit which is set when it's matched, and the set's hand skips
+ * (and clears) referenced entries when choosing one to replace, so that URIs
+ * which keep recurring stay in the table.
+ *
+ * The hash is of the URI as given rather than its cache key, so that a hit
+ * costs neither parsing nor a digest; a URI written two different ways
+ * simply occupies two entries.
+ */
+
+struct recent_entry
+{
+	uint64_t hi;
+	uint64_t lo;
+};
+
+struct recent_struct
+{
+	struct recent_entry *entries;
+	unsigned char *refs;
+	unsigned char *hands;
+	size_t nsets;
+	unsigned long lookups;
+	unsigned long hits;
+};
+
+static void recent_hash_(const char *uristr, uint64_t *hi, uint64_t *lo);
+
+/* Create a filter holding up to (approximately) size URIs */
+RECENT *
+recent_create(size_t size)
+{
+	RECENT *p;
+	
+	p = (RECENT *) calloc(1, sizeof(RECENT));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->nsets = (size + RECENT_WAYS - 1) / RECENT_WAYS;
+	if(!p->nsets)
+	{
+		p->nsets = 1;
+	}
+	p->entries = (struct recent_entry *) calloc(p->nsets * RECENT_WAYS, sizeof(struct recent_entry));
+	p->refs = (unsigned char *) calloc(p->nsets, RECENT_WAYS);
+	p->hands = (unsigned char *) calloc(p->nsets, 1);
+	if(!p->entries || !p->refs || !p->hands)
+	{
+		recent_destroy(p);
+		return NULL;
+	}
+	return p;
+}
+
+void
+recent_destroy(RECENT *recent)
+{
+	if(!recent)
+	{
+		return;
+	}
+	free(recent->hands);
+	free(recent->refs);
+	free(recent->entries);
+	free(recent);
+}
+
+/* Returns 1 if a URI has been recorded recently, or 0 if not */
+int
+recent_check(RECENT *recent, const char *uristr)
+{
+	struct recent_entry *set;
+	unsigned char *refs;
+	uint64_t hi, lo;
+	size_t s, c;
+	
+	recent_hash_(uristr, &hi, &lo);
+	s = (size_t) (hi % recent->nsets);
+	set = &(recent->entries[s * RECENT_WAYS]);
+	refs = &(recent->refs[s * RECENT_WAYS]);
+	recent->lookups++;
+	for(c = 0; c < RECENT_WAYS; c++)
+	{
+		if(set[c].hi == hi && set[c].lo == lo)
+		{
+			refs[c] = 1;
+			recent->hits++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Record a URI, replacing an older entry in its set; this should only be
+ * done once recent_check() has found it to be absent
+ */
+void
+recent_add(RECENT *recent, const char *uristr)
+{
+	struct recent_entry *set;
+	unsigned char *refs;
+	uint64_t hi, lo;
+	size_t s, c;
+	
+	recent_hash_(uristr, &hi, &lo);
+	s = (size_t) (hi % recent->nsets);
+	set = &(recent->entries[s * RECENT_WAYS]);
+	refs = &(recent->refs[s * RECENT_WAYS]);
+	/* Advance the hand past referenced entries, giving each a second
+	 * chance; this stops after at most one revolution
+	 */
+	c = recent->hands[s];
+	while(refs[c])
+	{
+		refs[c] = 0;
+		c = (c + 1) % RECENT_WAYS;
+	}
+	set[c].hi = hi;
+	set[c].lo = lo;
+	recent->hands[s] = (unsigned char) ((c + 1) % RECENT_WAYS);
+}
+
+/* Obtain the number of URIs checked and the number found */
+void
+recent_stats(RECENT *recent, unsigned long *lookups, unsigned long *hits)
+{
+	*lookups = recent->lookups;
+	*hits = recent->hits;
+}
+
+/* Two 64-bit hashes computed in a single pass: FNV-1a, and a multiply-add
+ * hash with its own seed, multiplier and per-byte shift, so that a
+ * collision in one is unlikely to coincide with a collision in the other;
+ * each is finished with a different multiply and shift mix. An all-zero
+ * result (which would match an empty entry) is avoided by setting the low
+ * bit.
+ */
+static void
+recent_hash_(const char *uristr, uint64_t *hi, uint64_t *lo)
+{
+	const unsigned char *s;
+	uint64_t a, b;
+	
+	a = 14695981039346656037ULL;
+	b = 0x9e3779b97f4a7c15ULL;
+	for(s = (const unsigned char *) uristr; *s; s++)
+	{
+		a = (a ^ *s) * 1099511628211ULL;
+		b = (b + *s) * 0x9fb21c651e98df25ULL;
+		b ^= b >> 29;
+	}
+	a ^= a >> 33;
+	a *= 0xff51afd7ed558ccdULL;
+	a ^= a >> 33;
+	b ^= b >> 32;
+	b *= 0xc4ceb9fe1a85ec53ULL;
+	b ^= b >> 29;
+	*hi = a;
+	*lo = b | 1;
+}
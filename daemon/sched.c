@@ -0,0 +1,668 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_crawld.h"
+
+/* In-process politeness scheduling
+ *
+ * Each queue has its own scheduler, which holds the URIs it has loaded
+ * grouped by root, and a min-heap of those roots ordered by the time at
+ * which each may next be fetched from. The time at which a root was last
+ * fetched from is shared by every thread in the process (by way of the host
+ * table), so that however many threads are crawling, each root is only
+ * fetched from once in every 'rate' milliseconds.
+ *
+ * Because another thread may push a root's ready time back after it was
+ * added to a heap, the ready time of the root at the top of the heap is
+ * checked against the host table when it's popped, and the root is re-sifted
+ * if it has changed.
+ *
+ * Host entries are referenced by the roots which use them. Once an entry is
+ * unreferenced and its ready time has passed it holds nothing of value, and
+ * is freed when the table is next swept; the table is swept whenever it
+ * becomes full, and only grown if the sweep leaves it more than half full,
+ * so that it's sized to the hosts which are actually live.
+ */
+
+struct sched_host
+{
+	struct sched_host *next;
+	char key[SCHED_KEY_LEN + 1];
+	uint64_t ready;
+	unsigned long refcount;
+};
+
+struct sched_uri
+{
+	struct sched_uri *next;
+	char uri[1];
+};
+
+struct sched_root
+{
+	struct sched_root *next;
+	char key[SCHED_KEY_LEN + 1];
+	uint64_t ready;
+	int rate;
+	size_t heapidx;
+	struct sched_host *host;
+	struct sched_uri *head;
+	struct sched_uri *tail;
+};
+
+struct sched_struct
+{
+	struct sched_root *roots[SCHED_BUCKETS];
+	struct sched_root **heap;
+	size_t heapcount;
+	size_t heapsize;
+	size_t pending;
+};
+
+static unsigned int sched_hash_(const char *key, size_t buckets);
+static struct sched_host *sched_host_(const char *key);
+static void sched_host_release_(struct sched_host *host);
+static void sched_host_sweep_(void);
+static int sched_host_grow_(void);
+static void sched_swap_(SCHED *sched, size_t a, size_t b);
+static void sched_up_(SCHED *sched, size_t idx);
+static void sched_down_(SCHED *sched, size_t idx);
+static void sched_remove_root_(SCHED *sched, struct sched_root *root);
+
+static struct sched_host **hosts;
+static size_t hostsize, hostcount;
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Obtain the current time in milliseconds */
+uint64_t
+sched_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+SCHED *
+sched_create(void)
+{
+	return (SCHED *) calloc(1, sizeof(SCHED));
+}
+
+void
+sched_destroy(SCHED *sched)
+{
+	struct sched_root *root;
+	struct sched_uri *uri;
+	size_t c;
+	
+	if(!sched)
+	{
+		return;
+	}
+	for(c = 0; c < SCHED_BUCKETS; c++)
+	{
+		while(sched->roots[c])
+		{
+			root = sched->roots[c];
+			sched->roots[c] = root->next;
+			while(root->head)
+			{
+				uri = root->head;
+				root->head = uri->next;
+				free(uri);
+			}
+			sched_host_release_(root->host);
+			free(root);
+		}
+	}
+	free(sched->heap);
+	free(sched);
+}
+
+/* Free the shared host table */
+void
+sched_cleanup(void)
+{
+	struct sched_host *host;
+	size_t c;
+	
+	pthread_mutex_lock(&host_lock);
+	for(c = 0; c < hostsize; c++)
+	{
+		while(hosts[c])
+		{
+			host = hosts[c];
+			hosts[c] = host->next;
+			free(host);
+		}
+	}
+	free(hosts);
+	hosts = NULL;
+	hostsize = 0;
+	hostcount = 0;
+	pthread_mutex_unlock(&host_lock);
+}
+
+/* Obtain the number of URIs held by a scheduler */
+size_t
+sched_pending(SCHED *sched)
+{
+	return sched->pending;
+}
+
+/* Add a URI to the scheduler; rate is the minimum interval, in
+ * milliseconds, between fetches from its root
+ */
+int
+sched_add(SCHED *sched, const char *rootkey, int rate, const char *uristr)
+{
+	struct sched_root *root, **p;
+	struct sched_uri *uri;
+	unsigned int h;
+	size_t len;
+	
+	len = strlen(uristr);
+	uri = (struct sched_uri *) malloc(sizeof(struct sched_uri) + len);
+	if(!uri)
+	{
+		return -1;
+	}
+	uri->next = NULL;
+	memcpy(uri->uri, uristr, len + 1);
+	h = sched_hash_(rootkey, SCHED_BUCKETS);
+	for(root = sched->roots[h]; root; root = root->next)
+	{
+		if(!strcmp(root->key, rootkey))
+		{
+			break;
+		}
+	}
+	if(!root)
+	{
+		if(sched->heapcount + 1 > sched->heapsize)
+		{
+			p = (struct sched_root **) realloc(sched->heap, sizeof(struct sched_root *) * (sched->heapsize + SCHED_HEAP_BLOCK));
+			if(!p)
+			{
+				free(uri);
+				return -1;
+			}
+			sched->heap = p;
+			sched->heapsize += SCHED_HEAP_BLOCK;
+		}
+		root = (struct sched_root *) calloc(1, sizeof(struct sched_root));
+		if(!root)
+		{
+			free(uri);
+			return -1;
+		}
+		pthread_mutex_lock(&host_lock);
+		root->host = sched_host_(rootkey);
+		if(root->host)
+		{
+			root->host->refcount++;
+			root->ready = root->host->ready;
+		}
+		pthread_mutex_unlock(&host_lock);
+		if(!root->host)
+		{
+			free(root);
+			free(uri);
+			return -1;
+		}
+		strncpy(root->key, rootkey, SCHED_KEY_LEN);
+		root->next = sched->roots[h];
+		sched->roots[h] = root;
+		root->heapidx = sched->heapcount;
+		sched->heap[sched->heapcount] = root;
+		sched->heapcount++;
+		sched_up_(sched, root->heapidx);
+	}
+	root->rate = (rate > 0 ? rate : 0);
+	if(root->tail)
+	{
+		root->tail->next = uri;
+	}
+	else
+	{
+		root->head = uri;
+	}
+	root->tail = uri;
+	sched->pending++;
+	return 0;
+}
+
+/* Obtain the next URI whose root is ready to be fetched from, if any,
+ * which the caller must free; if none is ready, returns 0 and sets *wait to
+ * the number of milliseconds until one will be (or 0 if there are no URIs)
+ */
+int
+sched_next(SCHED *sched, char **uristr, uint64_t *wait)
+{
+	struct sched_root *root;
+	struct sched_uri *uri;
+	uint64_t now, ready;
+	size_t len;
+	
+	*uristr = NULL;
+	*wait = 0;
+	now = sched_now();
+	while(sched->heapcount)
+	{
+		root = sched->heap[0];
+		pthread_mutex_lock(&host_lock);
+		ready = root->host->ready;
+		if(ready <= root->ready && ready <= now)
+		{
+			/* A URI will be taken: claim the root for the next 'rate'
+			 * milliseconds
+			 */
+			root->host->ready = now + root->rate;
+		}
+		pthread_mutex_unlock(&host_lock);
+		if(ready > root->ready)
+		{
+			/* Another thread has fetched from this root since it was
+			 * sifted
+			 */
+			root->ready = ready;
+			sched_down_(sched, 0);
+			continue;
+		}
+		if(ready > now)
+		{
+			*wait = ready - now;
+			return 0;
+		}
+		uri = root->head;
+		root->head = uri->next;
+		if(!root->head)
+		{
+			root->tail = NULL;
+		}
+		sched->pending--;
+		len = strlen(uri->uri);
+		memmove(uri, uri->uri, len + 1);
+		*uristr = (char *) uri;
+		if(root->head)
+		{
+			root->ready = now + root->rate;
+			sched_down_(sched, 0);
+		}
+		else
+		{
+			sched_remove_root_(sched, root);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Ensure that a root isn't fetched from by any thread for at least delay
+ * milliseconds; its ready time is pushed back, but never brought forward
+ */
+int
+sched_defer(const char *rootkey, uint64_t delay)
+{
+	struct sched_host *host;
+	uint64_t ready;
+	
+	ready = sched_now() + delay;
+	pthread_mutex_lock(&host_lock);
+	host = sched_host_(rootkey);
+	if(host && host->ready < ready)
+	{
+		host->ready = ready;
+	}
+	pthread_mutex_unlock(&host_lock);
+	return (host ? 0 : -1);
+}
+
+/* Write the contents of a scheduler to a file: each root is written as a line
+ * giving its key, rate and the number of milliseconds until it's ready,
+ * followed by a line for each of its URIs, in order
+ */
+int
+sched_save(SCHED *sched, FILE *f)
+{
+	struct sched_root *root;
+	struct sched_uri *uri;
+	uint64_t now, ready;
+	size_t c;
+	
+	now = sched_now();
+	for(c = 0; c < sched->heapcount; c++)
+	{
+		root = sched->heap[c];
+		pthread_mutex_lock(&host_lock);
+		ready = root->host->ready;
+		pthread_mutex_unlock(&host_lock);
+		if(ready < root->ready)
+		{
+			ready = root->ready;
+		}
+		if(fprintf(f, "R %s %d %lu\n", root->key, root->rate, (unsigned long) (ready > now ? ready - now : 0)) < 0)
+		{
+			return -1;
+		}
+		for(uri = root->head; uri; uri = uri->next)
+		{
+			if(fprintf(f, "U %s\n", uri->uri) < 0)
+			{
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Load the contents of a scheduler written by sched_save(), returning the
+ * number of URIs loaded; ready times are pushed back, but never brought
+ * forward. If keep is non-NULL, only those URIs for which it returns
+ * nonzero are loaded.
+ */
+int
+sched_load(SCHED *sched, FILE *f, sched_keep_cb keep, void *userdata)
+{
+	char buf[SCHED_LINE_LEN], key[SCHED_KEY_LEN + 1], *s;
+	unsigned long delay;
+	int rate, count;
+	
+	key[0] = 0;
+	rate = 0;
+	count = 0;
+	while(fgets(buf, sizeof(buf), f))
+	{
+		s = strchr(buf, '\n');
+		if(!s)
+		{
+			/* Too long to be one of ours */
+			return -1;
+		}
+		*s = 0;
+		if(buf[0] == 'R' && buf[1] == ' ')
+		{
+			if(sscanf(buf + 2, "%32s %d %lu", key, &rate, &delay) != 3 ||
+				strlen(key) != SCHED_KEY_LEN)
+			{
+				return -1;
+			}
+			if(sched_defer(key, delay))
+			{
+				return -1;
+			}
+		}
+		else if(buf[0] == 'U' && buf[1] == ' ' && key[0])
+		{
+			if(keep && !keep(buf + 2, userdata))
+			{
+				continue;
+			}
+			if(sched_add(sched, key, rate, buf + 2))
+			{
+				return -1;
+			}
+			count++;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return (ferror(f) ? -1 : count);
+}
+
+/* Obtain the number of milliseconds until the earliest root in the
+ * scheduler is expected to be ready (0 if it's ready now, or if the
+ * scheduler is empty)
+ */
+uint64_t
+sched_wait(SCHED *sched)
+{
+	uint64_t now, ready;
+	
+	if(!sched->heapcount)
+	{
+		return 0;
+	}
+	now = sched_now();
+	pthread_mutex_lock(&host_lock);
+	ready = sched->heap[0]->host->ready;
+	pthread_mutex_unlock(&host_lock);
+	if(ready < sched->heap[0]->ready)
+	{
+		ready = sched->heap[0]->ready;
+	}
+	return (ready > now ? ready - now : 0);
+}
+
+static void
+sched_remove_root_(SCHED *sched, struct sched_root *root)
+{
+	struct sched_root **p;
+	size_t idx;
+	
+	idx = root->heapidx;
+	sched->heapcount--;
+	if(idx != sched->heapcount)
+	{
+		sched_swap_(sched, idx, sched->heapcount);
+		sched_down_(sched, idx);
+		sched_up_(sched, idx);
+	}
+	for(p = &(sched->roots[sched_hash_(root->key, SCHED_BUCKETS)]); *p; p = &((*p)->next))
+	{
+		if(*p == root)
+		{
+			*p = root->next;
+			break;
+		}
+	}
+	sched_host_release_(root->host);
+	free(root);
+}
+
+/* Locate (or create) the shared entry for a root; the host lock must be
+ * held
+ */
+static struct sched_host *
+sched_host_(const char *key)
+{
+	struct sched_host *host;
+	unsigned int h;
+	
+	if(hosts)
+	{
+		h = sched_hash_(key, hostsize);
+		for(host = hosts[h]; host; host = host->next)
+		{
+			if(!strcmp(host->key, key))
+			{
+				return host;
+			}
+		}
+	}
+	if(hostcount >= hostsize * SCHED_HOST_LOAD)
+	{
+		sched_host_sweep_();
+		/* Failing to grow an existing table only lengthens its chains */
+		if(hostcount >= (hostsize * SCHED_HOST_LOAD) / 2 && sched_host_grow_() && !hosts)
+		{
+			return NULL;
+		}
+	}
+	host = (struct sched_host *) calloc(1, sizeof(struct sched_host));
+	if(!host)
+	{
+		return NULL;
+	}
+	strncpy(host->key, key, SCHED_KEY_LEN);
+	h = sched_hash_(key, hostsize);
+	host->next = hosts[h];
+	hosts[h] = host;
+	hostcount++;
+	return host;
+}
+
+/* Drop a root's reference to its shared entry; the entry itself is left
+ * for the next sweep, as its ready time has usually just been pushed back
+ */
+static void
+sched_host_release_(struct sched_host *host)
+{
+	pthread_mutex_lock(&host_lock);
+	host->refcount--;
+	pthread_mutex_unlock(&host_lock);
+}
+
+/* Free any entries in the host table which are unreferenced and whose
+ * ready times have passed; the host lock must be held
+ */
+static void
+sched_host_sweep_(void)
+{
+	struct sched_host **p, *host;
+	uint64_t now;
+	size_t c;
+	
+	now = sched_now();
+	for(c = 0; c < hostsize; c++)
+	{
+		p = &(hosts[c]);
+		while(*p)
+		{
+			host = *p;
+			if(!host->refcount && host->ready <= now)
+			{
+				*p = host->next;
+				free(host);
+				hostcount--;
+				continue;
+			}
+			p = &(host->next);
+		}
+	}
+}
+
+/* Double the number of buckets in the host table (or create it, if it
+ * doesn't yet exist); the host lock must be held
+ */
+static int
+sched_host_grow_(void)
+{
+	struct sched_host **table, *host;
+	size_t size, c;
+	unsigned int h;
+	
+	size = (hostsize ? hostsize * 2 : SCHED_BUCKETS);
+	table = (struct sched_host **) calloc(size, sizeof(struct sched_host *));
+	if(!table)
+	{
+		return -1;
+	}
+	for(c = 0; c < hostsize; c++)
+	{
+		while(hosts[c])
+		{
+			host = hosts[c];
+			hosts[c] = host->next;
+			h = sched_hash_(host->key, size);
+			host->next = table[h];
+			table[h] = host;
+		}
+	}
+	free(hosts);
+	hosts = table;
+	hostsize = size;
+	return 0;
+}
+
+/* Root keys are hex-encoded digests, so their leading digits are already
+ * well-distributed; enough of them are taken to spread even a very large
+ * table
+ */
+static unsigned int
+sched_hash_(const char *key, size_t buckets)
+{
+	unsigned int h;
+	size_t c;
+	
+	h = 0;
+	for(c = 0; c < 8 && key[c]; c++)
+	{
+		h = (h * 31) + (unsigned char) key[c];
+	}
+	return (h * 2654435761U) % buckets;
+}
+
+static void
+sched_swap_(SCHED *sched, size_t a, size_t b)
+{
+	struct sched_root *t;
+	
+	t = sched->heap[a];
+	sched->heap[a] = sched->heap[b];
+	sched->heap[b] = t;
+	sched->heap[a]->heapidx = a;
+	sched->heap[b]->heapidx = b;
+}
+
+static void
+sched_up_(SCHED *sched, size_t idx)
+{
+	size_t parent;
+	
+	while(idx)
+	{
+		parent = (idx - 1) / 2;
+		if(sched->heap[parent]->ready <= sched->heap[idx]->ready)
+		{
+			break;
+		}
+		sched_swap_(sched, parent, idx);
+		idx = parent;
+	}
+}
+
+static void
+sched_down_(SCHED *sched, size_t idx)
+{
+	size_t child;
+	
+	for(;;)
+	{
+		child = (idx * 2) + 1;
+		if(child >= sched->heapcount)
+		{
+			break;
+		}
+		if(child + 1 < sched->heapcount && sched->heap[child + 1]->ready < sched->heap[child]->ready)
+		{
+			child++;
+		}
+		if(sched->heap[idx]->ready <= sched->heap[child]->ready)
+		{
+			break;
+		}
+		sched_swap_(sched, idx, child);
+		idx = child;
+	}
+}
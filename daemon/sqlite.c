@@ -0,0 +1,1306 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* crawld module for using an embedded SQLite database as a queue
+ *
+ * This is intended for crawls which run on a single node: every crawl thread
+ * in the process opens its own connection to the same database file, which
+ * is kept in WAL mode so that readers don't wait for the writer. Resources
+ * are divided between the threads by bucket, as with the 'db' module, but
+ * as there is only one instance there are no lease expiry times: a resource
+ * is marked as leased by the crawler which loaded it until its outcome is
+ * recorded, and any marked as leased by a crawler when it starts (or
+ * exits) are handed back.
+ *
+ * Times are stored as seconds since the epoch, and keys as the 16 bytes of
+ * the digest, converted from and to hex as they pass in and out.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define QUEUE_STRUCT_DEFINED           1
+/* The maximum number of resources loaded into the scheduler at once */
+#define FILL_BATCH_SIZE                64
+/* The minimum interval, in milliseconds, between queries for more resources
+ * when the previous query didn't return a full batch
+ */
+#define FILL_INTERVAL                  1000
+/* The number of the most overdue resources in the refresh lane from which
+ * each batch is chosen in order of priority
+ */
+#define FILL_REFRESH_WINDOW            1024
+/* The time, in milliseconds, for which a connection waits for another to
+ * finish writing before giving up
+ */
+#define BUSY_TIMEOUT                   60000
+/* The interval, in seconds, between fetches of a resource whose rate of
+ * change isn't yet known, and the default bounds on it
+ */
+#define REVISIT_DEFAULT_INTERVAL       7200
+#define REVISIT_DEFAULT_MIN            900
+#define REVISIT_DEFAULT_MAX            604800
+/* The default percentage of each batch reserved for newly-discovered
+ * resources; whatever either lane doesn't use is given to the other
+ */
+#define DISCOVERY_DEFAULT_SHARE        50
+#define LANE_DISCOVERY                 0
+#define LANE_REFRESH                   1
+/* Weights from which a resource's priority is calculated, as for the 'db'
+ * module
+ */
+#define PRIORITY_DEPTH_WEIGHT          10
+#define PRIORITY_INLINK_WEIGHT         1
+#define PRIORITY_INLINK_MAX            100
+#define PRIORITY_CHANGE_WEIGHT         10
+/* The default number of fetch outcomes committed together, and the
+ * default maximum time in milliseconds for which an outcome may wait
+ */
+#define COMMIT_DEFAULT_BATCH           64
+#define COMMIT_DEFAULT_INTERVAL        1000
+/* The length of a key (the first 16 bytes of the SHA-256 digest of a
+ * canonical URI), which is stored as binary
+ */
+#define KEY_LEN                        16
+/* The current schema version, stored as the database's user_version */
+#define SCHEMA_VERSION                 1
+
+#include "p_crawld.h"
+
+#include <sqlite3.h>
+
+struct sqlite_outcome;
+struct sqlite_fill;
+
+static int sqlite_open_(QUEUE *me, const char *path);
+static int sqlite_migrate_(QUEUE *me);
+static void sqlite_priority_(sqlite3_context *context, int argc, sqlite3_value **argv);
+static unsigned long sqlite_addref(QUEUE *me);
+static unsigned long sqlite_release(QUEUE *me);
+static int sqlite_next(QUEUE *me, URI **next);
+static long sqlite_due(QUEUE *me);
+static long sqlite_due_(QUEUE *me);
+static int sqlite_fill_(QUEUE *me);
+static int sqlite_fill_lane_(QUEUE *me, struct sqlite_fill *batch, int lane, int limit, time_t now);
+static void sqlite_fill_reset_(struct sqlite_fill *batch);
+static int sqlite_release_leases_(QUEUE *me);
+static int sqlite_add_uri(QUEUE *me, URI *uri);
+static int sqlite_add_uristr(QUEUE *me, const char *uristr);
+static int sqlite_add_uristrs(QUEUE *me, const char **uristrs, size_t count);
+static int sqlite_insert_(QUEUE *me, const char *uristr, time_t now);
+static int sqlite_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl);
+static int sqlite_updated_uristr(QUEUE *me, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl);
+static int sqlite_unchanged_uri(QUEUE *me, URI *uri, int error);
+static int sqlite_unchanged_uristr(QUEUE *me, const char *uristr, int error);
+static int sqlite_stage_(QUEUE *me, const char *uristr, struct sqlite_outcome *outcome);
+static long sqlite_commit_due_(QUEUE *me);
+static int sqlite_commit_(QUEUE *me);
+static int sqlite_outcome_apply_(QUEUE *me, struct sqlite_outcome *outcome, time_t now);
+static int sqlite_uri_depth_(const char *uri);
+static int sqlite_begin_(QUEUE *me);
+static int sqlite_end_(QUEUE *me, int r);
+static int sqlite_exec_(QUEUE *me, int stmt);
+static int sqlite_key_bin_(const char *hex, unsigned char *bin);
+static void sqlite_key_hex_(const unsigned char *bin, char *hex);
+
+static struct queue_api_struct sqlite_api = {
+	NULL,
+	sqlite_addref,
+	sqlite_release,
+	sqlite_next,
+	sqlite_add_uri,
+	sqlite_add_uristr,
+	sqlite_updated_uri,
+	sqlite_updated_uristr,
+	sqlite_unchanged_uri,
+	sqlite_unchanged_uristr,
+	sqlite_due,
+	sqlite_add_uristrs
+};
+
+/* Every statement is prepared when the connection is opened, and reset after
+ * each use
+ */
+enum
+{
+	STMT_BEGIN,
+	STMT_COMMIT,
+	STMT_ROLLBACK,
+	STMT_DUE,
+	STMT_FILL,
+	STMT_FILL_REFRESH,
+	STMT_LEASE,
+	STMT_RELEASE,
+	STMT_ROOT_INSERT,
+	STMT_RESOURCE_INSERT,
+	STMT_RESOURCE_RELINK,
+	STMT_ROOT_FETCHED,
+	STMT_UPDATED,
+	STMT_UPDATED_STATUS,
+	STMT_UNCHANGED,
+	STMT_UNCHANGED_ERROR,
+	STMT_COUNT
+};
+
+/* Unlike MySQL, SQLite evaluates every assignment in an UPDATE against the
+ * row as it was, so the new change interval is spelled out wherever it's
+ * used
+ */
+#define CHANGED_INTERVAL \
+	"MAX(?5, CASE WHEN \"change_interval\" = 0 THEN ?6 ELSE \"change_interval\" / 2 END)"
+#define UNCHANGED_INTERVAL \
+	"MAX(?2, MIN(?3, CASE WHEN \"change_interval\" = 0 THEN ?4 ELSE \"change_interval\" + \"change_interval\" / 2 END))"
+
+static const char *sqlite_statements[STMT_COUNT] = {
+	/* STMT_BEGIN: take the write lock at the outset, rather than failing
+	 * to upgrade to it part-way through
+	 */
+	"BEGIN IMMEDIATE",
+	/* STMT_COMMIT */
+	"COMMIT",
+	/* STMT_ROLLBACK */
+	"ROLLBACK",
+	/* STMT_DUE: crawl_bucket, lane; the minimum is read from the start of
+	 * crawl_resource_lane_due
+	 */
+	"SELECT MIN(\"next_fetch\") FROM \"crawl_resource\" "
+	" WHERE \"crawl_bucket\" = ?1 AND \"lane\" = ?2 AND \"leased\" = 0",
+	/* STMT_FILL: crawl_bucket, lane, now, limit; read in
+	 * crawl_resource_lane_priority order (the unary + keeps the planner
+	 * from using crawl_resource_lane_due instead), so that the scan stops
+	 * once it has enough
+	 */
+	"SELECT \"res\".\"uri\", \"res\".\"hash\", \"res\".\"root\", \"root\".\"rate\" "
+	" FROM \"crawl_resource\" \"res\" JOIN \"crawl_root\" \"root\" ON \"root\".\"hash\" = \"res\".\"root\" "
+	" WHERE \"res\".\"crawl_bucket\" = ?1 AND \"res\".\"lane\" = ?2 AND \"res\".\"leased\" = 0 AND "
+	" +\"res\".\"next_fetch\" <= ?3 "
+	" ORDER BY \"res\".\"priority\" DESC "
+	" LIMIT ?4",
+	/* STMT_FILL_REFRESH: crawl_bucket, lane, now, limit, window */
+	"SELECT \"res\".\"uri\", \"res\".\"hash\", \"res\".\"root\", \"root\".\"rate\" "
+	" FROM \"crawl_resource\" \"res\" JOIN \"crawl_root\" \"root\" ON \"root\".\"hash\" = \"res\".\"root\" "
+	" WHERE \"res\".\"hash\" IN "
+	" (SELECT \"hash\" FROM \"crawl_resource\" "
+	"  WHERE \"crawl_bucket\" = ?1 AND \"lane\" = ?2 AND \"leased\" = 0 AND \"next_fetch\" <= ?3 "
+	"  ORDER BY \"next_fetch\" ASC LIMIT ?5) "
+	" ORDER BY \"res\".\"priority\" DESC, \"res\".\"next_fetch\" ASC "
+	" LIMIT ?4",
+	/* STMT_LEASE: crawler, hash */
+	"UPDATE \"crawl_resource\" SET \"leased\" = ?1 WHERE \"hash\" = ?2",
+	/* STMT_RELEASE: crawler */
+	"UPDATE \"crawl_resource\" SET \"leased\" = 0 WHERE \"leased\" = ?1",
+	/* STMT_ROOT_INSERT: hash, uri, added */
+	"INSERT OR IGNORE INTO \"crawl_root\" (\"hash\", \"uri\", \"added\") VALUES (?1, ?2, ?3)",
+	/* STMT_RESOURCE_INSERT: hash, crawl_bucket, root, uri, depth, priority,
+	 * added
+	 */
+	"INSERT OR IGNORE INTO \"crawl_resource\" (\"hash\", \"crawl_bucket\", \"root\", \"uri\", \"depth\", \"priority\", \"added\", \"next_fetch\") "
+	" VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?7)",
+	/* STMT_RESOURCE_RELINK: crawl_bucket, inlink max, inlink weight, hash */
+	"UPDATE \"crawl_resource\" SET \"crawl_bucket\" = ?1, "
+	" \"priority\" = \"priority\" + CASE WHEN \"inlinks\" < ?2 THEN ?3 ELSE 0 END, "
+	" \"inlinks\" = \"inlinks\" + 1 WHERE \"hash\" = ?4",
+	/* STMT_ROOT_FETCHED: last_updated, hash */
+	"UPDATE \"crawl_root\" SET \"last_updated\" = ?1 WHERE \"hash\" = ?2",
+	/* STMT_UPDATED: updated, last_modified, status, now, revisit-min,
+	 * default interval, freshness, revisit-max, hash
+	 */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?1, \"last_modified\" = ?2, \"status\" = ?3, "
+	" \"error_count\" = 0, \"soft_error_count\" = 0, "
+	" \"change_interval\" = " CHANGED_INTERVAL ", \"freshness\" = ?7, "
+	" \"next_fetch\" = ?4 + MIN(?8, MAX(" CHANGED_INTERVAL ", ?7)), "
+	" \"lane\" = 1, \"priority\" = crawld_priority(\"inlinks\", \"depth\", " CHANGED_INTERVAL "), "
+	" \"leased\" = 0 WHERE \"hash\" = ?9",
+	/* STMT_UPDATED_STATUS: updated, last_modified, status, next_fetch, hash;
+	 * a 4xx response counts as a hard error and a 5xx as a soft one
+	 */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?1, \"last_modified\" = ?2, \"status\" = ?3, "
+	" \"error_count\" = CASE WHEN ?3 >= 400 AND ?3 < 499 THEN \"error_count\" + 1 ELSE 0 END, "
+	" \"soft_error_count\" = CASE WHEN ?3 >= 500 AND ?3 < 599 THEN \"soft_error_count\" + 1 "
+	"  WHEN ?3 >= 400 AND ?3 < 499 THEN \"soft_error_count\" ELSE 0 END, "
+	" \"next_fetch\" = ?4, "
+	" \"lane\" = 1, \"priority\" = crawld_priority(\"inlinks\", \"depth\", \"change_interval\"), "
+	" \"leased\" = 0 WHERE \"hash\" = ?5",
+	/* STMT_UNCHANGED: now, revisit-min, revisit-max, default interval,
+	 * hash
+	 */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?1, "
+	" \"change_interval\" = " UNCHANGED_INTERVAL ", "
+	" \"next_fetch\" = ?1 + MIN(?3, MAX(" UNCHANGED_INTERVAL ", \"freshness\")), "
+	" \"lane\" = 1, \"priority\" = crawld_priority(\"inlinks\", \"depth\", " UNCHANGED_INTERVAL "), "
+	" \"leased\" = 0, \"error_count\" = 0 WHERE \"hash\" = ?5",
+	/* STMT_UNCHANGED_ERROR: updated, next_fetch, hash */
+	"UPDATE \"crawl_resource\" SET \"updated\" = ?1, \"next_fetch\" = ?2, "
+	" \"lane\" = 1, \"priority\" = crawld_priority(\"inlinks\", \"depth\", \"change_interval\"), "
+	" \"leased\" = 0, \"error_count\" = \"error_count\" + 1 WHERE \"hash\" = ?3"
+};
+
+/* The outcome of a fetch, staged until it's committed */
+struct sqlite_outcome
+{
+	int unchanged;
+	int status;
+	int error;
+	time_t updated;
+	time_t last_modified;
+	time_t next_fetch;
+	time_t ttl;
+	unsigned char key[KEY_LEN];
+	unsigned char rootkey[KEY_LEN];
+};
+
+/* Resources leased by a fill, held until the transaction has committed */
+struct sqlite_fill_entry
+{
+	char *uri;
+	char root[SCHED_KEY_LEN + 1];
+	int rate;
+};
+
+struct sqlite_fill
+{
+	int count;
+	struct sqlite_fill_entry entries[FILL_BATCH_SIZE];
+};
+
+struct queue_struct
+{
+	struct queue_api_struct *api;
+	unsigned long refcount;
+	CONTEXT *ctx;
+	sqlite3 *db;
+	sqlite3_stmt *stmt[STMT_COUNT];
+	int crawler_id;
+	/* Buckets are numbered from the first crawler in this instance */
+	int first_crawler;
+	int ncrawlers;
+	SCHED *sched;
+	uint64_t lastfill;
+	unsigned long fillgen;
+	int filled;
+	int revisit_min;
+	int revisit_max;
+	int discovery;
+	/* Fetch outcomes waiting to be committed */
+	struct sqlite_outcome *outcomes;
+	int noutcomes;
+	int commit_batch;
+	int commit_interval;
+	uint64_t pending_since;
+};
+
+QUEUE *
+sqlite_create(CONTEXT *ctx)
+{
+	QUEUE *p;
+	int threadcount;
+	
+	p = (QUEUE *) calloc(1, sizeof(QUEUE));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->api = &sqlite_api;
+	p->refcount = 1;
+	p->ctx = ctx;
+	p->crawler_id = ctx->api->crawler_id(ctx);
+	/* Every crawler is a thread of this instance */
+	p->first_crawler = config_get_int("instance:crawler", 1);
+	threadcount = config_get_int("instance:threadcount", 1);
+	p->ncrawlers = (threadcount < 1 ? 1 : threadcount);
+	p->revisit_min = config_get_int("sqlite:revisit-min", REVISIT_DEFAULT_MIN);
+	if(p->revisit_min < 1)
+	{
+		p->revisit_min = REVISIT_DEFAULT_MIN;
+	}
+	p->revisit_max = config_get_int("sqlite:revisit-max", REVISIT_DEFAULT_MAX);
+	if(p->revisit_max < p->revisit_min)
+	{
+		p->revisit_max = p->revisit_min;
+	}
+	p->discovery = config_get_int("sqlite:discovery", DISCOVERY_DEFAULT_SHARE);
+	if(p->discovery < 0 || p->discovery > 100)
+	{
+		p->discovery = DISCOVERY_DEFAULT_SHARE;
+	}
+	p->commit_batch = config_get_int("sqlite:commit-batch", COMMIT_DEFAULT_BATCH);
+	if(p->commit_batch < 1)
+	{
+		p->commit_batch = 1;
+	}
+	p->commit_interval = config_get_int("sqlite:commit-interval", COMMIT_DEFAULT_INTERVAL);
+	if(p->commit_interval < 0)
+	{
+		p->commit_interval = 0;
+	}
+	p->outcomes = (struct sqlite_outcome *) calloc(p->commit_batch, sizeof(struct sqlite_outcome));
+	if(!p->outcomes)
+	{
+		free(p);
+		return NULL;
+	}
+	p->sched = sched_create();
+	if(!p->sched)
+	{
+		free(p->outcomes);
+		free(p);
+		return NULL;
+	}
+	if(sqlite_open_(p, ctx->api->config_get(ctx, "sqlite:path", "crawl.sqlite")) ||
+		sqlite_release_leases_(p))
+	{
+		sqlite_release(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Open the database, bring its schema up to date and prepare the
+ * statements
+ */
+static int
+sqlite_open_(QUEUE *me, const char *path)
+{
+	int c;
+	
+	if(sqlite3_open_v2(path, &(me->db), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+	{
+		log_printf(LOG_CRIT, "SQLite: %s: %s\n", path, (me->db ? sqlite3_errmsg(me->db) : strerror(ENOMEM)));
+		return -1;
+	}
+	sqlite3_busy_timeout(me->db, BUSY_TIMEOUT);
+	/* In WAL mode, readers don't block the writer (or vice versa), and a
+	 * commit needn't be synced until the log is checkpointed; an outcome
+	 * lost to a power failure is simply fetched again
+	 */
+	if(sqlite3_exec(me->db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		log_printf(LOG_CRIT, "SQLite: %s: %s\n", path, sqlite3_errmsg(me->db));
+		return -1;
+	}
+	if(sqlite3_create_function(me->db, "crawld_priority", 3, SQLITE_UTF8, me, sqlite_priority_, NULL, NULL) != SQLITE_OK)
+	{
+		log_printf(LOG_CRIT, "SQLite: %s\n", sqlite3_errmsg(me->db));
+		return -1;
+	}
+	if(sqlite_migrate_(me))
+	{
+		log_printf(LOG_CRIT, "SQLite: Database migration failed: %s\n", sqlite3_errmsg(me->db));
+		return -1;
+	}
+	for(c = 0; c < STMT_COUNT; c++)
+	{
+		if(sqlite3_prepare_v2(me->db, sqlite_statements[c], -1, &(me->stmt[c]), NULL) != SQLITE_OK)
+		{
+			log_printf(LOG_CRIT, "SQLite: failed to prepare statement %d: %s\n", c, sqlite3_errmsg(me->db));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Bring the schema up to date; each crawl thread does this as it starts, so
+ * the version is checked once the write lock is held
+ */
+static int
+sqlite_migrate_(QUEUE *me)
+{
+	sqlite3_stmt *stmt;
+	int version;
+	
+	if(sqlite3_exec(me->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		return -1;
+	}
+	version = -1;
+	if(sqlite3_prepare_v2(me->db, "PRAGMA user_version", -1, &stmt, NULL) == SQLITE_OK)
+	{
+		if(sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			version = sqlite3_column_int(stmt, 0);
+		}
+		sqlite3_finalize(stmt);
+	}
+	if(version < 0 || version > SCHEMA_VERSION)
+	{
+		sqlite3_exec(me->db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+	if(version == SCHEMA_VERSION)
+	{
+		return (sqlite3_exec(me->db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1);
+	}
+	log_printf(LOG_NOTICE, "SQLite: Migrating database to version %d\n", SCHEMA_VERSION);
+	/* Both tables are keyed on the digest, so there's no need for a
+	 * separate rowid. The indexes match the queue queries, so that each is
+	 * a bounded range scan of one lane of one bucket.
+	 */
+	if(sqlite3_exec(me->db, "CREATE TABLE \"crawl_root\" ("
+			"\"hash\" BLOB NOT NULL PRIMARY KEY,"
+			"\"uri\" TEXT NOT NULL,"
+			"\"added\" INTEGER NOT NULL,"
+			"\"last_updated\" INTEGER DEFAULT NULL,"
+			"\"rate\" INTEGER NOT NULL DEFAULT 1000"
+			") WITHOUT ROWID", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "CREATE TABLE \"crawl_resource\" ("
+			"\"hash\" BLOB NOT NULL PRIMARY KEY,"
+			"\"crawl_bucket\" INTEGER NOT NULL,"
+			"\"leased\" INTEGER NOT NULL DEFAULT 0,"
+			"\"lane\" INTEGER NOT NULL DEFAULT 0,"
+			"\"root\" BLOB NOT NULL,"
+			"\"uri\" TEXT NOT NULL,"
+			"\"depth\" INTEGER NOT NULL DEFAULT 0,"
+			"\"inlinks\" INTEGER NOT NULL DEFAULT 0,"
+			"\"priority\" INTEGER NOT NULL DEFAULT 0,"
+			"\"added\" INTEGER NOT NULL,"
+			"\"updated\" INTEGER DEFAULT NULL,"
+			"\"last_modified\" INTEGER DEFAULT NULL,"
+			"\"status\" INTEGER DEFAULT NULL,"
+			"\"next_fetch\" INTEGER NOT NULL,"
+			"\"change_interval\" INTEGER NOT NULL DEFAULT 0,"
+			"\"freshness\" INTEGER NOT NULL DEFAULT 0,"
+			"\"error_count\" INTEGER NOT NULL DEFAULT 0,"
+			"\"soft_error_count\" INTEGER NOT NULL DEFAULT 0"
+			") WITHOUT ROWID", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "CREATE INDEX \"crawl_resource_lane_priority\" ON \"crawl_resource\" "
+			"(\"crawl_bucket\", \"lane\", \"leased\", \"priority\")", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "CREATE INDEX \"crawl_resource_lane_due\" ON \"crawl_resource\" "
+			"(\"crawl_bucket\", \"lane\", \"leased\", \"next_fetch\")", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "CREATE INDEX \"crawl_resource_leased\" ON \"crawl_resource\" "
+			"(\"leased\")", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "PRAGMA user_version = 1", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(me->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		sqlite3_exec(me->db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+/* crawld_priority(inlinks, depth, change_interval): the priority of a
+ * resource being refreshed; each link to it (up to PRIORITY_INLINK_MAX)
+ * counts for it, each path segment against it, and each halving of its
+ * change interval below revisit-max for it
+ */
+static void
+sqlite_priority_(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+	QUEUE *me;
+	sqlite3_int64 inlinks, depth, interval, priority;
+	double ratio;
+	int halvings;
+	
+	(void) argc;
+	
+	me = (QUEUE *) sqlite3_user_data(context);
+	inlinks = sqlite3_value_int64(argv[0]);
+	depth = sqlite3_value_int64(argv[1]);
+	interval = sqlite3_value_int64(argv[2]);
+	if(interval < 1)
+	{
+		interval = REVISIT_DEFAULT_INTERVAL;
+	}
+	ratio = (double) me->revisit_max / (double) interval;
+	for(halvings = 0; ratio >= 2.0; halvings++)
+	{
+		ratio /= 2.0;
+	}
+	for(; ratio < 1.0; halvings--)
+	{
+		ratio *= 2.0;
+	}
+	priority = (inlinks < PRIORITY_INLINK_MAX ? inlinks : PRIORITY_INLINK_MAX) * PRIORITY_INLINK_WEIGHT -
+		depth * PRIORITY_DEPTH_WEIGHT + halvings * PRIORITY_CHANGE_WEIGHT;
+	sqlite3_result_int64(context, priority);
+}
+
+static unsigned long
+sqlite_addref(QUEUE *me)
+{
+	me->refcount++;
+	return me->refcount;
+}
+
+static unsigned long
+sqlite_release(QUEUE *me)
+{
+	int c;
+	
+	me->refcount--;
+	if(!me->refcount)
+	{
+		if(me->stmt[STMT_COUNT - 1])
+		{
+			/* Record any outstanding outcomes and hand back anything
+			 * which was loaded but not fetched
+			 */
+			sqlite_commit_(me);
+			sqlite_release_leases_(me);
+		}
+		for(c = 0; c < STMT_COUNT; c++)
+		{
+			sqlite3_finalize(me->stmt[c]);
+		}
+		sqlite3_close(me->db);
+		sched_destroy(me->sched);
+		free(me->outcomes);
+		free(me);
+		return 0;
+	}
+	return me->refcount;
+}
+
+/* Obtain the next URI whose root is ready to be fetched from; politeness is
+ * enforced by the scheduler, which is topped up from the database in batches
+ */
+static int
+sqlite_next(QUEUE *me, URI **next)
+{
+	char *uristr;
+	uint64_t now, wait;
+	unsigned long gen;
+	int r;
+	
+	*next = NULL;
+	sqlite_commit_due_(me);
+	for(;;)
+	{
+		if(!sched_next(me->sched, &uristr, &wait))
+		{
+			now = sched_now();
+			gen = queue_generation();
+			if(sched_pending(me->sched) >= FILL_BATCH_SIZE / 2 ||
+				(me->filled < FILL_BATCH_SIZE && gen == me->fillgen && now - me->lastfill < FILL_INTERVAL))
+			{
+				return 0;
+			}
+			me->lastfill = now;
+			me->fillgen = gen;
+			r = sqlite_fill_(me);
+			if(r < 0)
+			{
+				return -1;
+			}
+			me->filled = r;
+			if(!sched_next(me->sched, &uristr, &wait))
+			{
+				log_printf(LOG_DEBUG, "sqlite_next: no resources are ready to be fetched\n");
+				return 0;
+			}
+		}
+		if(!crawl_resolve_failed(uristr))
+		{
+			break;
+		}
+		log_printf(LOG_DEBUG, "sqlite_next: skipping <%s> (host does not resolve)\n", uristr);
+		sqlite_unchanged_uristr(me, uristr, 1);
+		free(uristr);
+	}
+	*next = uri_create_str(uristr, NULL);
+	free(uristr);
+	if(!*next)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Obtain the number of milliseconds until sqlite_next() is expected to have
+ * something to return, or -1 if there is nothing waiting to be fetched;
+ * if fetch outcomes are waiting to be committed, this is no later than
+ * they're due to be
+ */
+static long
+sqlite_due(QUEUE *me)
+{
+	long due, commit;
+	
+	commit = sqlite_commit_due_(me);
+	due = sqlite_due_(me);
+	if(commit >= 0 && (due < 0 || commit < due))
+	{
+		return commit;
+	}
+	return due;
+}
+
+static long
+sqlite_due_(QUEUE *me)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 earliest;
+	uint64_t now;
+	long due, fill;
+	int lane, found;
+	
+	if(sched_pending(me->sched))
+	{
+		return (long) sched_wait(me->sched);
+	}
+	stmt = me->stmt[STMT_DUE];
+	earliest = 0;
+	found = 0;
+	for(lane = LANE_DISCOVERY; lane <= LANE_REFRESH; lane++)
+	{
+		sqlite3_bind_int(stmt, 1, me->crawler_id);
+		sqlite3_bind_int(stmt, 2, lane);
+		if(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL &&
+			(!found || sqlite3_column_int64(stmt, 0) < earliest))
+		{
+			earliest = sqlite3_column_int64(stmt, 0);
+			found = 1;
+		}
+		sqlite3_reset(stmt);
+	}
+	if(!found)
+	{
+		return -1;
+	}
+	/* next_fetch must have passed before a resource is returned */
+	due = (long) (earliest - time(NULL));
+	due = (due < 0 ? 0 : (due + 1) * 1000);
+	now = sched_now();
+	if(now - me->lastfill < FILL_INTERVAL)
+	{
+		fill = (long) (FILL_INTERVAL - (now - me->lastfill));
+		if(fill > due)
+		{
+			due = fill;
+		}
+	}
+	return due;
+}
+
+/* Lease a batch of resources which are due to be fetched and load them into
+ * the scheduler, returning the number loaded
+ */
+static int
+sqlite_fill_(QUEUE *me)
+{
+	struct sqlite_fill *batch;
+	int share, discovered, c, r;
+	time_t now;
+	
+	batch = (struct sqlite_fill *) calloc(1, sizeof(struct sqlite_fill));
+	if(!batch)
+	{
+		return -1;
+	}
+	if(sqlite_begin_(me))
+	{
+		free(batch);
+		return -1;
+	}
+	now = time(NULL);
+	share = (FILL_BATCH_SIZE * me->discovery) / 100;
+	discovered = 0;
+	r = (share ? sqlite_fill_lane_(me, batch, LANE_DISCOVERY, share, now) : 0);
+	if(!r)
+	{
+		discovered = batch->count;
+		r = sqlite_fill_lane_(me, batch, LANE_REFRESH, FILL_BATCH_SIZE - batch->count, now);
+	}
+	/* Those loaded from the discovery lane are now leased, so won't be
+	 * returned again
+	 */
+	if(!r && batch->count < FILL_BATCH_SIZE && discovered == share)
+	{
+		r = sqlite_fill_lane_(me, batch, LANE_DISCOVERY, FILL_BATCH_SIZE - batch->count, now);
+	}
+	if(sqlite_end_(me, r))
+	{
+		sqlite_fill_reset_(batch);
+		free(batch);
+		return -1;
+	}
+	/* Only once the leases have been committed are the resources handed to
+	 * the scheduler
+	 */
+	for(c = 0; c < batch->count; c++)
+	{
+		if(sched_add(me->sched, batch->entries[c].root, batch->entries[c].rate, batch->entries[c].uri))
+		{
+			sqlite_fill_reset_(batch);
+			free(batch);
+			return -1;
+		}
+		/* Resolve the host while the resource waits its turn */
+		crawl_resolve_prefetch(batch->entries[c].uri);
+	}
+	r = batch->count;
+	sqlite_fill_reset_(batch);
+	free(batch);
+	log_printf(LOG_DEBUG, "sqlite_next: leased %d resources\n", r);
+	return r;
+}
+
+/* Lease up to limit resources from one lane, highest priority first, and
+ * add them to the batch; resources in the refresh lane are chosen from the
+ * FILL_REFRESH_WINDOW most overdue. Returns 0 on success.
+ */
+static int
+sqlite_fill_lane_(QUEUE *me, struct sqlite_fill *batch, int lane, int limit, time_t now)
+{
+	struct sqlite_fill_entry *entry;
+	sqlite3_stmt *stmt, *lease;
+	unsigned char keys[FILL_BATCH_SIZE][KEY_LEN];
+	const char *uri;
+	int count, c, r;
+	
+	if(limit > FILL_BATCH_SIZE - batch->count)
+	{
+		limit = FILL_BATCH_SIZE - batch->count;
+	}
+	if(limit < 1)
+	{
+		return 0;
+	}
+	stmt = me->stmt[lane == LANE_REFRESH ? STMT_FILL_REFRESH : STMT_FILL];
+	sqlite3_bind_int(stmt, 1, me->crawler_id);
+	sqlite3_bind_int(stmt, 2, lane);
+	sqlite3_bind_int64(stmt, 3, (sqlite3_int64) now);
+	sqlite3_bind_int(stmt, 4, limit);
+	if(lane == LANE_REFRESH)
+	{
+		sqlite3_bind_int(stmt, 5, FILL_REFRESH_WINDOW);
+	}
+	count = 0;
+	while(count < limit && (r = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		uri = (const char *) sqlite3_column_text(stmt, 0);
+		if(!uri || sqlite3_column_bytes(stmt, 1) != KEY_LEN || sqlite3_column_bytes(stmt, 2) != KEY_LEN)
+		{
+			log_printf(LOG_ERR, "SQLite: skipping malformed queue entry\n");
+			continue;
+		}
+		entry = &(batch->entries[batch->count]);
+		entry->uri = strdup(uri);
+		if(!entry->uri)
+		{
+			sqlite3_reset(stmt);
+			return -1;
+		}
+		sqlite_key_hex_((const unsigned char *) sqlite3_column_blob(stmt, 2), entry->root);
+		entry->rate = sqlite3_column_int(stmt, 3);
+		memcpy(keys[count], sqlite3_column_blob(stmt, 1), KEY_LEN);
+		batch->count++;
+		count++;
+	}
+	sqlite3_reset(stmt);
+	if(count < limit && r != SQLITE_DONE)
+	{
+		log_printf(LOG_CRIT, "SQLite: %s\n", sqlite3_errmsg(me->db));
+		return -1;
+	}
+	/* The rows are leased once the query has finished with them, as the
+	 * lease moves each within the index it was read from
+	 */
+	lease = me->stmt[STMT_LEASE];
+	for(c = 0; c < count; c++)
+	{
+		sqlite3_bind_int(lease, 1, me->crawler_id);
+		sqlite3_bind_blob(lease, 2, keys[c], KEY_LEN, SQLITE_STATIC);
+		if(sqlite_exec_(me, STMT_LEASE))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+sqlite_fill_reset_(struct sqlite_fill *batch)
+{
+	int c;
+	
+	for(c = 0; c < batch->count; c++)
+	{
+		free(batch->entries[c].uri);
+		batch->entries[c].uri = NULL;
+	}
+	batch->count = 0;
+}
+
+/* Release any leases held by this crawler */
+static int
+sqlite_release_leases_(QUEUE *me)
+{
+	sqlite3_bind_int(me->stmt[STMT_RELEASE], 1, me->crawler_id);
+	return sqlite_exec_(me, STMT_RELEASE);
+}
+
+static int
+sqlite_add_uri(QUEUE *me, URI *uri)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = sqlite_add_uristr(me, uristr);
+	free(uristr);
+	return r;
+}
+
+static int
+sqlite_add_uristr(QUEUE *me, const char *uristr)
+{
+	return sqlite_add_uristrs(me, &uristr, 1);
+}
+
+/* Add a set of URIs in a single transaction */
+static int
+sqlite_add_uristrs(QUEUE *me, const char **uristrs, size_t count)
+{
+	size_t c;
+	time_t now;
+	int r;
+	
+	if(!count)
+	{
+		return 0;
+	}
+	if(sqlite_begin_(me))
+	{
+		return -1;
+	}
+	now = time(NULL);
+	r = 0;
+	for(c = 0; c < count; c++)
+	{
+		switch(sqlite_insert_(me, uristrs[c], now))
+		{
+		case 0:
+			break;
+		case 1:
+			/* The URI couldn't be canonicalised */
+			r = -1;
+			break;
+		default:
+			sqlite_end_(me, -1);
+			return -1;
+		}
+	}
+	if(sqlite_end_(me, 0))
+	{
+		return -1;
+	}
+	/* Wake any idle crawl threads */
+	queue_notify();
+	return r;
+}
+
+/* Insert a resource and its root, if they don't already exist; a resource
+ * which does is reassigned to its bucket and gains another inlink. Returns
+ * 1 if the URI can't be added, -1 on error
+ */
+static int
+sqlite_insert_(QUEUE *me, const char *uristr, time_t now)
+{
+	CRAWLCANON *canon;
+	unsigned char key[KEY_LEN], rootkey[KEY_LEN];
+	sqlite3_stmt *stmt;
+	int bucket, depth;
+	
+	canon = crawl_canonicalise(uristr);
+	if(!canon)
+	{
+		return 1;
+	}
+	if(sqlite_key_bin_(canon->key, key) || sqlite_key_bin_(canon->rootkey, rootkey))
+	{
+		crawl_canonical_destroy(canon);
+		return 1;
+	}
+	bucket = (int) (canon->shortkey % me->ncrawlers) + me->first_crawler;
+	stmt = me->stmt[STMT_ROOT_INSERT];
+	sqlite3_bind_blob(stmt, 1, rootkey, KEY_LEN, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, canon->root, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, (sqlite3_int64) now);
+	if(sqlite_exec_(me, STMT_ROOT_INSERT))
+	{
+		crawl_canonical_destroy(canon);
+		return -1;
+	}
+	depth = sqlite_uri_depth_(canon->uri);
+	stmt = me->stmt[STMT_RESOURCE_INSERT];
+	sqlite3_bind_blob(stmt, 1, key, KEY_LEN, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, bucket);
+	sqlite3_bind_blob(stmt, 3, rootkey, KEY_LEN, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, canon->uri, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 5, depth);
+	sqlite3_bind_int(stmt, 6, -(depth * PRIORITY_DEPTH_WEIGHT));
+	sqlite3_bind_int64(stmt, 7, (sqlite3_int64) now);
+	if(sqlite_exec_(me, STMT_RESOURCE_INSERT))
+	{
+		crawl_canonical_destroy(canon);
+		return -1;
+	}
+	if(!sqlite3_changes(me->db))
+	{
+		stmt = me->stmt[STMT_RESOURCE_RELINK];
+		sqlite3_bind_int(stmt, 1, bucket);
+		sqlite3_bind_int(stmt, 2, PRIORITY_INLINK_MAX);
+		sqlite3_bind_int(stmt, 3, PRIORITY_INLINK_WEIGHT);
+		sqlite3_bind_blob(stmt, 4, key, KEY_LEN, SQLITE_STATIC);
+		if(sqlite_exec_(me, STMT_RESOURCE_RELINK))
+		{
+			crawl_canonical_destroy(canon);
+			return -1;
+		}
+	}
+	crawl_canonical_destroy(canon);
+	return 0;
+}
+
+static int
+sqlite_updated_uri(QUEUE *me, URI *uri, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = sqlite_updated_uristr(me, uristr, updated, last_modified, status, ttl);
+	free(uristr);
+	return r;
+}
+
+/* The outcome of a fetch is staged, and committed along with others */
+static int
+sqlite_updated_uristr(QUEUE *me, const char *uristr, time_t updated, time_t last_modified, int status, time_t ttl)
+{
+	struct sqlite_outcome outcome;
+	
+	memset(&outcome, 0, sizeof(outcome));
+	outcome.updated = updated;
+	outcome.last_modified = last_modified;
+	outcome.status = status;
+	if(status != 200)
+	{
+		if(ttl < 86400)
+		{
+			ttl = 86400;
+		}
+		outcome.next_fetch = time(NULL) + ttl;
+	}
+	else
+	{
+		/* The freshness lifetime given by the server, if any */
+		outcome.ttl = (ttl < 0 ? 0 : ttl);
+	}
+	return sqlite_stage_(me, uristr, &outcome);
+}
+
+static int
+sqlite_unchanged_uri(QUEUE *me, URI *uri, int error)
+{
+	char *uristr;
+	int r;
+	
+	uristr = uri_stralloc(uri);
+	if(!uristr)
+	{
+		return -1;
+	}
+	r = sqlite_unchanged_uristr(me, uristr, error);
+	free(uristr);
+	return r;
+}
+
+static int
+sqlite_unchanged_uristr(QUEUE *me, const char *uristr, int error)
+{
+	struct sqlite_outcome outcome;
+	
+	memset(&outcome, 0, sizeof(outcome));
+	outcome.unchanged = 1;
+	outcome.error = error;
+	outcome.updated = time(NULL);
+	if(error)
+	{
+		outcome.next_fetch = outcome.updated + (86400 * 7);
+	}
+	return sqlite_stage_(me, uristr, &outcome);
+}
+
+/* Add a fetch outcome to those waiting to be committed, committing them if
+ * there are enough
+ */
+static int
+sqlite_stage_(QUEUE *me, const char *uristr, struct sqlite_outcome *outcome)
+{
+	CRAWLCANON *canon;
+	
+	canon = crawl_canonicalise(uristr);
+	if(!canon)
+	{
+		return -1;
+	}
+	if(sqlite_key_bin_(canon->key, outcome->key) || sqlite_key_bin_(canon->rootkey, outcome->rootkey))
+	{
+		log_printf(LOG_ERR, "SQLite: <%s> has a malformed key\n", uristr);
+		crawl_canonical_destroy(canon);
+		return -1;
+	}
+	crawl_canonical_destroy(canon);
+	if(!me->noutcomes)
+	{
+		me->pending_since = sched_now();
+	}
+	me->outcomes[me->noutcomes] = *outcome;
+	me->noutcomes++;
+	if(me->noutcomes >= me->commit_batch)
+	{
+		return sqlite_commit_(me);
+	}
+	return 0;
+}
+
+/* Commit any fetch outcomes which have waited for commit-interval, returning
+ * the number of milliseconds until those still waiting will have, or -1 if
+ * there are none
+ */
+static long
+sqlite_commit_due_(QUEUE *me)
+{
+	uint64_t now;
+	
+	if(!me->noutcomes)
+	{
+		return -1;
+	}
+	now = sched_now();
+	if(now - me->pending_since < (uint64_t) me->commit_interval)
+	{
+		return (long) (me->commit_interval - (now - me->pending_since));
+	}
+	sqlite_commit_(me);
+	return -1;
+}
+
+/* Commit the fetch outcomes which are waiting, in a single transaction */
+static int
+sqlite_commit_(QUEUE *me)
+{
+	time_t now;
+	int c, r;
+	
+	if(!me->noutcomes)
+	{
+		return 0;
+	}
+	if(sqlite_begin_(me))
+	{
+		return -1;
+	}
+	now = time(NULL);
+	r = 0;
+	for(c = 0; c < me->noutcomes && !r; c++)
+	{
+		r = sqlite_outcome_apply_(me, &(me->outcomes[c]), now);
+	}
+	if(sqlite_end_(me, r))
+	{
+		return -1;
+	}
+	log_printf(LOG_DEBUG, "SQLite: committed %d fetch outcomes\n", me->noutcomes);
+	me->noutcomes = 0;
+	return 0;
+}
+
+/* Apply a fetch outcome to a resource and mark its root as fetched from */
+static int
+sqlite_outcome_apply_(QUEUE *me, struct sqlite_outcome *outcome, time_t now)
+{
+	sqlite3_stmt *stmt;
+	int which;
+	
+	stmt = me->stmt[STMT_ROOT_FETCHED];
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64) now);
+	sqlite3_bind_blob(stmt, 2, outcome->rootkey, KEY_LEN, SQLITE_STATIC);
+	if(sqlite_exec_(me, STMT_ROOT_FETCHED))
+	{
+		return -1;
+	}
+	if(outcome->unchanged && outcome->error)
+	{
+		which = STMT_UNCHANGED_ERROR;
+		stmt = me->stmt[which];
+		sqlite3_bind_int64(stmt, 1, (sqlite3_int64) outcome->updated);
+		sqlite3_bind_int64(stmt, 2, (sqlite3_int64) outcome->next_fetch);
+		sqlite3_bind_blob(stmt, 3, outcome->key, KEY_LEN, SQLITE_STATIC);
+	}
+	else if(outcome->unchanged)
+	{
+		/* The resource hasn't changed, so lengthen the estimated interval
+		 * between changes by half
+		 */
+		which = STMT_UNCHANGED;
+		stmt = me->stmt[which];
+		sqlite3_bind_int64(stmt, 1, (sqlite3_int64) outcome->updated);
+		sqlite3_bind_int(stmt, 2, me->revisit_min);
+		sqlite3_bind_int(stmt, 3, me->revisit_max);
+		sqlite3_bind_int(stmt, 4, REVISIT_DEFAULT_INTERVAL);
+		sqlite3_bind_blob(stmt, 5, outcome->key, KEY_LEN, SQLITE_STATIC);
+	}
+	else if(outcome->status != 200)
+	{
+		which = STMT_UPDATED_STATUS;
+		stmt = me->stmt[which];
+		sqlite3_bind_int64(stmt, 1, (sqlite3_int64) outcome->updated);
+		sqlite3_bind_int64(stmt, 2, (sqlite3_int64) outcome->last_modified);
+		sqlite3_bind_int(stmt, 3, outcome->status);
+		sqlite3_bind_int64(stmt, 4, (sqlite3_int64) outcome->next_fetch);
+		sqlite3_bind_blob(stmt, 5, outcome->key, KEY_LEN, SQLITE_STATIC);
+	}
+	else
+	{
+		/* The resource has changed since it was last fetched (or it's
+		 * new), so halve the estimated interval between changes; ttl is
+		 * the freshness lifetime given by the server, before which
+		 * there's no point in fetching it again
+		 */
+		which = STMT_UPDATED;
+		stmt = me->stmt[which];
+		sqlite3_bind_int64(stmt, 1, (sqlite3_int64) outcome->updated);
+		sqlite3_bind_int64(stmt, 2, (sqlite3_int64) outcome->last_modified);
+		sqlite3_bind_int(stmt, 3, outcome->status);
+		sqlite3_bind_int64(stmt, 4, (sqlite3_int64) now);
+		sqlite3_bind_int(stmt, 5, me->revisit_min);
+		sqlite3_bind_int(stmt, 6, REVISIT_DEFAULT_INTERVAL);
+		sqlite3_bind_int64(stmt, 7, (sqlite3_int64) (outcome->ttl < me->revisit_max ? outcome->ttl : me->revisit_max));
+		sqlite3_bind_int(stmt, 8, me->revisit_max);
+		sqlite3_bind_blob(stmt, 9, outcome->key, KEY_LEN, SQLITE_STATIC);
+	}
+	return sqlite_exec_(me, which);
+}
+
+/* Count the path segments of an absolute URI */
+static int
+sqlite_uri_depth_(const char *uri)
+{
+	const char *s;
+	int depth;
+	
+	s = strstr(uri, "://");
+	if(!s)
+	{
+		return 0;
+	}
+	s = strchr(s + 3, '/');
+	for(depth = 0; s && *s && *s != '?' && *s != '#'; s++)
+	{
+		if(*s == '/' && s[1] && s[1] != '?' && s[1] != '#')
+		{
+			depth++;
+		}
+	}
+	return depth;
+}
+
+static int
+sqlite_begin_(QUEUE *me)
+{
+	if(sqlite_exec_(me, STMT_BEGIN))
+	{
+		log_printf(LOG_CRIT, "SQLite: %s\n", sqlite3_errmsg(me->db));
+		exit(1);
+	}
+	return 0;
+}
+
+/* Commit the current transaction if r is zero, otherwise roll it back;
+ * returns r, or -1 if the commit failed
+ */
+static int
+sqlite_end_(QUEUE *me, int r)
+{
+	if(!r && !sqlite_exec_(me, STMT_COMMIT))
+	{
+		return 0;
+	}
+	log_printf(LOG_CRIT, "SQLite: %s\n", sqlite3_errmsg(me->db));
+	sqlite_exec_(me, STMT_ROLLBACK);
+	exit(1);
+	return -1;
+}
+
+/* Execute a prepared statement which returns no rows, then reset it and
+ * clear its parameters
+ */
+static int
+sqlite_exec_(QUEUE *me, int stmt)
+{
+	int r;
+	
+	r = sqlite3_step(me->stmt[stmt]);
+	sqlite3_reset(me->stmt[stmt]);
+	sqlite3_clear_bindings(me->stmt[stmt]);
+	if(r != SQLITE_DONE && r != SQLITE_ROW)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Convert a key from hex to binary */
+static int
+sqlite_key_bin_(const char *hex, unsigned char *bin)
+{
+	int c, hi, lo;
+	
+	if(strlen(hex) != KEY_LEN * 2)
+	{
+		return -1;
+	}
+	for(c = 0; c < KEY_LEN; c++)
+	{
+		hi = (unsigned char) hex[c * 2];
+		lo = (unsigned char) hex[c * 2 + 1];
+		if(!isxdigit(hi) || !isxdigit(lo))
+		{
+			return -1;
+		}
+		hi = (isdigit(hi) ? hi - '0' : tolower(hi) - 'a' + 10);
+		lo = (isdigit(lo) ? lo - '0' : tolower(lo) - 'a' + 10);
+		bin[c] = (unsigned char) ((hi << 4) | lo);
+	}
+	return 0;
+}
+
+/* Convert a key from binary to (lowercase) hex */
+static void
+sqlite_key_hex_(const unsigned char *bin, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	int c;
+	
+	for(c = 0; c < KEY_LEN; c++)
+	{
+		hex[c * 2] = digits[bin[c] >> 4];
+		hex[c * 2 + 1] = digits[bin[c] & 15];
+	}
+	hex[KEY_LEN * 2] = 0;
+}
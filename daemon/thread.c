@@ -20,57 +20,280 @@
 
 #include "p_crawld.h"
 
+/* Each crawl thread occupies a slot, which is identified by its offset from
+ * the instance's base crawler ID. The supervisor (which runs in the main
+ * thread) starts a thread for each slot, restarts any which exit while the
+ * daemon is running (backing off if they keep dying), and joins them all
+ * on shutdown.
+ */
+
+struct thread_struct
+{
+	pthread_t thread;
+	int offset;
+	int running;
+	int exited;
+	time_t started;
+	time_t restart;
+	int backoff;
+};
+
 static int thread_prefetch(CRAWL *crawl, URI *uri, const char *uristr, void *userdata);
+static int thread_start(struct thread_struct *slot);
 
+static struct thread_struct *threads;
+static int threadcount;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t thread_stop;
+
+/* Start threadcount crawl threads */
 int
-thread_create(int crawler_offset)
+thread_init(void)
 {
-	CONTEXT *context;
+	int c;
 	
-	context = context_create(crawler_offset);
-	if(!context)
+	threadcount = config_get_int("instance:threadcount", 1);
+	if(threadcount < 1)
+	{
+		log_printf(LOG_CRIT, "Invalid thread count (%d) specified in [instance] section of the configuration file\n", threadcount);
+		return -1;
+	}
+	threads = (struct thread_struct *) calloc(threadcount, sizeof(struct thread_struct));
+	if(!threads)
 	{
+		log_printf(LOG_CRIT, "Failed to allocate memory for %d threads\n", threadcount);
 		return -1;
 	}
-	thread_handler(context);
+	log_printf(LOG_NOTICE, "Starting %d crawl thread%s\n", threadcount, (threadcount == 1 ? "" : "s"));
+	for(c = 0; c < threadcount; c++)
+	{
+		threads[c].offset = c;
+		if(thread_start(&(threads[c])))
+		{
+			thread_shutdown();
+			thread_supervise();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Supervise the crawl threads until shutdown has been requested, then wait
+ * for them to finish
+ */
+int
+thread_supervise(void)
+{
+	struct timespec ts;
+	time_t now;
+	int c, active, lifetime, notified;
+	
+	notified = 0;
+	pthread_mutex_lock(&thread_lock);
+	for(;;)
+	{
+		if(thread_stop && !notified)
+		{
+			/* Wake any crawl threads waiting for work so that they notice
+			 * the shutdown; this can't be done from the signal handler
+			 */
+			notified = 1;
+			queue_notify();
+		}
+		now = time(NULL);
+		active = 0;
+		for(c = 0; c < threadcount; c++)
+		{
+			if(threads[c].exited)
+			{
+				pthread_mutex_unlock(&thread_lock);
+				pthread_join(threads[c].thread, NULL);
+				pthread_mutex_lock(&thread_lock);
+				threads[c].exited = 0;
+				threads[c].running = 0;
+				if(thread_stop)
+				{
+					continue;
+				}
+				/* Back off if the thread dies soon after starting */
+				lifetime = (int) (now - threads[c].started);
+				if(lifetime < THREAD_BACKOFF_MAX)
+				{
+					threads[c].backoff = (threads[c].backoff ? threads[c].backoff * 2 : 1);
+					if(threads[c].backoff > THREAD_BACKOFF_MAX)
+					{
+						threads[c].backoff = THREAD_BACKOFF_MAX;
+					}
+				}
+				else
+				{
+					threads[c].backoff = 0;
+				}
+				threads[c].restart = now + threads[c].backoff;
+				log_printf(LOG_ERR, "Crawl thread %d exited unexpectedly; restarting in %d second%s\n", threads[c].offset, threads[c].backoff, (threads[c].backoff == 1 ? "" : "s"));
+			}
+			if(!threads[c].running && !thread_stop && threads[c].restart <= now)
+			{
+				pthread_mutex_unlock(&thread_lock);
+				thread_start(&(threads[c]));
+				pthread_mutex_lock(&thread_lock);
+			}
+			if(threads[c].running)
+			{
+				active++;
+			}
+		}
+		if(thread_stop && !active)
+		{
+			break;
+		}
+		/* Wake up when a thread exits, or periodically to check whether
+		 * a shutdown has been requested or a restart is due
+		 */
+		ts.tv_sec = time(NULL) + 1;
+		ts.tv_nsec = 0;
+		pthread_cond_timedwait(&thread_cond, &thread_lock, &ts);
+	}
+	pthread_mutex_unlock(&thread_lock);
+	log_printf(LOG_NOTICE, "All crawl threads have stopped\n");
+	return 0;
+}
+
+/* Request that the crawl threads stop once their current cycle has
+ * completed; this may be invoked from a signal handler
+ */
+void
+thread_shutdown(void)
+{
+	thread_stop = 1;
+}
+
+/* Has a shutdown been requested? */
+int
+thread_stopping(void)
+{
+	return thread_stop;
+}
+
+/* Free the thread slots once they have been joined */
+int
+thread_cleanup(void)
+{
+	free(threads);
+	threads = NULL;
+	threadcount = 0;
 	return 0;
 }
 
 void *
 thread_handler(void *arg)
 {
+	struct thread_struct *slot;
 	CONTEXT *context;
 	CRAWL *crawler;
+	const char *mode;
+	unsigned long gen;
+	long due, idle;
+	int event, maxconn, r;
 	
-	/* no addref() of the context because this thread is given ownership of the
-	 * object.
-	 */
-	context = (CONTEXT *) arg;
-	crawler = context->crawl;
-	log_printf(LOG_DEBUG, "thread_handler: crawler=%d, cache=%d\n", context->crawler_id, context->cache_id);
-	crawl_set_verbose(crawler, config_get_int("crawl:verbose", 0));
-	processor_init_crawler(crawler, context);
-	queue_init_crawler(crawler, context);
-	policy_init_crawler(crawler, context);
-	crawl_set_prefetch(crawler, thread_prefetch);
-	
-	while(1)
+	slot = (struct thread_struct *) arg;
+	context = context_create(slot->offset);
+	if(context)
 	{
-		if(crawl_perform(crawler))
+		crawler = context->crawl;
+		log_printf(LOG_DEBUG, "thread_handler: crawler=%d, cache=%d\n", context->crawler_id, context->cache_id);
+		crawl_set_verbose(crawler, config_get_int("crawl:verbose", 0));
+		processor_init_crawler(crawler, context);
+		queue_init_crawler(crawler, context);
+		policy_init_crawler(crawler, context);
+		crawl_set_prefetch(crawler, thread_prefetch);
+		/* In event-driven mode, each thread keeps many fetches in flight */
+		mode = context->api->config_get(context, "crawl:mode", "thread");
+		event = (mode && !strcmp(mode, "event"));
+		maxconn = config_get_int("crawl:connections", THREAD_DEFAULT_CONNECTIONS);
+		
+		idle = 0;
+		while(!thread_stop)
 		{
-			log_printf(LOG_CRIT, "%s\n", strerror(errno));
-			break;
+			gen = queue_generation();
+			if(event)
+			{
+				r = crawl_perform_multi(crawler, maxconn);
+			}
+			else
+			{
+				r = crawl_perform(crawler);
+			}
+			if(r)
+			{
+				log_printf(LOG_CRIT, "%s\n", strerror(errno));
+				break;
+			}
+			if(thread_stop)
+			{
+				break;
+			}
+			/* Sleep until the queue expects more work to be due, or until
+			 * URIs are added; if it's empty, back off progressively
+			 */
+			due = queue_due(crawler);
+			if(due < 0)
+			{
+				idle = (idle ? idle * 2 : THREAD_IDLE_MIN);
+				if(idle > THREAD_IDLE_MAX)
+				{
+					idle = THREAD_IDLE_MAX;
+				}
+				due = idle;
+			}
+			else
+			{
+				idle = 0;
+				if(due > THREAD_IDLE_MAX)
+				{
+					due = THREAD_IDLE_MAX;
+				}
+			}
+			queue_wait(gen, due);
 		}
-		sleep(1);
+		
+		/* The processing threads may still be passing updates to the queue */
+		processor_cleanup_crawler(crawler, context);
+		queue_cleanup_crawler(crawler, context);
+		
+		/* This thread was given ownership of the context */
+		context->api->release(context);
 	}
-
-	queue_cleanup_crawler(crawler, context);
-	processor_cleanup_crawler(crawler, context);
-
-	context->api->release(context);
+	pthread_mutex_lock(&thread_lock);
+	slot->exited = 1;
+	pthread_cond_signal(&thread_cond);
+	pthread_mutex_unlock(&thread_lock);
 	return NULL;
 }
 
+static int
+thread_start(struct thread_struct *slot)
+{
+	int e;
+	
+	pthread_mutex_lock(&thread_lock);
+	slot->started = time(NULL);
+	slot->exited = 0;
+	slot->running = 1;
+	e = pthread_create(&(slot->thread), NULL, thread_handler, (void *) slot);
+	if(e)
+	{
+		slot->running = 0;
+		slot->restart = slot->started + THREAD_BACKOFF_MAX;
+		pthread_mutex_unlock(&thread_lock);
+		log_printf(LOG_CRIT, "Failed to create crawl thread %d: %s\n", slot->offset, strerror(e));
+		return -1;
+	}
+	pthread_mutex_unlock(&thread_lock);
+	return 0;
+}
+
 static int
 thread_prefetch(CRAWL *crawl, URI *uri, const char *uristr, void *userdata)
 {
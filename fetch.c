@@ -26,6 +26,7 @@ static size_t crawl_fetch_header_(char *ptr, size_t size, size_t nmemb, void *us
 static size_t crawl_fetch_payload_(char *ptr, size_t size, size_t nmemb, void *userdata);
 static int crawl_update_info_(struct crawl_fetch_data_struct *data);
 static int crawl_generate_info_(struct crawl_fetch_data_struct *data, jd_var *dict);
+static int crawl_fetch_giveup_(struct crawl_fetch_data_struct *data);
 
 CRAWLOBJ *
 crawl_fetch(CRAWL *crawl, const char *uristr)
@@ -47,172 +48,234 @@ CRAWLOBJ *
 crawl_fetch_uri(CRAWL *crawl, URI *uri)
 {
 	struct crawl_fetch_data_struct data;
-	struct curl_slist *headers;
+	CRAWLOBJ *obj;
+	
+	if(crawl_fetch_prepare_(crawl, uri, &data, &obj) < 1)
+	{
+		return obj;
+	}
+	return crawl_fetch_complete_(&data, curl_easy_perform(data.ch));
+}
+
+/* Prepare to fetch a resource: returns 1 if a transfer must be performed
+ * using data->ch (after which crawl_fetch_complete_() must be invoked), or
+ * 0 if the fetch has already completed (successfully or otherwise), in which
+ * case *result is set to the object, if any, and the outcome has been passed
+ * to the relevant callback. Returns -1 if no object could be created for
+ * the URI, in which case there was nothing to pass to a callback. The URI
+ * is not retained.
+ */
+int
+crawl_fetch_prepare_(CRAWL *crawl, URI *uri, struct crawl_fetch_data_struct *data, CRAWLOBJ **result)
+{
 	struct tm tp;
 	char modified[64];
-	int error;
-	jd_var dict = JD_INIT, json = JD_INIT;
-	size_t len;
-	const char *p;
 	
-	memset(&data, 0, sizeof(data));
-	headers = NULL;
-
-	data.now = time(NULL);
-	data.crawl = crawl;
-	data.obj = crawl_obj_create_(crawl, uri);
-	if(!data.obj)
+	memset(data, 0, sizeof(struct crawl_fetch_data_struct));
+	*result = NULL;
+	data->now = time(NULL);
+	data->crawl = crawl;
+	data->obj = crawl_obj_create_(crawl, uri);
+	if(!data->obj)
 	{
-		return NULL;
+		return -1;
 	}
-	data.ch = curl_easy_init();
-	if(crawl_obj_locate_(data.obj) == 0)
+	if(crawl_obj_locate_(data->obj) == 0)
 	{
 		/* Object was located in the cache */
-		data.cachetime = data.obj->updated;
-		if(data.now - data.cachetime < crawl->cache_min)
+		data->cachetime = data->obj->updated;
+		if(data->now - data->cachetime < crawl->cache_min)
 		{
 			/* The object hasn't reached its minimum time-to-live */
 			if(crawl->unchanged)
 			{
-				crawl->unchanged(crawl, data.obj, data.cachetime, crawl->userdata);
+				crawl->unchanged(crawl, data->obj, data->cachetime, crawl->userdata);
 			}
-		    return data.obj;
+			*result = data->obj;
+			return 0;
 		}
-		/* Store a copy of the object dictionary to allow rolling it back without
-		 * re-reading from disk.
+		/* Take a snapshot of the object dictionary to allow rolling it back
+		 * without re-reading from disk. This doesn't copy anything: the
+		 * dictionary is replaced, not modified, once the response arrives.
 		 */
-		jd_clone(&dict, &(data.obj->info), 1);
+		crawl_obj_snapshot_(data->obj, &(data->snapshot));
 		/* Send an If-Modified-Since header */
-		gmtime_r(&(data.cachetime), &tp);
+		gmtime_r(&(data->cachetime), &tp);
 		strftime(modified, sizeof(modified), "If-Modified-Since: %a, %e %b %Y %H:%M:%S %z", &tp);
-		headers = curl_slist_append(headers, modified);		
+		data->reqheaders = curl_slist_append(data->reqheaders, modified);
 	}
 	if(crawl->uri_policy)
 	{
-		if(crawl->uri_policy(crawl, data.obj->uri, data.obj->uristr, crawl->userdata) < 1)
+		if(crawl->uri_policy(crawl, uri, data->obj->uristr, crawl->userdata) < 1)
 		{
-			if(crawl->failed)
-			{
-				crawl->failed(crawl, data.obj, data.cachetime, crawl->userdata);
-			}		
-			crawl_obj_destroy(data.obj);
-			return NULL;
+			return crawl_fetch_giveup_(data);
 		}
 	}
+	/* Use a prefetched address for the host, if there is one; there's no
+	 * point in a transfer to a host which is known not to resolve
+	 */
+	if(crawl_resolve_lookup_(data->obj->uristr, &(data->resolve)))
+	{
+		return crawl_fetch_giveup_(data);
+	}
 	/* Set the Accept header */
 	if(crawl->accept)
 	{
-		headers = curl_slist_append(headers, crawl->accept);	
+		data->reqheaders = curl_slist_append(data->reqheaders, crawl->accept);
 	}
 	/* Set the User-Agent header */
 	if(crawl->ua)
 	{
-		curl_slist_append(headers, crawl->ua);
-	}
-	curl_easy_setopt(data.ch, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(data.ch, CURLOPT_URL, data.obj->uristr);
-	curl_easy_setopt(data.ch, CURLOPT_WRITEFUNCTION, crawl_fetch_payload_);
-	curl_easy_setopt(data.ch, CURLOPT_WRITEDATA, (void *) &data);
-	curl_easy_setopt(data.ch, CURLOPT_HEADERFUNCTION, crawl_fetch_header_);
-	curl_easy_setopt(data.ch, CURLOPT_HEADERDATA, (void *) &data);
-	curl_easy_setopt(data.ch, CURLOPT_FOLLOWLOCATION, 0);
-	curl_easy_setopt(data.ch, CURLOPT_VERBOSE, crawl->verbose);
-	curl_easy_setopt(data.ch, CURLOPT_NOSIGNAL, 1);
-	curl_easy_setopt(data.ch, CURLOPT_CONNECTTIMEOUT, 30);
-	curl_easy_setopt(data.ch, CURLOPT_TIMEOUT, 120);
-	error = 0;
-	data.info = cache_open_info_write_(data.crawl, data.obj->key);
-	if(!data.info)
+		data->reqheaders = curl_slist_append(data->reqheaders, crawl->ua);
+	}
+	data->ch = curl_easy_init();
+	if(!data->ch)
 	{
-		jd_release(&dict);
-		crawl_obj_destroy(data.obj);
-		return NULL;
+		return crawl_fetch_giveup_(data);
 	}
-	data.payload = cache_open_payload_write_(crawl, data.obj->key);
-	if(!data.payload)
+	curl_easy_setopt(data->ch, CURLOPT_HTTPHEADER, data->reqheaders);
+	if(data->resolve)
 	{
-		jd_release(&dict);
-		crawl_obj_destroy(data.obj);
-		return NULL;
+		curl_easy_setopt(data->ch, CURLOPT_RESOLVE, data->resolve);
+	}
+	curl_easy_setopt(data->ch, CURLOPT_URL, data->obj->uristr);
+	curl_easy_setopt(data->ch, CURLOPT_WRITEFUNCTION, crawl_fetch_payload_);
+	curl_easy_setopt(data->ch, CURLOPT_WRITEDATA, (void *) data);
+	curl_easy_setopt(data->ch, CURLOPT_HEADERFUNCTION, crawl_fetch_header_);
+	curl_easy_setopt(data->ch, CURLOPT_HEADERDATA, (void *) data);
+	curl_easy_setopt(data->ch, CURLOPT_PRIVATE, (void *) data);
+	curl_easy_setopt(data->ch, CURLOPT_FOLLOWLOCATION, 0);
+	curl_easy_setopt(data->ch, CURLOPT_VERBOSE, crawl->verbose);
+	curl_easy_setopt(data->ch, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(data->ch, CURLOPT_CONNECTTIMEOUT, 30);
+	curl_easy_setopt(data->ch, CURLOPT_TIMEOUT, 120);
+	data->info = cache_open_info_write_(data->crawl, data->obj->key);
+	if(!data->info)
+	{
+		return crawl_fetch_giveup_(data);
+	}
+	data->payload = cache_open_payload_write_(crawl, data->obj->key);
+	if(!data->payload)
+	{
+		cache_close_info_rollback_(crawl, data->obj->key, data->info);
+		data->info = NULL;
+		return crawl_fetch_giveup_(data);
 	}
 	if(crawl->prefetch)
 	{
-		crawl->prefetch(crawl, data.obj->uri, data.obj->uristr, crawl->userdata);
+		crawl->prefetch(crawl, uri, data->obj->uristr, crawl->userdata);
 	}
-	if(curl_easy_perform(data.ch))
+	return 1;
+}
+
+/* Abandon a fetch before its transfer has begun, reporting it as having
+ * failed so that whatever handed out the URI doesn't wait for it forever
+ */
+static int
+crawl_fetch_giveup_(struct crawl_fetch_data_struct *data)
+{
+	CRAWL *crawl;
+	
+	crawl = data->crawl;
+	if(crawl->failed)
 	{
-		if(!data.status)
+		crawl->failed(crawl, data->obj, data->cachetime, crawl->userdata);
+	}
+	crawl_fetch_cleanup_(data);
+	return 0;
+}
+
+/* Complete a fetch once its transfer has finished, committing or rolling
+ * back the cache entry and invoking the relevant callback
+ */
+CRAWLOBJ *
+crawl_fetch_complete_(struct crawl_fetch_data_struct *data, CURLcode result)
+{
+	CRAWL *crawl;
+	CRAWLOBJ *obj;
+	jd_var json = JD_INIT;
+	size_t len;
+	const char *p;
+	int error;
+	
+	crawl = data->crawl;
+	error = 0;
+	if(result != CURLE_OK)
+	{
+		if(!data->status)
 		{
 			/* Use 504 to indicate a low-level fetch error */
-			data.status = 504;
+			data->status = 504;
 		}
 	}
 	else
 	{
-		/* In the event that there was no payload written, data.status will be
-		 * unset, so ensure that it is
+		/* In the event that there was no payload written, data->status will
+		 * be unset, so ensure that it is
 		 */
-		curl_easy_getinfo(data.ch, CURLINFO_RESPONSE_CODE, &(data.status));
-	}	
-	if(data.cachetime && data.status == 304)
+		curl_easy_getinfo(data->ch, CURLINFO_RESPONSE_CODE, &(data->status));
+	}
+	if(data->cachetime && data->status == 304)
 	{
 		/* Not modified; rollback with successful return */
-		data.rollback = 1;
+		data->rollback = 1;
 	}
-	else if(data.status >= 500)
+	else if(data->status >= 500)
 	{
 		/* rollback if there's already a cached version */
-		if(data.cachetime)
+		if(data->cachetime)
 		{
-			data.rollback = 1;
+			data->rollback = 1;
 		}
 	}
-	if(!data.rollback)
+	if(!data->rollback)
 	{
 		JD_SCOPE
 		{
-			if(crawl_update_info_(&data))
+			if(crawl_update_info_(data))
 			{
-				data.rollback = 1;
+				data->rollback = 1;
 				error = -1;
-				jd_to_json(&json, &(data.obj->info));
+			}
+			else if(!data->rollback)
+			{
+				/* The checkpoint callback may have requested a rollback */
+				jd_to_json(&json, &(data->obj->info));
 				p = jd_bytes(&json, &len);
 				len--;				
-				if(!p || (fwrite(p, len, 1, data.info) != 1))
+				if(!p || (fwrite(p, len, 1, data->info) != 1))
 				{
-					data.rollback = 1;
+					data->rollback = 1;
 					error = -1;
 				}
 				else
 				{
-					data.obj->fresh = 1;			
+					data->obj->fresh = 1;			
 				}
-			}
-			if(data.rollback)
-			{
-				crawl_obj_replace_(data.obj, &dict);
+				jd_release(&json);
 			}
 		}
 	}
-	free(data.headers);
-	jd_release(&dict);
-	if(data.rollback)
+	if(data->rollback && data->generated_info)
+	{
+		/* Restore the snapshot taken before the fetch */
+		crawl_obj_replace_(data->obj, &(data->snapshot));
+	}
+	if(data->rollback)
 	{
-		cache_close_info_rollback_(crawl, data.obj->key, data.info);
-		cache_close_payload_rollback_(crawl, data.obj->key, data.payload);
-		/* restore info */
+		cache_close_info_rollback_(crawl, data->obj->key, data->info);
+		cache_close_payload_rollback_(crawl, data->obj->key, data->payload);
 	}
 	else
 	{
-		cache_close_info_commit_(crawl, data.obj->key, data.info);
-		cache_close_payload_commit_(crawl, data.obj->key, data.payload);	
-	}	
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(data.ch);
+		cache_close_info_commit_(crawl, data->obj->key, data->info);
+		cache_close_payload_commit_(crawl, data->obj->key, data->payload);	
+	}
+	data->info = NULL;
+	data->payload = NULL;
 	/* If we rolled back and there was nothing to roll back to, consider
 	 * it an error */
-	if(data.rollback && !data.cachetime)
+	if(data->rollback && !data->cachetime)
 	{
 		error = -1;
 	}
@@ -220,24 +283,50 @@ crawl_fetch_uri(CRAWL *crawl, URI *uri)
 	{
 		if(crawl->failed)
 		{
-			crawl->failed(crawl, data.obj, data.cachetime, crawl->userdata);
+			crawl->failed(crawl, data->obj, data->cachetime, crawl->userdata);
 		}
-		crawl_obj_destroy(data.obj);
+		crawl_fetch_cleanup_(data);
 		return NULL;
 	}
-	if(!data.obj->fresh)
+	obj = data->obj;
+	data->obj = NULL;
+	crawl_fetch_cleanup_(data);
+	if(!obj->fresh)
 	{
 		if(crawl->unchanged)
 		{
-			crawl->unchanged(crawl, data.obj, data.cachetime, crawl->userdata);
+			crawl->unchanged(crawl, obj, data->cachetime, crawl->userdata);
 		}
-		return data.obj;
+		return obj;
 	}
 	if(crawl->updated)
 	{
-		crawl->updated(crawl, data.obj, data.cachetime, crawl->userdata);
+		crawl->updated(crawl, obj, data->cachetime, crawl->userdata);
+	}
+	return obj;
+}
+
+/* Release the resources held by a fetch (other than the cache files) */
+void
+crawl_fetch_cleanup_(struct crawl_fetch_data_struct *data)
+{
+	free(data->headers);
+	data->headers = NULL;
+	jd_release(&(data->snapshot));
+	curl_slist_free_all(data->reqheaders);
+	data->reqheaders = NULL;
+	curl_slist_free_all(data->resolve);
+	data->resolve = NULL;
+	if(data->ch)
+	{
+		curl_easy_cleanup(data->ch);
+		data->ch = NULL;
+	}
+	if(data->obj)
+	{
+		crawl_obj_destroy(data->obj);
+		data->obj = NULL;
 	}
-	return data.obj;
 }
 
 static size_t
@@ -322,13 +411,14 @@ crawl_update_info_(struct crawl_fetch_data_struct *data)
 		}
 		if(data->obj->status != data->status)
 		{
-			key = jd_get_ks(&(data->obj->info), "status", 1);
+			key = jd_get_ks(crawl_obj_info_(data->obj), "status", 1);
 			value = jd_niv(data->status);
+			jd_assign(key, value);
 			data->obj->status = data->status;
 		}
 		if(data->have_size)
 		{
-			key = jd_get_ks(&(data->obj->info), "size", 1);
+			key = jd_get_ks(crawl_obj_info_(data->obj), "size", 1);
 			value = jd_niv(data->size);
 			jd_assign(key, value);
 			data->obj->size = data->size;
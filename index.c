@@ -0,0 +1,584 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcrawl.h"
+
+#define INDEX_ALLOC_BLOCK              4096
+#define INDEX_TYPES_BLOCK              16
+
+/* Per-thread state used while building an index */
+struct index_build_thread_struct
+{
+	CRAWLINDEXENTRY *entries;
+	size_t count;
+	size_t size;
+	char **types;
+	size_t ntypes;
+	int error;
+};
+
+struct index_build_struct
+{
+	struct index_build_thread_struct *threads;
+	int nthreads;
+	/* The time at which the walk began: anything written after this may
+	 * have been missed
+	 */
+	time_t created;
+};
+
+static int index_build_cb_(void *userdata, int thread, const CACHEKEY key, const char *path);
+static uint32_t index_build_type_(struct index_build_thread_struct *t, const char *type);
+static int index_build_write_(CRAWL *crawl, const char *path, struct index_build_struct *build);
+static char *index_default_path_(CRAWL *crawl);
+static int index_entrycmp_(const void *a, const void *b);
+
+/* Build a sorted index of the objects in a cache */
+int
+crawl_cache_index(CRAWL *crawl, const char *path, int nthreads)
+{
+	struct index_build_struct build;
+	char *defpath;
+	int c, r;
+	
+	defpath = NULL;
+	if(!path)
+	{
+		defpath = index_default_path_(crawl);
+		if(!defpath)
+		{
+			return -1;
+		}
+		path = defpath;
+	}
+	nthreads = cache_walk_threads_(nthreads);
+	build.nthreads = nthreads;
+	build.threads = (struct index_build_thread_struct *) calloc(nthreads, sizeof(struct index_build_thread_struct));
+	if(!build.threads)
+	{
+		free(defpath);
+		return -1;
+	}
+	build.created = time(NULL);
+	r = cache_walk_(crawl, nthreads, index_build_cb_, &build);
+	for(c = 0; !r && c < nthreads; c++)
+	{
+		r = build.threads[c].error;
+	}
+	if(!r)
+	{
+		r = index_build_write_(crawl, path, &build);
+	}
+	for(c = 0; c < nthreads; c++)
+	{
+		free(build.threads[c].entries);
+		while(build.threads[c].ntypes)
+		{
+			build.threads[c].ntypes--;
+			free(build.threads[c].types[build.threads[c].ntypes]);
+		}
+		free(build.threads[c].types);
+	}
+	free(build.threads);
+	free(defpath);
+	return r;
+}
+
+/* Attach an index to a crawl context */
+int
+crawl_set_index(CRAWL *crawl, const char *path)
+{
+	CRAWLINDEX *index;
+	char *defpath;
+	
+	defpath = NULL;
+	if(!path)
+	{
+		defpath = index_default_path_(crawl);
+		if(!defpath)
+		{
+			return -1;
+		}
+		path = defpath;
+	}
+	index = crawl_index_open(path);
+	free(defpath);
+	if(!index)
+	{
+		return -1;
+	}
+	crawl_index_close(crawl->index);
+	crawl->index = index;
+	return 0;
+}
+
+CRAWLINDEX *
+crawl_index_open(const char *path)
+{
+	CRAWLINDEX *p;
+	struct stat sbuf;
+	const struct crawl_index_header_struct *h;
+	size_t c;
+	
+	p = (CRAWLINDEX *) calloc(1, sizeof(CRAWLINDEX));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->fd = open(path, O_RDONLY);
+	if(p->fd == -1)
+	{
+		free(p);
+		return NULL;
+	}
+	if(fstat(p->fd, &sbuf) || (size_t) sbuf.st_size < sizeof(struct crawl_index_header_struct))
+	{
+		crawl_index_close(p);
+		errno = EINVAL;
+		return NULL;
+	}
+	p->maplen = sbuf.st_size;
+	p->map = mmap(NULL, p->maplen, PROT_READ, MAP_SHARED, p->fd, 0);
+	if(p->map == MAP_FAILED)
+	{
+		p->map = NULL;
+		crawl_index_close(p);
+		return NULL;
+	}
+	h = p->header = (const struct crawl_index_header_struct *) p->map;
+	if(memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) ||
+		h->version != INDEX_VERSION ||
+		h->entrysize != sizeof(CRAWLINDEXENTRY) ||
+		h->count > (p->maplen - sizeof(struct crawl_index_header_struct)) / sizeof(CRAWLINDEXENTRY) ||
+		h->types > p->maplen ||
+		h->ntypes > (p->maplen - h->types) / sizeof(uint64_t))
+	{
+		crawl_index_close(p);
+		errno = EINVAL;
+		return NULL;
+	}
+	p->entries = (const CRAWLINDEXENTRY *) ((const char *) p->map + sizeof(struct crawl_index_header_struct));
+	p->count = h->count;
+	p->types = (const uint64_t *) ((const char *) p->map + h->types);
+	p->ntypes = h->ntypes;
+	p->created = (time_t) h->created;
+	/* Each type must be a string which ends within the map, so that
+	 * crawl_index_type() can return it as-is
+	 */
+	for(c = 0; c < p->ntypes; c++)
+	{
+		if(p->types[c] >= p->maplen ||
+			!memchr((const char *) p->map + p->types[c], 0, p->maplen - p->types[c]))
+		{
+			crawl_index_close(p);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	return p;
+}
+
+void
+crawl_index_close(CRAWLINDEX *index)
+{
+	if(index)
+	{
+		if(index->map)
+		{
+			munmap(index->map, index->maplen);
+		}
+		if(index->fd != -1)
+		{
+			close(index->fd);
+		}
+		free(index);
+	}
+}
+
+size_t
+crawl_index_count(CRAWLINDEX *index)
+{
+	return index->count;
+}
+
+time_t
+crawl_index_created(CRAWLINDEX *index)
+{
+	return index->created;
+}
+
+const CRAWLINDEXENTRY *
+crawl_index_entry(CRAWLINDEX *index, size_t n)
+{
+	if(n >= index->count)
+	{
+		return NULL;
+	}
+	return &(index->entries[n]);
+}
+
+/* Locate an entry by binary search */
+const CRAWLINDEXENTRY *
+crawl_index_lookup(CRAWLINDEX *index, const char *key)
+{
+	unsigned char bin[CACHE_KEY_BINLEN];
+	size_t lo, hi, mid;
+	int r;
+	
+	if(cache_key_bin_(key, bin))
+	{
+		return NULL;
+	}
+	lo = 0;
+	hi = index->count;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		r = memcmp(bin, index->entries[mid].key, CACHE_KEY_BINLEN);
+		if(!r)
+		{
+			return &(index->entries[mid]);
+		}
+		if(r < 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+const char *
+crawl_index_type(CRAWLINDEX *index, uint32_t type)
+{
+	if(!type || type > index->ntypes || index->types[type - 1] >= index->maplen)
+	{
+		return NULL;
+	}
+	return (const char *) index->map + index->types[type - 1];
+}
+
+int
+crawl_index_key(const CRAWLINDEXENTRY *entry, char *buf, size_t buflen)
+{
+	CACHEKEY k;
+	
+	cache_key_hex_(entry->key, k);
+	if(buflen)
+	{
+		strncpy(buf, k, buflen - 1);
+		buf[buflen - 1] = 0;
+	}
+	return 0;
+}
+
+/* Invoked by the cache walker for each object: parse the sidecar and
+ * append an entry to this thread's list
+ */
+static int
+index_build_cb_(void *userdata, int thread, const CACHEKEY key, const char *path)
+{
+	struct index_build_struct *build;
+	struct index_build_thread_struct *t;
+	CRAWLINDEXENTRY *p;
+	jd_var info = JD_INIT;
+	jd_var *value;
+	FILE *f;
+	
+	build = (struct index_build_struct *) userdata;
+	t = &(build->threads[thread]);
+	f = fopen(path, "r");
+	if(!f)
+	{
+		/* The object may have been replaced or removed since the directory
+		 * was read
+		 */
+		return 0;
+	}
+	if(cache_read_info_(f, &info))
+	{
+		t->error = -1;
+		return -1;
+	}
+	if(t->count + 1 > t->size)
+	{
+		p = (CRAWLINDEXENTRY *) realloc(t->entries, sizeof(CRAWLINDEXENTRY) * (t->size + INDEX_ALLOC_BLOCK));
+		if(!p)
+		{
+			jd_release(&info);
+			t->error = -1;
+			return -1;
+		}
+		t->entries = p;
+		t->size += INDEX_ALLOC_BLOCK;
+	}
+	p = &(t->entries[t->count]);
+	memset(p, 0, sizeof(CRAWLINDEXENTRY));
+	if(cache_key_bin_(key, p->key))
+	{
+		jd_release(&info);
+		return 0;
+	}
+	if(info.type != VOID)
+	{
+		JD_SCOPE
+		{
+			value = jd_get_ks(&info, "updated", 0);
+			if(value && value->type != VOID)
+			{
+				p->updated = jd_get_int(value);
+			}
+			value = jd_get_ks(&info, "status", 0);
+			if(value && value->type != VOID)
+			{
+				p->status = (int32_t) jd_get_int(value);
+			}
+			value = jd_get_ks(&info, "size", 0);
+			if(value && value->type != VOID)
+			{
+				p->size = jd_get_int(value);
+			}
+			value = jd_get_ks(&info, "type", 0);
+			if(value && value->type != VOID)
+			{
+				p->type = index_build_type_(t, jd_bytes(value, NULL));
+			}
+		}
+	}
+	jd_release(&info);
+	if(t->error)
+	{
+		return -1;
+	}
+	t->count++;
+	return 0;
+}
+
+/* Intern a type string in a thread's type table, returning its (thread-local)
+ * type ID
+ */
+static uint32_t
+index_build_type_(struct index_build_thread_struct *t, const char *type)
+{
+	char **p;
+	size_t c;
+	
+	if(!type)
+	{
+		return 0;
+	}
+	for(c = 0; c < t->ntypes; c++)
+	{
+		if(!strcmp(t->types[c], type))
+		{
+			return (uint32_t) c + 1;
+		}
+	}
+	if(!(t->ntypes % INDEX_TYPES_BLOCK))
+	{
+		p = (char **) realloc(t->types, sizeof(char *) * (t->ntypes + INDEX_TYPES_BLOCK));
+		if(!p)
+		{
+			t->error = -1;
+			return 0;
+		}
+		t->types = p;
+	}
+	t->types[t->ntypes] = strdup(type);
+	if(!t->types[t->ntypes])
+	{
+		t->error = -1;
+		return 0;
+	}
+	t->ntypes++;
+	return (uint32_t) t->ntypes;
+}
+
+/* Merge the per-thread lists, sort them and write the index */
+static int
+index_build_write_(CRAWL *crawl, const char *path, struct index_build_struct *build)
+{
+	struct crawl_index_header_struct header;
+	struct index_build_thread_struct *t;
+	CRAWLINDEXENTRY *entries;
+	const char **types;
+	uint32_t **remap;
+	uint64_t offset;
+	size_t count, ntypes, c, n, len;
+	char *tmp;
+	FILE *f;
+	int r;
+	
+	(void) crawl;
+	
+	count = 0;
+	ntypes = 0;
+	for(c = 0; c < (size_t) build->nthreads; c++)
+	{
+		count += build->threads[c].count;
+		ntypes += build->threads[c].ntypes;
+	}
+	entries = (CRAWLINDEXENTRY *) malloc(sizeof(CRAWLINDEXENTRY) * (count ? count : 1));
+	types = (const char **) malloc(sizeof(char *) * (ntypes ? ntypes : 1));
+	remap = (uint32_t **) calloc(build->nthreads, sizeof(uint32_t *));
+	tmp = (char *) malloc(strlen(path) + strlen(CACHE_TMP_SUFFIX) + 1);
+	if(!entries || !types || !remap || !tmp)
+	{
+		free(entries);
+		free(types);
+		free(remap);
+		free(tmp);
+		return -1;
+	}
+	/* Merge the per-thread type tables, mapping each thread's type IDs onto
+	 * those of the combined table
+	 */
+	r = 0;
+	ntypes = 0;
+	for(c = 0; c < (size_t) build->nthreads; c++)
+	{
+		t = &(build->threads[c]);
+		remap[c] = (uint32_t *) calloc(t->ntypes + 1, sizeof(uint32_t));
+		if(!remap[c])
+		{
+			r = -1;
+			break;
+		}
+		for(n = 0; n < t->ntypes; n++)
+		{
+			for(len = 0; len < ntypes; len++)
+			{
+				if(!strcmp(types[len], t->types[n]))
+				{
+					break;
+				}
+			}
+			if(len == ntypes)
+			{
+				types[ntypes] = t->types[n];
+				ntypes++;
+			}
+			remap[c][n + 1] = (uint32_t) len + 1;
+		}
+	}
+	count = 0;
+	for(c = 0; !r && c < (size_t) build->nthreads; c++)
+	{
+		t = &(build->threads[c]);
+		for(n = 0; n < t->count; n++)
+		{
+			entries[count] = t->entries[n];
+			entries[count].type = remap[c][entries[count].type];
+			count++;
+		}
+	}
+	for(c = 0; c < (size_t) build->nthreads; c++)
+	{
+		free(remap[c]);
+	}
+	free(remap);
+	if(r)
+	{
+		free(entries);
+		free(types);
+		free(tmp);
+		return -1;
+	}
+	qsort(entries, count, sizeof(CRAWLINDEXENTRY), index_entrycmp_);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.version = INDEX_VERSION;
+	header.entrysize = sizeof(CRAWLINDEXENTRY);
+	header.count = count;
+	header.created = build->created;
+	header.types = sizeof(header) + (sizeof(CRAWLINDEXENTRY) * count);
+	header.ntypes = ntypes;
+	sprintf(tmp, "%s%s", path, CACHE_TMP_SUFFIX);
+	f = fopen(tmp, "wb");
+	if(!f)
+	{
+		free(entries);
+		free(types);
+		free(tmp);
+		return -1;
+	}
+	if(fwrite(&header, sizeof(header), 1, f) != 1 ||
+		(count && fwrite(entries, sizeof(CRAWLINDEXENTRY), count, f) != count))
+	{
+		r = -1;
+	}
+	offset = header.types + (sizeof(uint64_t) * ntypes);
+	for(c = 0; !r && c < ntypes; c++)
+	{
+		if(fwrite(&offset, sizeof(offset), 1, f) != 1)
+		{
+			r = -1;
+		}
+		offset += strlen(types[c]) + 1;
+	}
+	for(c = 0; !r && c < ntypes; c++)
+	{
+		len = strlen(types[c]) + 1;
+		if(fwrite(types[c], len, 1, f) != 1)
+		{
+			r = -1;
+		}
+	}
+	if(fclose(f))
+	{
+		r = -1;
+	}
+	if(!r)
+	{
+		r = rename(tmp, path);
+	}
+	if(r)
+	{
+		unlink(tmp);
+	}
+	free(entries);
+	free(types);
+	free(tmp);
+	return r;
+}
+
+static char *
+index_default_path_(CRAWL *crawl)
+{
+	char *p;
+	
+	/* cache path + "/" + name */
+	p = (char *) malloc(strlen(crawl->cache) + 1 + strlen(CACHE_INDEX_NAME) + 1);
+	if(!p)
+	{
+		return NULL;
+	}
+	sprintf(p, "%s/%s", crawl->cache, CACHE_INDEX_NAME);
+	return p;
+}
+
+static int
+index_entrycmp_(const void *a, const void *b)
+{
+	return memcmp(((const CRAWLINDEXENTRY *) a)->key, ((const CRAWLINDEXENTRY *) b)->key, CACHE_KEY_BINLEN);
+}
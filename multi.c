@@ -0,0 +1,403 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcrawl.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+/* Event-driven crawling: many transfers are kept in flight at once within
+ * a single thread by way of a curl multi handle. Where epoll is available,
+ * curl informs us of the sockets it's interested in and we wait on them
+ * directly; otherwise, curl_multi_wait() is used.
+ *
+ * Whenever there are free slots, the next callback is invoked to obtain
+ * more URIs; if it has none to offer, it isn't asked again for
+ * MULTI_REPOLL_INTERVAL milliseconds, while the outstanding transfers
+ * proceed.
+ *
+ * The next callback is invoked synchronously from the event loop, so no
+ * transfer makes progress while it runs: it should return promptly, doing
+ * any slow work (such as querying a database) in batches. To limit the
+ * stall while many slots are refilled at once, the transfers are serviced
+ * after every MULTI_REFILL_BATCH URIs are added.
+ */
+
+#define MULTI_REPOLL_INTERVAL          1000
+#define MULTI_MAX_EVENTS               64
+#define MULTI_REFILL_BATCH             8
+
+struct crawl_multi_struct
+{
+	CRAWL *crawl;
+	CURLM *multi;
+	int epfd;
+	/* Monotonic time (in milliseconds) at which curl's timers next fall
+	 * due, or -1 if none are pending
+	 */
+	long long deadline;
+	size_t active;
+	struct crawl_fetch_data_struct *transfers;
+};
+
+static int multi_add_(struct crawl_multi_struct *m, URI *uri);
+static int multi_wait_(struct crawl_multi_struct *m, long maxwait);
+static int multi_complete_(struct crawl_multi_struct *m);
+#ifdef HAVE_SYS_EPOLL_H
+static long long multi_now_(void);
+static int multi_socket_cb_(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+static int multi_timer_cb_(CURLM *multi, long timeout_ms, void *userp);
+#endif
+
+int
+crawl_perform_multi(CRAWL *crawl, int maxconn)
+{
+	struct crawl_multi_struct m;
+	struct crawl_fetch_data_struct *data;
+	struct timespec now, polled;
+	URI *uri;
+	int r, drained, error, added;
+	long maxwait;
+	
+	if(!crawl->next)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(maxconn < 1)
+	{
+		maxconn = 1;
+	}
+	memset(&m, 0, sizeof(m));
+	m.crawl = crawl;
+	m.epfd = -1;
+	m.deadline = -1;
+	m.multi = curl_multi_init();
+	if(!m.multi)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	m.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(m.epfd < 0)
+	{
+		curl_multi_cleanup(m.multi);
+		return -1;
+	}
+	curl_multi_setopt(m.multi, CURLMOPT_SOCKETFUNCTION, multi_socket_cb_);
+	curl_multi_setopt(m.multi, CURLMOPT_SOCKETDATA, (void *) &m);
+	curl_multi_setopt(m.multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb_);
+	curl_multi_setopt(m.multi, CURLMOPT_TIMERDATA, (void *) &m);
+#endif
+	curl_multi_setopt(m.multi, CURLMOPT_MAXCONNECTS, (long) maxconn);
+	drained = 0;
+	error = 0;
+	memset(&polled, 0, sizeof(polled));
+	for(;;)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(drained && ((now.tv_sec - polled.tv_sec) * 1000 + (now.tv_nsec - polled.tv_nsec) / 1000000) >= MULTI_REPOLL_INTERVAL)
+		{
+			drained = 0;
+		}
+		/* Refill any free slots */
+		added = 0;
+		while(!drained && !error && m.active < (size_t) maxconn)
+		{
+			uri = NULL;
+			r = crawl->next(crawl, &uri, crawl->userdata);
+			if(r < 0)
+			{
+				error = 1;
+				break;
+			}
+			if(!uri)
+			{
+				drained = 1;
+				polled = now;
+				break;
+			}
+			if(multi_add_(&m, uri))
+			{
+				error = 1;
+			}
+			uri_destroy(uri);
+			added++;
+			if(!(added % MULTI_REFILL_BATCH) && m.active)
+			{
+				/* Don't leave the transfers in flight unattended for long */
+				if(multi_wait_(&m, 0))
+				{
+					error = 1;
+					break;
+				}
+				multi_complete_(&m);
+			}
+		}
+		if(!m.active)
+		{
+			if(drained || error)
+			{
+				break;
+			}
+			continue;
+		}
+		maxwait = (drained ? MULTI_REPOLL_INTERVAL : 1000);
+		if(multi_wait_(&m, maxwait))
+		{
+			error = 1;
+			break;
+		}
+		multi_complete_(&m);
+	}
+	/* Abandon any transfers which are still in flight; each is completed
+	 * as having been aborted, so that its outcome is still reported
+	 */
+	while(m.transfers)
+	{
+		data = m.transfers;
+		m.transfers = data->next;
+		curl_multi_remove_handle(m.multi, data->ch);
+		crawl_obj_destroy(crawl_fetch_complete_(data, CURLE_ABORTED_BY_CALLBACK));
+		free(data);
+	}
+	curl_multi_cleanup(m.multi);
+	if(m.epfd >= 0)
+	{
+		close(m.epfd);
+	}
+	return (error ? -1 : 0);
+}
+
+/* Prepare a fetch and add its transfer to the multi handle; returns -1 if
+ * the multi handle can't be used, or if the URI couldn't be passed to any
+ * callback
+ */
+static int
+multi_add_(struct crawl_multi_struct *m, URI *uri)
+{
+	struct crawl_fetch_data_struct *data, fallback;
+	CRAWLOBJ *obj;
+	int r;
+	
+	data = (struct crawl_fetch_data_struct *) malloc(sizeof(struct crawl_fetch_data_struct));
+	if(!data)
+	{
+		/* Report the fetch as having failed rather than dropping it */
+		r = crawl_fetch_prepare_(m->crawl, uri, &fallback, &obj);
+		if(r > 0)
+		{
+			obj = crawl_fetch_complete_(&fallback, CURLE_OUT_OF_MEMORY);
+		}
+		crawl_obj_destroy(obj);
+		return -1;
+	}
+	r = crawl_fetch_prepare_(m->crawl, uri, data, &obj);
+	if(r < 1)
+	{
+		/* Completed (or failed) without needing a transfer */
+		crawl_obj_destroy(obj);
+		free(data);
+		return r;
+	}
+	if(curl_multi_add_handle(m->multi, data->ch) != CURLM_OK)
+	{
+		crawl_obj_destroy(crawl_fetch_complete_(data, CURLE_FAILED_INIT));
+		free(data);
+		return -1;
+	}
+	data->next = m->transfers;
+	m->transfers = data;
+	m->active++;
+	return 0;
+}
+
+/* Wait for activity on any of the transfers (for no longer than maxwait
+ * milliseconds) and allow curl to process it
+ */
+static int
+multi_wait_(struct crawl_multi_struct *m, long maxwait)
+{
+	int running;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[MULTI_MAX_EVENTS];
+	long long now;
+	int c, n, flags;
+	
+	if(m->deadline >= 0)
+	{
+		now = multi_now_();
+		if(m->deadline <= now)
+		{
+			maxwait = 0;
+		}
+		else if(m->deadline - now < maxwait)
+		{
+			maxwait = (long) (m->deadline - now);
+		}
+	}
+	n = epoll_wait(m->epfd, events, MULTI_MAX_EVENTS, (int) maxwait);
+	if(n < 0)
+	{
+		return (errno == EINTR ? 0 : -1);
+	}
+	for(c = 0; c < n; c++)
+	{
+		flags = 0;
+		if(events[c].events & EPOLLIN)
+		{
+			flags |= CURL_CSELECT_IN;
+		}
+		if(events[c].events & EPOLLOUT)
+		{
+			flags |= CURL_CSELECT_OUT;
+		}
+		if(events[c].events & (EPOLLERR | EPOLLHUP))
+		{
+			flags |= CURL_CSELECT_ERR;
+		}
+		curl_multi_socket_action(m->multi, events[c].data.fd, flags, &running);
+	}
+	/* Busy sockets mustn't starve the timers of other transfers (such as
+	 * connection and low-speed timeouts), so fire them whenever they're due
+	 */
+	if(m->deadline >= 0 && m->deadline <= multi_now_())
+	{
+		curl_multi_socket_action(m->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	}
+	return 0;
+#else
+	int n;
+	
+	if(curl_multi_perform(m->multi, &running) != CURLM_OK ||
+		curl_multi_wait(m->multi, NULL, 0, (int) maxwait, &n) != CURLM_OK)
+	{
+		return -1;
+	}
+	curl_multi_perform(m->multi, &running);
+	return 0;
+#endif
+}
+
+/* Complete any transfers which have finished */
+static int
+multi_complete_(struct crawl_multi_struct *m)
+{
+	struct crawl_fetch_data_struct *data, **dp;
+	CURLMsg *msg;
+	CURL *ch;
+	CURLcode result;
+	int pending;
+	
+	while((msg = curl_multi_info_read(m->multi, &pending)))
+	{
+		if(msg->msg != CURLMSG_DONE)
+		{
+			continue;
+		}
+		ch = msg->easy_handle;
+		result = msg->data.result;
+		data = NULL;
+		curl_easy_getinfo(ch, CURLINFO_PRIVATE, (char **) &data);
+		curl_multi_remove_handle(m->multi, ch);
+		if(!data)
+		{
+			continue;
+		}
+		for(dp = &(m->transfers); *dp; dp = &((*dp)->next))
+		{
+			if(*dp == data)
+			{
+				*dp = data->next;
+				break;
+			}
+		}
+		m->active--;
+		crawl_obj_destroy(crawl_fetch_complete_(data, result));
+		free(data);
+	}
+	return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Invoked by curl to add, modify or remove interest in a socket */
+static int
+multi_socket_cb_(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+	struct crawl_multi_struct *m;
+	struct epoll_event ev;
+	
+	(void) easy;
+	
+	m = (struct crawl_multi_struct *) userp;
+	if(what == CURL_POLL_REMOVE)
+	{
+		epoll_ctl(m->epfd, EPOLL_CTL_DEL, s, NULL);
+		curl_multi_assign(m->multi, s, NULL);
+		return 0;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = s;
+	if(what & CURL_POLL_IN)
+	{
+		ev.events |= EPOLLIN;
+	}
+	if(what & CURL_POLL_OUT)
+	{
+		ev.events |= EPOLLOUT;
+	}
+	if(socketp)
+	{
+		epoll_ctl(m->epfd, EPOLL_CTL_MOD, s, &ev);
+	}
+	else
+	{
+		epoll_ctl(m->epfd, EPOLL_CTL_ADD, s, &ev);
+		/* Any non-NULL value marks the socket as being known to epoll */
+		curl_multi_assign(m->multi, s, (void *) m);
+	}
+	return 0;
+}
+
+/* Invoked by curl to update the time at which it should next be prodded */
+static int
+multi_timer_cb_(CURLM *multi, long timeout_ms, void *userp)
+{
+	struct crawl_multi_struct *m;
+	
+	(void) multi;
+	
+	m = (struct crawl_multi_struct *) userp;
+	m->deadline = (timeout_ms < 0 ? -1 : multi_now_() + timeout_ms);
+	return 0;
+}
+
+/* Return the current monotonic time in milliseconds */
+static long long
+multi_now_(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+#endif
@@ -21,38 +21,184 @@
 #include "p_libcrawl.h"
 
 static int crawl_obj_update_(CRAWLOBJ *obj);
+static int crawl_obj_header_id_(const char *name);
+static int crawl_obj_parse_headers_(CRAWLOBJ *obj, jd_var *headers);
+static CRAWLOBJ *crawl_obj_alloc_(CRAWL *crawl, const CACHEKEY key, size_t urilen);
+
+/* The interned names of the well-known headers, indexed by CRAWLHEADER */
+static const struct
+{
+	const char *name;
+	size_t len;
+} crawl_obj_header_names_[CRAWL_HDR_COUNT_] = {
+	{ "Content-Type", 12 },
+	{ "Content-Length", 14 },
+	{ "ETag", 4 },
+	{ "Last-Modified", 13 },
+	{ "Cache-Control", 13 },
+	{ "Expires", 7 },
+	{ "Location", 8 },
+	{ "Date", 4 },
+};
 
 CRAWLOBJ *
 crawl_obj_create_(CRAWL *crawl, URI *uri)
 {
 	CRAWLOBJ *p;
-	size_t needed;
+	char *str;
+	
+	str = uri_stralloc(uri);
+	if(!str)
+	{
+		return NULL;
+	}
+	p = crawl_obj_create_str_(crawl, str);
+	free(str);
+	return p;
+}
+
+/* Create an object for a URI string; the canonical form of the URI is
+ * written directly into the object's arena and hashed in place
+ */
+CRAWLOBJ *
+crawl_obj_create_str_(CRAWL *crawl, const char *uristr)
+{
+	CRAWLOBJ *p;
+	CACHEKEY key;
+	size_t needed, rootlen;
+	ssize_t len;
 	
-	p = (CRAWLOBJ *) calloc(1, sizeof(CRAWLOBJ));
+	needed = crawl_canon_size_(uristr);
+	/* The key isn't known until the URI has been canonicalised, but the
+	 * length of the payload path doesn't depend upon it
+	 */
+	memset(key, '0', CACHE_KEY_LEN);
+	key[CACHE_KEY_LEN] = 0;
+	p = crawl_obj_alloc_(crawl, key, needed);
 	if(!p)
 	{
 		return NULL;
 	}
-	p->crawl = crawl;
-	p->uri = uri_create_uri(uri, NULL);
-	if(!p->uri)
+	len = crawl_canon_write_(uristr, p->uristr, needed, &rootlen);
+	if(len < 0 ||
+		crawl_canon_hash_(p->uristr, len, rootlen, p->key, NULL, NULL) ||
+		cache_filename_(crawl, p->key, CACHE_PAYLOAD_SUFFIX, p->payload, p->payloadsize, 0) != p->payloadsize)
 	{
 		crawl_obj_destroy(p);
 		return NULL;
 	}
-	needed = uri_str(p->uri, NULL, 0);
-	if(!needed ||
-		(p->uristr = (char *) malloc(needed)) == NULL ||
-		uri_str(p->uri, p->uristr, needed) != needed ||
-		crawl_cache_key_(crawl, p->key, p->uristr))
+	return p;
+}
+
+/* Create an object for a cache key and read its JSON sidecar; the URI is
+ * recovered from the stored location, if there is one
+ */
+CRAWLOBJ *
+crawl_obj_locate_key_(CRAWL *crawl, const CACHEKEY key)
+{
+	CRAWLOBJ *p;
+	jd_var info = JD_INIT;
+	jd_var *value;
+	const char *str;
+	size_t len;
+	FILE *f;
+	
+	f = cache_open_info_read_(crawl, key);
+	if(!f)
 	{
-		crawl_obj_destroy(p);
 		return NULL;
 	}
-	needed = cache_filename_(crawl, p->key, CACHE_PAYLOAD_SUFFIX, NULL, 0, 0);
-	if(!needed ||
-		(p->payload = (char *) malloc(needed)) == NULL ||
-		cache_filename_(crawl, p->key, CACHE_PAYLOAD_SUFFIX, p->payload, needed, 0) != needed)
+	if(cache_read_info_(f, &info))
+	{
+		return NULL;
+	}
+	str = NULL;
+	if(info.type != VOID)
+	{
+		JD_SCOPE
+		{
+			value = jd_get_ks(&info, "location", 0);
+			if(value && value->type != VOID)
+			{
+				str = jd_bytes(value, NULL);
+			}
+		}
+	}
+	len = (str ? strlen(str) + 1 : 0);
+	p = crawl_obj_alloc_(crawl, key, len);
+	if(!p)
+	{
+		jd_release(&info);
+		return NULL;
+	}
+	if(str)
+	{
+		strcpy(p->uristr, str);
+	}
+	else
+	{
+		p->uristr = NULL;
+	}
+	jd_assign(&(p->info), &info);
+	jd_release(&info);
+	crawl_obj_update_(p);
+	return p;
+}
+
+/* Obtain an object whose arena can hold a URI of urilen bytes (including
+ * the terminating NUL) followed by the payload path for key, taking it from
+ * the context's pool if possible. The payload path is filled in.
+ */
+static CRAWLOBJ *
+crawl_obj_alloc_(CRAWL *crawl, const CACHEKEY key, size_t urilen)
+{
+	CRAWLOBJ *p, **pp;
+	size_t payloadsize, needed;
+	
+	payloadsize = cache_filename_(crawl, key, CACHE_PAYLOAD_SUFFIX, NULL, 0, 0);
+	needed = urilen + payloadsize;
+	p = NULL;
+	for(pp = &(crawl->pool); *pp; pp = &((*pp)->next))
+	{
+		if((*pp)->arenasize >= needed)
+		{
+			p = *pp;
+			*pp = p->next;
+			crawl->poolcount--;
+			break;
+		}
+	}
+	if(!p)
+	{
+		/* Grow a pooled object (if there is one) rather than leaving it to
+		 * languish
+		 */
+		p = crawl->pool;
+		if(p)
+		{
+			crawl->pool = p->next;
+			crawl->poolcount--;
+		}
+		needed = ((needed + OBJ_ARENA_BLOCK - 1) / OBJ_ARENA_BLOCK) * OBJ_ARENA_BLOCK;
+		pp = (CRAWLOBJ **) realloc(p, sizeof(CRAWLOBJ) + needed);
+		if(!pp)
+		{
+			free(p);
+			return NULL;
+		}
+		p = (CRAWLOBJ *) pp;
+		p->arenasize = needed;
+	}
+	needed = p->arenasize;
+	memset(p, 0, sizeof(CRAWLOBJ));
+	p->arenasize = needed;
+	p->crawl = crawl;
+	p->max_age = -1;
+	strcpy(p->key, key);
+	p->uristr = p->arena;
+	p->payload = &(p->arena[urilen]);
+	p->payloadsize = payloadsize;
+	if(cache_filename_(crawl, key, CACHE_PAYLOAD_SUFFIX, p->payload, payloadsize, 0) != payloadsize)
 	{
 		crawl_obj_destroy(p);
 		return NULL;
@@ -65,46 +211,17 @@ int
 crawl_obj_locate_(CRAWLOBJ *obj)
 {
 	FILE *f;
-	char *buf, *p;
-	size_t bufsize;
-	ssize_t count;
 	
 	f = cache_open_info_read_(obj->crawl, obj->key);
 	if(!f)
 	{
 		return -1;
 	}
-	/* Read JSON */
-	buf = 0;
-	bufsize = 0;
-	for(;;)
-	{
-		p = realloc(buf, bufsize + OBJ_READ_BLOCK + 1);
-		if(!p)
-		{
-			fclose(f);
-			return -1;
-		}
-		buf = p;
-		p = &(buf[bufsize]);
-		count = fread(p, 1, OBJ_READ_BLOCK, f);
-		if(count < 0)
-		{
-			fclose(f);
-			free(buf);
-			return -1;
-		}
-		p[count] = 0;
-		bufsize += count;
-		if(count == 0)
-		{
-			break;
-		}
-	}	
-	fclose(f);
 	jd_release(&(obj->info));
-	jd_from_jsons(&(obj->info), buf);
-	free(buf);
+	if(cache_read_info_(f, &(obj->info)))
+	{
+		return -1;
+	}
 	crawl_obj_update_(obj);
 	return 0;
 }
@@ -112,20 +229,78 @@ crawl_obj_locate_(CRAWLOBJ *obj)
 int
 crawl_obj_destroy(CRAWLOBJ *obj)
 {
+	CRAWL *crawl;
+	
 	if(obj)
 	{
 		if(obj->uri)
 		{
 			uri_destroy(obj->uri);
 		}
-		free(obj->uristr);
-		free(obj->payload);
 		jd_release(&(obj->info));
+		/* Recycle the object, along with the arena holding its strings */
+		crawl = obj->crawl;
+		if(crawl && !obj->detached && crawl->poolcount < OBJ_POOL_MAX)
+		{
+			obj->next = crawl->pool;
+			crawl->pool = obj;
+			crawl->poolcount++;
+			return 0;
+		}
 		free(obj);
 	}
 	return 0;
 }
 
+/* Copy an object, including its arena, such that the copy doesn't share
+ * anything with the original: its information is deep-cloned and it won't
+ * be returned to the context's object pool when it's destroyed
+ */
+CRAWLOBJ *
+crawl_obj_dup(CRAWLOBJ *obj)
+{
+	CRAWLOBJ *p;
+	
+	p = (CRAWLOBJ *) malloc(sizeof(CRAWLOBJ) + obj->arenasize);
+	if(!p)
+	{
+		return NULL;
+	}
+	memcpy(p, obj, sizeof(CRAWLOBJ) + obj->arenasize);
+	p->next = NULL;
+	p->uri = NULL;
+	p->shared = 0;
+	p->detached = 1;
+	if(obj->uristr)
+	{
+		p->uristr = p->arena + (obj->uristr - obj->arena);
+	}
+	if(obj->payload)
+	{
+		p->payload = p->arena + (obj->payload - obj->arena);
+	}
+	memset(&(p->info), 0, sizeof(jd_var));
+	jd_clone(&(p->info), &(obj->info), 1);
+	/* Pointers into the original's dictionary must be re-established */
+	crawl_obj_update_(p);
+	return p;
+}
+
+/* Free the objects held in a context's pool */
+void
+crawl_obj_pool_destroy_(CRAWL *crawl)
+{
+	CRAWLOBJ *p;
+	
+	while(crawl->pool)
+	{
+		p = crawl->pool;
+		crawl->pool = p->next;
+		free(p);
+	}
+	crawl->poolcount = 0;
+}
+
 const char *
 crawl_obj_key(CRAWLOBJ *obj)
 {
@@ -186,10 +361,14 @@ crawl_obj_headers(CRAWLOBJ *obj, jd_var *out, int clone)
 	return r;
 }
 
-/* Obtain the crawl object URI */
+/* Obtain the crawl object URI, which is only parsed when first requested */
 const URI *
 crawl_obj_uri(CRAWLOBJ *obj)
 {
+	if(!obj->uri && obj->uristr)
+	{
+		obj->uri = uri_create_str(obj->uristr, NULL);
+	}
 	return obj->uri;
 }
 
@@ -203,45 +382,73 @@ crawl_obj_uristr(CRAWLOBJ *obj)
 const char *
 crawl_obj_type(CRAWLOBJ *obj)
 {
-	jd_var *key;
-	const char *str;
-	
-	if(obj->info.type == VOID)
-	{
-		return NULL;
-	}
-	JD_SCOPE
-	{
-		key = jd_get_ks(&(obj->info), "type", 1);
-		if(key->type == VOID)
-		{
-			return NULL;
-		}
-		str = jd_bytes(key, NULL);
-	}
-	return str;
+	return obj->type;
 }
 
 const char *
 crawl_obj_redirect(CRAWLOBJ *obj)
 {
-	jd_var *key;
-	const char *str;
-	
-	if(obj->info.type == VOID)
+	return obj->redirect;
+}
+
+/* Obtain the first value of a well-known response header */
+const char *
+crawl_obj_header(CRAWLOBJ *obj, CRAWLHEADER header)
+{
+	if((int) header < 0 || header >= CRAWL_HDR_COUNT_)
 	{
 		return NULL;
 	}
-	JD_SCOPE
-	{
-		key = jd_get_ks(&(obj->info), "redirect", 1);
-		if(key->type == VOID)
-		{
-			return NULL;
-		}
-		str = jd_bytes(key, NULL);
-	}
-	return str;
+	return obj->headers[header];
+}
+
+/* Obtain the media type of the payload, without parameters */
+const char *
+crawl_obj_media_type(CRAWLOBJ *obj)
+{
+	return (obj->media_type[0] ? obj->media_type : NULL);
+}
+
+/* Obtain the character set of the payload */
+const char *
+crawl_obj_charset(CRAWLOBJ *obj)
+{
+	return (obj->charset[0] ? obj->charset : NULL);
+}
+
+/* Obtain the entity tag of the resource */
+const char *
+crawl_obj_etag(CRAWLOBJ *obj)
+{
+	return obj->headers[CRAWL_HDR_ETAG];
+}
+
+/* Obtain the last modification time of the resource */
+time_t
+crawl_obj_last_modified(CRAWLOBJ *obj)
+{
+	return obj->last_modified;
+}
+
+/* Obtain the Cache-Control header of the response */
+const char *
+crawl_obj_cache_control(CRAWLOBJ *obj)
+{
+	return obj->headers[CRAWL_HDR_CACHE_CONTROL];
+}
+
+/* Obtain the expiry time from the Expires header */
+time_t
+crawl_obj_expires(CRAWLOBJ *obj)
+{
+	return obj->expires;
+}
+
+/* Obtain the max-age from the Cache-Control header */
+long
+crawl_obj_max_age(CRAWLOBJ *obj)
+{
+	return obj->max_age;
 }
 
 /* Has this object been freshly-fetched? */
@@ -251,15 +458,53 @@ crawl_obj_fresh(CRAWLOBJ *obj)
 	return obj->fresh;
 }
 
-/* Replace the information in a crawl object with a new dictionary */
+/* Replace the information in a crawl object with a new dictionary (or a
+ * snapshot taken with crawl_obj_snapshot_()). The dictionary isn't copied:
+ * the caller must release its own reference and not modify it afterwards.
+ */
 int
 crawl_obj_replace_(CRAWLOBJ *obj, jd_var *dict)
 {
 	jd_release(&(obj->info));
-	jd_clone(&(obj->info), dict, 1);
+	jd_assign(&(obj->info), dict);
+	obj->shared = 0;
 	return crawl_obj_update_(obj);
 }
 
+/* Take a snapshot of the information in a crawl object, which can later be
+ * restored with crawl_obj_replace_(). The snapshot shares the object's
+ * dictionary: it is only copied if the object is modified in place (see
+ * crawl_obj_info_()) before being replaced.
+ */
+int
+crawl_obj_snapshot_(CRAWLOBJ *obj, jd_var *snapshot)
+{
+	jd_assign(snapshot, &(obj->info));
+	obj->shared = 1;
+	return 0;
+}
+
+/* Obtain the object's dictionary for modification, copying it first if it is
+ * shared with a snapshot
+ */
+jd_var *
+crawl_obj_info_(CRAWLOBJ *obj)
+{
+	jd_var copy = JD_INIT;
+	
+	if(obj->shared)
+	{
+		jd_clone(&copy, &(obj->info), 1);
+		jd_release(&(obj->info));
+		jd_assign(&(obj->info), &copy);
+		jd_release(&copy);
+		obj->shared = 0;
+		/* Pointers into the old dictionary are no longer valid */
+		crawl_obj_update_(obj);
+	}
+	return &(obj->info);
+}
+
 /* Update internal members of the structured based on the info jd_var */
 static int
 crawl_obj_update_(CRAWLOBJ *obj)
@@ -267,27 +512,175 @@ crawl_obj_update_(CRAWLOBJ *obj)
 	jd_var *key;
 	
 	obj->updated = 0;
+	obj->type = NULL;
+	obj->redirect = NULL;
 	if(obj->info.type == VOID)
 	{
+		crawl_obj_parse_headers_(obj, NULL);
 		return -1;
 	}
 	JD_SCOPE
 	{
-		key = jd_get_ks(&(obj->info), "updated", 1);
-		if(key->type != VOID)
+		key = jd_get_ks(&(obj->info), "updated", 0);
+		if(key && key->type != VOID)
 		{
 			obj->updated = jd_get_int(key);
 		}
-		key = jd_get_ks(&(obj->info), "status", 1);
-		if(key->type != VOID)
+		key = jd_get_ks(&(obj->info), "status", 0);
+		if(key && key->type != VOID)
 		{
 			obj->status = jd_get_int(key);
 		}
-		key = jd_get_ks(&(obj->info), "size", 1);
-		if(key->type != VOID)
+		key = jd_get_ks(&(obj->info), "size", 0);
+		if(key && key->type != VOID)
 		{
 			obj->size = jd_get_int(key);
 		}
+		key = jd_get_ks(&(obj->info), "type", 0);
+		if(key && key->type != VOID)
+		{
+			obj->type = jd_bytes(key, NULL);
+		}
+		key = jd_get_ks(&(obj->info), "redirect", 0);
+		if(key && key->type != VOID)
+		{
+			obj->redirect = jd_bytes(key, NULL);
+		}
+		crawl_obj_parse_headers_(obj, jd_get_ks(&(obj->info), "headers", 0));
+	}
+	return 0;
+}
+
+/* Map a header name onto a well-known header, ignoring case */
+static int
+crawl_obj_header_id_(const char *name)
+{
+	size_t c, len;
+	
+	len = strlen(name);
+	for(c = 0; c < CRAWL_HDR_COUNT_; c++)
+	{
+		if(len == crawl_obj_header_names_[c].len &&
+			!strcasecmp(name, crawl_obj_header_names_[c].name))
+		{
+			return (int) c;
+		}
+	}
+	return -1;
+}
+
+/* Locate the well-known headers in the response headers, and derive the
+ * normalised values from them; this happens once each time the object's
+ * dictionary is replaced, so that the accessors need only return a member.
+ */
+static int
+crawl_obj_parse_headers_(CRAWLOBJ *obj, jd_var *headers)
+{
+	jd_var keys = JD_INIT;
+	jd_var *value;
+	const char *name, *type, *s;
+	size_t c, count, n;
+	int id;
+	
+	memset(obj->headers, 0, sizeof(obj->headers));
+	obj->media_type[0] = 0;
+	obj->charset[0] = 0;
+	obj->last_modified = 0;
+	obj->expires = 0;
+	obj->max_age = -1;
+	if(headers && headers->type == HASH)
+	{
+		jd_keys(&keys, headers);
+		count = jd_count(&keys);
+		for(c = 0; c < count; c++)
+		{
+			name = jd_bytes(jd_get_idx(&keys, c), NULL);
+			if(!name || (id = crawl_obj_header_id_(name)) < 0 || obj->headers[id])
+			{
+				continue;
+			}
+			value = jd_get_ks(headers, name, 0);
+			if(value && value->type == ARRAY)
+			{
+				value = (jd_count(value) ? jd_get_idx(value, 0) : NULL);
+			}
+			if(value && value->type == STRING)
+			{
+				obj->headers[id] = jd_bytes(value, NULL);
+			}
+		}
+		jd_release(&keys);
+	}
+	/* Media type: lower-cased, without parameters or whitespace */
+	type = (obj->type ? obj->type : obj->headers[CRAWL_HDR_CONTENT_TYPE]);
+	if(type)
+	{
+		while(isspace(*type))
+		{
+			type++;
+		}
+		for(n = 0; type[n] && type[n] != ';' && n + 1 < sizeof(obj->media_type); n++)
+		{
+			obj->media_type[n] = tolower(type[n]);
+		}
+		while(n && isspace(obj->media_type[n - 1]))
+		{
+			n--;
+		}
+		obj->media_type[n] = 0;
+		/* Character set, from the charset parameter */
+		for(s = strchr(type, ';'); s; s = strchr(s + 1, ';'))
+		{
+			s++;
+			while(isspace(*s))
+			{
+				s++;
+			}
+			if(strncasecmp(s, "charset=", 8))
+			{
+				continue;
+			}
+			s += 8;
+			if(*s == '"')
+			{
+				s++;
+			}
+			for(n = 0; s[n] && s[n] != ';' && s[n] != '"' && !isspace(s[n]) && n + 1 < sizeof(obj->charset); n++)
+			{
+				obj->charset[n] = tolower(s[n]);
+			}
+			obj->charset[n] = 0;
+			break;
+		}
+	}
+	if(obj->headers[CRAWL_HDR_LAST_MODIFIED])
+	{
+		obj->last_modified = curl_getdate(obj->headers[CRAWL_HDR_LAST_MODIFIED], NULL);
+		if(obj->last_modified == -1)
+		{
+			obj->last_modified = 0;
+		}
+	}
+	if(obj->headers[CRAWL_HDR_EXPIRES])
+	{
+		/* An invalid date (such as "0") means already expired */
+		obj->expires = curl_getdate(obj->headers[CRAWL_HDR_EXPIRES], NULL);
+		if(obj->expires == -1)
+		{
+			obj->expires = 1;
+		}
+	}
+	for(s = obj->headers[CRAWL_HDR_CACHE_CONTROL]; s && *s; s++)
+	{
+		/* Find the max-age directive at the start of the value or after a
+		 * separator (so that s-maxage is not mistaken for it)
+		 */
+		if((s == obj->headers[CRAWL_HDR_CACHE_CONTROL] || s[-1] == ',' || isspace(s[-1])) &&
+			!strncasecmp(s, "max-age=", 8))
+		{
+			obj->max_age = strtol(s + 8, NULL, 10);
+			break;
+		}
 	}
 	return 0;
 }
@@ -21,14 +21,19 @@
 # include <stdlib.h>
 # include <string.h>
 # include <ctype.h>
+# include <strings.h>
 # include <errno.h>
 # include <sys/types.h>
 # include <sys/stat.h>
 # include <fcntl.h>
 # include <unistd.h>
+# include <dirent.h>
+# include <pthread.h>
+# include <sys/mman.h>
 
 # include <curl/curl.h>
 # include <openssl/sha.h>
+# include <openssl/evp.h>
 
 # include "crawl.h"
 
@@ -68,6 +73,21 @@
 # define CACHE_INFO_SUFFIX             "json"
 # define CACHE_PAYLOAD_SUFFIX          "payload"
 # define CACHE_TMP_SUFFIX              ".tmp"
+# define CACHE_INDEX_NAME              "index"
+# define CACHE_KEY_BINLEN              (CACHE_KEY_LEN / 2)
+# define INDEX_MAGIC                   "CRAWLIDX"
+# define INDEX_VERSION                 1
+# define OBJ_POOL_MAX                  16
+# define OBJ_ARENA_BLOCK               256
+# define OBJ_MEDIA_TYPE_LEN            128
+# define OBJ_CHARSET_LEN               48
+# define RESOLVE_HOST_LEN              256
+# define RESOLVE_BUCKETS               1024
+# define RESOLVE_MAX_ENTRIES           65536
+# define RESOLVE_QUEUE_LEN             1024
+# define RESOLVE_THREADS               4
+# define RESOLVE_POSITIVE_TTL          300
+# define RESOLVE_NEGATIVE_TTL          60
 
 typedef char CACHEKEY[CACHE_KEY_LEN+1];
 
@@ -89,27 +109,62 @@ struct crawl_struct
 	crawl_checkpoint_cb checkpoint;
 	crawl_unchanged_cb unchanged;
 	crawl_prefetch_cb prefetch;
+	CRAWLINDEX *index;
+	CRAWLOBJ *pool;
+	size_t poolcount;
 };
 
+/* An object, the URI string and the payload path are allocated as a single
+ * block: the strings are stored in the arena which follows the structure.
+ * When destroyed, objects are returned to their context's pool (up to
+ * OBJ_POOL_MAX of them) for re-use. The parsed URI is only created on
+ * demand.
+ *
+ * The type, redirect and headers members point into the info dictionary,
+ * and are re-derived (along with the normalised media type, character set,
+ * modification time and max-age) whenever it is replaced.
+ */
 struct crawl_object_struct
 {
 	CRAWL *crawl;
+	CRAWLOBJ *next;
 	CACHEKEY key;
 	int fresh;
 	time_t updated;
 	int status;
 	jd_var info;
+	int shared;
+	int detached;
 	URI *uri;
 	char *uristr;
 	char *payload;
+	size_t payloadsize;
 	uint64_t size;
+	const char *type;
+	const char *redirect;
+	const char *headers[CRAWL_HDR_COUNT_];
+	char media_type[OBJ_MEDIA_TYPE_LEN];
+	char charset[OBJ_CHARSET_LEN];
+	time_t last_modified;
+	time_t expires;
+	long max_age;
+	size_t arenasize;
+	char arena[];
 };
 
+/* The state of a single fetch, from crawl_fetch_prepare_() until
+ * crawl_fetch_complete_(); transfers may be performed synchronously or
+ * by way of a multi handle.
+ */
 struct crawl_fetch_data_struct
 {
 	CRAWL *crawl;
 	CRAWLOBJ *obj;
 	CURL *ch;
+	struct curl_slist *reqheaders;
+	struct curl_slist *resolve;
+	jd_var snapshot;
+	struct crawl_fetch_data_struct *next;
 	int rollback;
 	time_t now;
 	char *headers;
@@ -125,11 +180,67 @@ struct crawl_fetch_data_struct
 	int checkpoint_invoked;
 };
 
+/* Cache index files are laid out as:
+ *
+ * struct crawl_index_header_struct
+ * CRAWLINDEXENTRY[count], sorted by binary key
+ * uint64_t[ntypes]: offsets of each of the type strings from the start
+ *                   of the file
+ * NUL-terminated type strings
+ *
+ * All values are stored in host byte order; an index is intended to be
+ * consumed on the machine which generated it. Type ID 0 means "no type";
+ * type ID n refers to the (n-1)th string in the type table.
+ */
+struct crawl_index_header_struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entrysize;
+	uint64_t count;
+	int64_t created;
+	uint64_t types;
+	uint64_t ntypes;
+};
+
+struct crawl_index_struct
+{
+	int fd;
+	void *map;
+	size_t maplen;
+	const struct crawl_index_header_struct *header;
+	const CRAWLINDEXENTRY *entries;
+	size_t count;
+	const uint64_t *types;
+	size_t ntypes;
+	time_t created;
+};
+
+/* Invoked by cache_walk_() for each committed object in the cache; thread
+ * is the index of the worker thread (0..nthreads-1) and path is the path
+ * to the object's JSON sidecar. Return nonzero to stop the walk.
+ */
+typedef int (*cache_walk_cb_)(void *userdata, int thread, const CACHEKEY key, const char *path);
+
 CRAWLOBJ *crawl_obj_create_(CRAWL *crawl, URI *uri);
+CRAWLOBJ *crawl_obj_create_str_(CRAWL *crawl, const char *uristr);
+CRAWLOBJ *crawl_obj_locate_key_(CRAWL *crawl, const CACHEKEY key);
+void crawl_obj_pool_destroy_(CRAWL *crawl);
 int crawl_obj_locate_(CRAWLOBJ *obj);
 int crawl_obj_replace_(CRAWLOBJ *obj, jd_var *dict);
+int crawl_obj_snapshot_(CRAWLOBJ *obj, jd_var *snapshot);
+jd_var *crawl_obj_info_(CRAWLOBJ *obj);
+
+int crawl_fetch_prepare_(CRAWL *crawl, URI *uri, struct crawl_fetch_data_struct *data, CRAWLOBJ **result);
+CRAWLOBJ *crawl_fetch_complete_(struct crawl_fetch_data_struct *data, CURLcode result);
+void crawl_fetch_cleanup_(struct crawl_fetch_data_struct *data);
+
+int crawl_resolve_lookup_(const char *uristr, struct curl_slist **list);
 
 int crawl_cache_key_(CRAWL *crawl, CACHEKEY dest, const char *uri);
+size_t crawl_canon_size_(const char *uristr);
+ssize_t crawl_canon_write_(const char *uristr, char *dest, size_t destlen, size_t *rootlen);
+int crawl_canon_hash_(const char *uri, size_t urilen, size_t rootlen, char *key, char *rootkey, uint32_t *shortkey);
 size_t cache_filename_(CRAWL *crawl, const CACHEKEY key, const char *type, char *buf, size_t bufsize, int temporary);
 FILE *cache_open_info_read_(CRAWL *crawl, const CACHEKEY key);
 FILE *cache_open_info_write_(CRAWL *crawl, const CACHEKEY key);
@@ -138,5 +249,12 @@ int cache_close_info_rollback_(CRAWL *crawl, const CACHEKEY key, FILE *f);
 int cache_close_payload_rollback_(CRAWL *crawl, const CACHEKEY key, FILE *f);
 int cache_close_info_commit_(CRAWL *crawl, const CACHEKEY key, FILE *f);
 int cache_close_payload_commit_(CRAWL *crawl, const CACHEKEY key, FILE *f);
+int cache_read_info_(FILE *f, jd_var *dest);
+int cache_stat_leaf_(CRAWL *crawl, const CACHEKEY key, struct stat *sbuf);
+int cache_key_bin_(const char *key, unsigned char *dest);
+void cache_key_hex_(const unsigned char *bin, CACHEKEY dest);
+int cache_walk_threads_(int nthreads);
+int cache_walk_(CRAWL *crawl, int nthreads, cache_walk_cb_ cb, void *userdata);
+int cache_walk_since_(CRAWL *crawl, int nthreads, time_t since, cache_walk_cb_ cb, void *userdata);
 
 #endif /*!P_LIBCRAWL_H_*/
\ No newline at end of file
@@ -0,0 +1,384 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcrawl.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* Name resolution ahead of fetching
+ *
+ * Host names are resolved in the background by a small pool of threads,
+ * shared by every context in the process, and the results held in a cache:
+ * successful look-ups for RESOLVE_POSITIVE_TTL seconds and definitive
+ * failures for RESOLVE_NEGATIVE_TTL seconds (getaddrinfo() doesn't expose
+ * record TTLs). When a fetch is prepared, a cached address is handed to curl
+ * by way of CURLOPT_RESOLVE, so that the transfer doesn't wait for DNS, and
+ * a host which is known not to resolve fails immediately.
+ */
+
+enum
+{
+	RESOLVE_PENDING,
+	RESOLVE_OK,
+	RESOLVE_FAILED
+};
+
+struct resolve_entry
+{
+	struct resolve_entry *next;
+	int state;
+	time_t expires;
+	char addr[INET6_ADDRSTRLEN];
+	char host[RESOLVE_HOST_LEN];
+};
+
+static int resolve_host_(const char *uristr, char *host, size_t hostlen, int *port);
+static struct resolve_entry *resolve_find_(const char *host, unsigned int h, time_t now);
+static unsigned int resolve_hash_(const char *host);
+static void resolve_init_(void);
+static void *resolve_thread_(void *arg);
+
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static struct resolve_entry *resolve_cache[RESOLVE_BUCKETS];
+static size_t resolve_count;
+/* Entries waiting to be resolved */
+static struct resolve_entry *resolve_queue[RESOLVE_QUEUE_LEN];
+static size_t resolve_head, resolve_tail;
+static int resolve_threads;
+
+/* Begin resolving the host of a URI in the background, unless it's already
+ * cached (or being resolved)
+ */
+int
+crawl_resolve_prefetch(const char *uristr)
+{
+	struct resolve_entry *entry;
+	char host[RESOLVE_HOST_LEN];
+	unsigned int h;
+	time_t now;
+	int port;
+	
+	if(resolve_host_(uristr, host, sizeof(host), &port))
+	{
+		return 0;
+	}
+	pthread_once(&resolve_once, resolve_init_);
+	if(!resolve_threads)
+	{
+		return -1;
+	}
+	h = resolve_hash_(host);
+	now = time(NULL);
+	pthread_mutex_lock(&resolve_lock);
+	entry = resolve_find_(host, h, now);
+	if(entry || resolve_count >= RESOLVE_MAX_ENTRIES ||
+		resolve_tail - resolve_head >= RESOLVE_QUEUE_LEN)
+	{
+		pthread_mutex_unlock(&resolve_lock);
+		return 0;
+	}
+	entry = (struct resolve_entry *) calloc(1, sizeof(struct resolve_entry));
+	if(!entry)
+	{
+		pthread_mutex_unlock(&resolve_lock);
+		return -1;
+	}
+	strcpy(entry->host, host);
+	entry->state = RESOLVE_PENDING;
+	entry->next = resolve_cache[h];
+	resolve_cache[h] = entry;
+	resolve_count++;
+	resolve_queue[resolve_tail % RESOLVE_QUEUE_LEN] = entry;
+	resolve_tail++;
+	pthread_cond_signal(&resolve_cond);
+	pthread_mutex_unlock(&resolve_lock);
+	return 0;
+}
+
+/* Is the host of a URI known not to resolve? */
+int
+crawl_resolve_failed(const char *uristr)
+{
+	struct resolve_entry *entry;
+	char host[RESOLVE_HOST_LEN];
+	int port, r;
+	
+	if(resolve_host_(uristr, host, sizeof(host), &port))
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&resolve_lock);
+	entry = resolve_find_(host, resolve_hash_(host), time(NULL));
+	r = (entry && entry->state == RESOLVE_FAILED);
+	pthread_mutex_unlock(&resolve_lock);
+	return r;
+}
+
+/* Add the cached address of a URI's host, if there is one, to a list to be
+ * passed to CURLOPT_RESOLVE; returns -1 if the host is known not to
+ * resolve. If the host isn't cached, it's resolved for next time.
+ */
+int
+crawl_resolve_lookup_(const char *uristr, struct curl_slist **list)
+{
+	struct resolve_entry *entry;
+	char host[RESOLVE_HOST_LEN], buf[RESOLVE_HOST_LEN + INET6_ADDRSTRLEN + 16];
+	int port, state;
+	
+	if(resolve_host_(uristr, host, sizeof(host), &port))
+	{
+		return 0;
+	}
+	buf[0] = 0;
+	pthread_mutex_lock(&resolve_lock);
+	entry = resolve_find_(host, resolve_hash_(host), time(NULL));
+	state = (entry ? entry->state : RESOLVE_PENDING);
+	if(entry && state == RESOLVE_OK)
+	{
+		snprintf(buf, sizeof(buf), "%s:%d:%s", host, port, entry->addr);
+	}
+	pthread_mutex_unlock(&resolve_lock);
+	if(!entry)
+	{
+		crawl_resolve_prefetch(uristr);
+		return 0;
+	}
+	if(state == RESOLVE_FAILED)
+	{
+		return -1;
+	}
+	if(buf[0])
+	{
+		*list = curl_slist_append(*list, buf);
+	}
+	return 0;
+}
+
+/* Extract the host name and port from an absolute URI; returns -1 if there
+ * is no host name to resolve (including where the host is an IP literal)
+ */
+static int
+resolve_host_(const char *uristr, char *host, size_t hostlen, int *port)
+{
+	const char *s, *e, *t, *colon;
+	unsigned char addr[16];
+	size_t schemelen, len;
+	
+	s = strstr(uristr, "://");
+	if(!s)
+	{
+		return -1;
+	}
+	schemelen = s - uristr;
+	s += 3;
+	for(e = s; *e && *e != '/' && *e != '?' && *e != '#'; e++);
+	for(t = s; t < e; t++)
+	{
+		if(*t == '@')
+		{
+			s = t + 1;
+		}
+	}
+	if(s >= e || *s == '[')
+	{
+		return -1;
+	}
+	colon = memchr(s, ':', e - s);
+	len = (colon ? colon : e) - s;
+	if(!len || len >= hostlen)
+	{
+		return -1;
+	}
+	for(t = s; t < s + len; t++)
+	{
+		*host = tolower((unsigned char) *t);
+		host++;
+	}
+	*host = 0;
+	host -= len;
+	if(inet_pton(AF_INET, host, addr) == 1)
+	{
+		return -1;
+	}
+	if(colon && colon + 1 < e)
+	{
+		*port = atoi(colon + 1);
+	}
+	else if(schemelen == 5 && !strncasecmp(uristr, "https", 5))
+	{
+		*port = 443;
+	}
+	else if(schemelen == 4 && !strncasecmp(uristr, "http", 4))
+	{
+		*port = 80;
+	}
+	else
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Locate a cache entry, discarding any expired entries in its bucket; the
+ * lock must be held
+ */
+static struct resolve_entry *
+resolve_find_(const char *host, unsigned int h, time_t now)
+{
+	struct resolve_entry **p, *entry;
+	
+	for(p = &(resolve_cache[h]); *p; )
+	{
+		entry = *p;
+		if(entry->state != RESOLVE_PENDING && entry->expires <= now)
+		{
+			*p = entry->next;
+			free(entry);
+			resolve_count--;
+			continue;
+		}
+		if(!strcmp(entry->host, host))
+		{
+			return entry;
+		}
+		p = &(entry->next);
+	}
+	return NULL;
+}
+
+static unsigned int
+resolve_hash_(const char *host)
+{
+	unsigned int h;
+	
+	for(h = 5381; *host; host++)
+	{
+		h = (h * 33) ^ (unsigned char) *host;
+	}
+	return h % RESOLVE_BUCKETS;
+}
+
+static void
+resolve_init_(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int c;
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(c = 0; c < RESOLVE_THREADS; c++)
+	{
+		if(pthread_create(&thread, &attr, resolve_thread_, NULL))
+		{
+			break;
+		}
+		resolve_threads++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void *
+resolve_thread_(void *arg)
+{
+	struct resolve_entry *entry, **p;
+	struct addrinfo hints, *res, *ai;
+	char host[RESOLVE_HOST_LEN], addr[INET6_ADDRSTRLEN];
+	int r;
+	
+	(void) arg;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for(;;)
+	{
+		pthread_mutex_lock(&resolve_lock);
+		while(resolve_head == resolve_tail)
+		{
+			pthread_cond_wait(&resolve_cond, &resolve_lock);
+		}
+		entry = resolve_queue[resolve_head % RESOLVE_QUEUE_LEN];
+		resolve_head++;
+		strcpy(host, entry->host);
+		pthread_mutex_unlock(&resolve_lock);
+		addr[0] = 0;
+		res = NULL;
+		r = getaddrinfo(host, NULL, &hints, &res);
+		if(!r)
+		{
+			/* Prefer an IPv4 address, if there is one */
+			for(ai = res; ai; ai = ai->ai_next)
+			{
+				if(ai->ai_family == AF_INET)
+				{
+					inet_ntop(AF_INET, &(((struct sockaddr_in *) ai->ai_addr)->sin_addr), addr, sizeof(addr));
+					break;
+				}
+			}
+			for(ai = res; !addr[0] && ai; ai = ai->ai_next)
+			{
+				if(ai->ai_family == AF_INET6)
+				{
+					inet_ntop(AF_INET6, &(((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr), addr, sizeof(addr));
+				}
+			}
+			freeaddrinfo(res);
+		}
+		pthread_mutex_lock(&resolve_lock);
+		if(addr[0])
+		{
+			strcpy(entry->addr, addr);
+			entry->state = RESOLVE_OK;
+			entry->expires = time(NULL) + RESOLVE_POSITIVE_TTL;
+		}
+		else if(r == EAI_NONAME
+#ifdef EAI_NODATA
+			|| r == EAI_NODATA
+#endif
+			)
+		{
+			entry->state = RESOLVE_FAILED;
+			entry->expires = time(NULL) + RESOLVE_NEGATIVE_TTL;
+		}
+		else
+		{
+			/* A temporary failure: let curl try for itself, and
+			 * look it up again next time
+			 */
+			for(p = &(resolve_cache[resolve_hash_(host)]); *p; p = &((*p)->next))
+			{
+				if(*p == entry)
+				{
+					*p = entry->next;
+					free(entry);
+					resolve_count--;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&resolve_lock);
+	}
+	return NULL;
+}
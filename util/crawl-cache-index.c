@@ -0,0 +1,157 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "crawl.h"
+
+/* Build (or list) a sorted index of a cache using libcrawl */
+
+static int list_index(const char *progname, const char *path);
+static void usage(const char *progname);
+
+int
+main(int argc, char **argv)
+{
+	CRAWL *crawl;
+	const char *index;
+	size_t moved;
+	int c, nthreads, list, rekey;
+	
+	nthreads = 0;
+	list = 0;
+	rekey = 0;
+	index = NULL;
+	while((c = getopt(argc, argv, "hlrj:o:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'l':
+			list = 1;
+			break;
+		case 'r':
+			rekey = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'o':
+			index = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(argc - optind > 1)
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	crawl = crawl_create();
+	if(!crawl)
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(optind < argc)
+	{
+		crawl_set_cache(crawl, argv[optind]);
+	}
+	if(list)
+	{
+		if(!index)
+		{
+			fprintf(stderr, "%s: the path to the index must be specified with -o when listing\n", argv[0]);
+			crawl_destroy(crawl);
+			exit(EXIT_FAILURE);
+		}
+		c = list_index(argv[0], index);
+		crawl_destroy(crawl);
+		return c;
+	}
+	if(rekey)
+	{
+		if(crawl_cache_rekey(crawl, nthreads, &moved))
+		{
+			fprintf(stderr, "%s: failed to re-key cache: %s\n", argv[0], strerror(errno));
+			crawl_destroy(crawl);
+			return 1;
+		}
+		fprintf(stderr, "%s: re-keyed %lu objects\n", argv[0], (unsigned long) moved);
+	}
+	if(crawl_cache_index(crawl, index, nthreads))
+	{
+		fprintf(stderr, "%s: failed to index cache: %s\n", argv[0], strerror(errno));
+		crawl_destroy(crawl);
+		return 1;
+	}
+	crawl_destroy(crawl);
+	return 0;
+}
+
+/* Stream the contents of an index to standard output */
+static int
+list_index(const char *progname, const char *path)
+{
+	CRAWLINDEX *index;
+	const CRAWLINDEXENTRY *entry;
+	const char *type;
+	char key[48];
+	size_t c, count;
+	
+	index = crawl_index_open(path);
+	if(!index)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return 1;
+	}
+	count = crawl_index_count(index);
+	for(c = 0; c < count; c++)
+	{
+		entry = crawl_index_entry(index, c);
+		crawl_index_key(entry, key, sizeof(key));
+		type = crawl_index_type(index, entry->type);
+		printf("%s %ld %d %llu %s\n", key, (long) entry->updated, (int) entry->status, (unsigned long long) entry->size, (type ? type : "-"));
+	}
+	crawl_index_close(index);
+	return 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-r] [-j THREADS] [-o INDEX] [CACHE]\n"
+		"       %s -l -o INDEX\n"
+		"\n"
+		"  -j THREADS   Walk the cache using THREADS threads (default: one per CPU)\n"
+		"  -o INDEX     Write the index to INDEX (default: CACHE/index)\n"
+		"  -r           Move objects cached before URIs were canonicalised to\n"
+		"               their current keys before indexing\n"
+		"  -l           List the contents of INDEX\n",
+		progname, progname);
+}
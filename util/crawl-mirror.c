@@ -31,7 +31,7 @@
 #define QUEUE_BLOCK_SIZE               16
 
 static URI *initial_uri;
-static char *initial_uri_str;
+static CRAWLCANON *initial_canon;
 static URI **queue;
 size_t queue_count;
 size_t queue_size;
@@ -96,7 +96,7 @@ policy_callback(CRAWL *crawl, URI *uri, const char *uristr, void *userdata)
 	(void) crawl;
 	(void) userdata;
 	
-	if(strncmp(uristr, initial_uri_str, strlen(initial_uri_str)))
+	if(strncmp(uristr, initial_canon->uri, initial_canon->urilen))
 	{
 		fprintf(stderr, "Not fetching %s because it is outside of the mirror root\n", uristr);
 		return 0;
@@ -114,8 +114,7 @@ static int
 updated_callback(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata)
 {
 	int status;
-	const char *str;
-	char *type, *p;
+	const char *str, *type;
 	URI *uri;
 	
 	(void) crawl;
@@ -126,35 +125,15 @@ updated_callback(CRAWL *crawl, CRAWLOBJ *obj, time_t prevtime, void *userdata)
 	fprintf(stderr, "Fetched %s => %s (%d)\n", crawl_obj_uristr(obj), crawl_obj_key(obj), status);
 	if(status == 200)
 	{
-		str = crawl_obj_type(obj);
-		if(!str)
-		{
-			return 0;
-		}
-		type = strdup(str);
+		type = crawl_obj_media_type(obj);
 		if(!type)
 		{
-			return -1;
-		}
-		p = strchr(type, ';');
-		if(p)
-		{
-			*p = 0;
-		}
-		while(p > type)
-		{
-			p--;
-			if(!isspace(*p))
-			{
-				break;
-			}
-			*p = 0;
+			return 0;
 		}
 		if(!strcmp(type, "text/html") || !strcmp(type, "application/xhtml+xml"))
 		{
 			recurse_links(crawl, obj);
 		}
-		free(type);
 		return 0;
 	}
 	if(status >= 300 && status < 399)
@@ -196,7 +175,7 @@ static int
 push_uri(CRAWL *crawl, URI *uri)
 {
 	CRAWLOBJ *obj;
-	size_t needed;
+	char *uristr;
 	URI **p;
 	
 	obj = crawl_locate_uri(crawl, uri);
@@ -220,13 +199,17 @@ push_uri(CRAWL *crawl, URI *uri)
 	if(!initial_uri)
 	{
 		initial_uri = uri_create_uri(uri, NULL);
-		needed = uri_str(uri, NULL, 0);
-		initial_uri_str = (char *) malloc(needed);
-		if(!initial_uri_str)
+		/* The URIs passed to the policy callback are canonical, so the
+		 * mirror root must be too
+		 */
+		uristr = uri_stralloc(uri);
+		if(!uristr)
 		{
 			return -1;
 		}
-		if(uri_str(uri, initial_uri_str, needed) != needed)
+		initial_canon = crawl_canonicalise(uristr);
+		free(uristr);
+		if(!initial_canon)
 		{
 			return -1;
 		}
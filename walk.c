@@ -0,0 +1,606 @@
+/*
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcrawl.h"
+
+/* Parallel walking of the cache's shard tree.
+ *
+ * The cache is laid out as <cache>/xx/yy/<key>.<suffix>, giving 256
+ * top-level shards each of up to 256 leaf directories. Each worker thread
+ * claims the next unvisited top-level shard and visits its leaf directories
+ * in key order. Within a leaf directory, objects are visited in inode order,
+ * which on most filesystems approximates on-disk order and so reduces
+ * seeking.
+ *
+ * When the context has an index attached, crawl_cache_foreach() instead
+ * visits the indexed objects in key order, each thread taking a contiguous
+ * range of the index (the index doesn't record inodes, so the per-leaf
+ * inode ordering isn't available), and then walks only those leaf
+ * directories modified since the index was built to pick up any objects
+ * cached after it.
+ */
+
+struct cache_walk_struct
+{
+	CRAWL *crawl;
+	cache_walk_cb_ cb;
+	void *userdata;
+	time_t since;
+	pthread_mutex_t lock;
+	char shards[256][3];
+	size_t nshards;
+	size_t next;
+	int stop;
+	int error;
+};
+
+struct cache_walk_thread_struct
+{
+	struct cache_walk_struct *walk;
+	pthread_t thread;
+	int index;
+};
+
+struct cache_walk_entry_struct
+{
+	ino_t ino;
+	CACHEKEY key;
+};
+
+struct cache_foreach_struct
+{
+	crawl_cache_filter_cb filter;
+	crawl_cache_foreach_cb cb;
+	CRAWL **contexts;
+	CRAWLINDEX *index;
+	size_t count;
+	int nthreads;
+	pthread_mutex_t lock;
+	int stop;
+};
+
+struct cache_foreach_thread_struct
+{
+	struct cache_foreach_struct *fe;
+	pthread_t thread;
+	int index;
+};
+
+static void *cache_walk_thread_(void *arg);
+static int cache_walk_shard_(struct cache_walk_struct *walk, int thread, const char *shard);
+static int cache_walk_leaf_(struct cache_walk_struct *walk, int thread, char *path, size_t pathlen);
+static int cache_walk_list_(const char *path, char names[256][3]);
+static int cache_walk_namecmp_(const void *a, const void *b);
+static int cache_walk_inocmp_(const void *a, const void *b);
+static int cache_foreach_visit_(struct cache_foreach_struct *fe, int thread, const CACHEKEY key);
+static int cache_foreach_walk_cb_(void *userdata, int thread, const CACHEKEY key, const char *path);
+static int cache_foreach_since_cb_(void *userdata, int thread, const CACHEKEY key, const char *path);
+static int cache_foreach_index_(struct cache_foreach_struct *fe);
+static void *cache_foreach_index_thread_(void *arg);
+
+/* Iterate the committed objects in the cache */
+int
+crawl_cache_foreach(CRAWL *crawl, crawl_cache_filter_cb filter, crawl_cache_foreach_cb cb, int nthreads)
+{
+	struct cache_foreach_struct fe;
+	int c, r;
+	
+	if(!cb)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&fe, 0, sizeof(fe));
+	fe.filter = filter;
+	fe.cb = cb;
+	fe.index = crawl->index;
+	fe.nthreads = cache_walk_threads_(nthreads);
+	if(fe.index)
+	{
+		fe.count = crawl_index_count(fe.index);
+		if((size_t) fe.nthreads > fe.count)
+		{
+			fe.nthreads = (fe.count ? (int) fe.count : 1);
+		}
+	}
+	/* Each thread is given its own context, as contexts can't be shared */
+	fe.contexts = (CRAWL **) calloc(fe.nthreads, sizeof(CRAWL *));
+	if(!fe.contexts)
+	{
+		return -1;
+	}
+	r = 0;
+	for(c = 0; c < fe.nthreads; c++)
+	{
+		fe.contexts[c] = crawl_create();
+		if(!fe.contexts[c] ||
+			crawl_set_cache(fe.contexts[c], crawl->cache))
+		{
+			r = -1;
+			break;
+		}
+		crawl_set_userdata(fe.contexts[c], crawl->userdata);
+		crawl_set_verbose(fe.contexts[c], crawl->verbose);
+	}
+	if(!r)
+	{
+		if(fe.index)
+		{
+			r = cache_foreach_index_(&fe);
+			if(!r && !fe.stop)
+			{
+				/* Pick up anything cached since the index was built */
+				r = cache_walk_since_(crawl, fe.nthreads, crawl_index_created(fe.index), cache_foreach_since_cb_, &fe);
+			}
+		}
+		else
+		{
+			r = cache_walk_(crawl, fe.nthreads, cache_foreach_walk_cb_, &fe);
+		}
+	}
+	for(c = 0; c < fe.nthreads; c++)
+	{
+		crawl_destroy(fe.contexts[c]);
+	}
+	free(fe.contexts);
+	return r;
+}
+
+/* Determine the number of threads to use for a walk */
+int
+cache_walk_threads_(int nthreads)
+{
+	long n;
+	
+	if(nthreads > 0)
+	{
+		return nthreads;
+	}
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+	{
+		n = 1;
+	}
+	return (int) n;
+}
+
+/* Walk the cache using nthreads threads, invoking cb for each committed
+ * object. The callback is invoked concurrently from each of the threads.
+ */
+int
+cache_walk_(CRAWL *crawl, int nthreads, cache_walk_cb_ cb, void *userdata)
+{
+	return cache_walk_since_(crawl, nthreads, 0, cb, userdata);
+}
+
+/* As cache_walk_(), but if since is nonzero, skip any leaf directory which
+ * hasn't been modified since that time
+ */
+int
+cache_walk_since_(CRAWL *crawl, int nthreads, time_t since, cache_walk_cb_ cb, void *userdata)
+{
+	struct cache_walk_struct walk;
+	struct cache_walk_thread_struct *threads;
+	int c, started;
+	
+	memset(&walk, 0, sizeof(walk));
+	walk.crawl = crawl;
+	walk.cb = cb;
+	walk.userdata = userdata;
+	walk.since = since;
+	if(cache_walk_list_(crawl->cache, walk.shards) < 0)
+	{
+		return -1;
+	}
+	for(walk.nshards = 0; walk.nshards < 256 && walk.shards[walk.nshards][0]; walk.nshards++);
+	nthreads = cache_walk_threads_(nthreads);
+	if((size_t) nthreads > walk.nshards)
+	{
+		nthreads = (walk.nshards ? (int) walk.nshards : 1);
+	}
+	if(nthreads == 1)
+	{
+		/* Don't bother spawning a thread */
+		for(walk.next = 0; walk.next < walk.nshards && !walk.stop; walk.next++)
+		{
+			if(cache_walk_shard_(&walk, 0, walk.shards[walk.next]))
+			{
+				walk.stop = 1;
+			}
+		}
+		return walk.error;
+	}
+	threads = (struct cache_walk_thread_struct *) calloc(nthreads, sizeof(struct cache_walk_thread_struct));
+	if(!threads)
+	{
+		return -1;
+	}
+	pthread_mutex_init(&(walk.lock), NULL);
+	started = 0;
+	for(c = 0; c < nthreads; c++)
+	{
+		threads[c].walk = &walk;
+		threads[c].index = c;
+		if(pthread_create(&(threads[c].thread), NULL, cache_walk_thread_, &(threads[c])))
+		{
+			pthread_mutex_lock(&(walk.lock));
+			walk.stop = 1;
+			walk.error = -1;
+			pthread_mutex_unlock(&(walk.lock));
+			break;
+		}
+		started++;
+	}
+	for(c = 0; c < started; c++)
+	{
+		pthread_join(threads[c].thread, NULL);
+	}
+	pthread_mutex_destroy(&(walk.lock));
+	free(threads);
+	return walk.error;
+}
+
+static void *
+cache_walk_thread_(void *arg)
+{
+	struct cache_walk_thread_struct *self;
+	struct cache_walk_struct *walk;
+	const char *shard;
+	
+	self = (struct cache_walk_thread_struct *) arg;
+	walk = self->walk;
+	for(;;)
+	{
+		shard = NULL;
+		pthread_mutex_lock(&(walk->lock));
+		if(!walk->stop && walk->next < walk->nshards)
+		{
+			shard = walk->shards[walk->next];
+			walk->next++;
+		}
+		pthread_mutex_unlock(&(walk->lock));
+		if(!shard)
+		{
+			break;
+		}
+		if(cache_walk_shard_(walk, self->index, shard))
+		{
+			pthread_mutex_lock(&(walk->lock));
+			walk->stop = 1;
+			pthread_mutex_unlock(&(walk->lock));
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Visit each of the leaf directories within a top-level shard */
+static int
+cache_walk_shard_(struct cache_walk_struct *walk, int thread, const char *shard)
+{
+	char leaves[256][3];
+	char *path;
+	size_t base, c;
+	struct stat sbuf;
+	int r;
+	
+	/* base path + "/" + xx + "/" + yy + "/" + key + "." + suffix + NUL */
+	base = strlen(walk->crawl->cache);
+	path = (char *) malloc(base + 1 + 2 + 1 + 2 + 1 + CACHE_KEY_LEN + 1 + strlen(CACHE_INFO_SUFFIX) + 1);
+	if(!path)
+	{
+		walk->error = -1;
+		return -1;
+	}
+	sprintf(path, "%s/%s", walk->crawl->cache, shard);
+	if(cache_walk_list_(path, leaves) < 0)
+	{
+		free(path);
+		return 0;
+	}
+	r = 0;
+	for(c = 0; c < 256 && leaves[c][0] && !walk->stop; c++)
+	{
+		sprintf(path, "%s/%s/%s", walk->crawl->cache, shard, leaves[c]);
+		if(walk->since &&
+			(stat(path, &sbuf) || sbuf.st_mtime < walk->since))
+		{
+			continue;
+		}
+		r = cache_walk_leaf_(walk, thread, path, base + 6);
+		if(r)
+		{
+			break;
+		}
+	}
+	free(path);
+	return r;
+}
+
+/* Visit each of the committed objects within a leaf directory, in inode
+ * order
+ */
+static int
+cache_walk_leaf_(struct cache_walk_struct *walk, int thread, char *path, size_t pathlen)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct cache_walk_entry_struct *list, *p;
+	size_t count, size, c, len, suffixlen;
+	int r;
+	
+	dir = opendir(path);
+	if(!dir)
+	{
+		return 0;
+	}
+	list = NULL;
+	count = 0;
+	size = 0;
+	suffixlen = strlen(CACHE_INFO_SUFFIX);
+	while((de = readdir(dir)))
+	{
+		/* Only <key>.json is of interest: this excludes payloads and
+		 * uncommitted (.tmp) files.
+		 */
+		len = strlen(de->d_name);
+		if(len != CACHE_KEY_LEN + 1 + suffixlen ||
+			de->d_name[CACHE_KEY_LEN] != '.' ||
+			strcmp(&(de->d_name[CACHE_KEY_LEN + 1]), CACHE_INFO_SUFFIX))
+		{
+			continue;
+		}
+		if(count + 1 > size)
+		{
+			p = (struct cache_walk_entry_struct *) realloc(list, sizeof(struct cache_walk_entry_struct) * (size + 64));
+			if(!p)
+			{
+				free(list);
+				closedir(dir);
+				walk->error = -1;
+				return -1;
+			}
+			list = p;
+			size += 64;
+		}
+		list[count].ino = de->d_ino;
+		strncpy(list[count].key, de->d_name, CACHE_KEY_LEN);
+		list[count].key[CACHE_KEY_LEN] = 0;
+		count++;
+	}
+	closedir(dir);
+	qsort(list, count, sizeof(struct cache_walk_entry_struct), cache_walk_inocmp_);
+	r = 0;
+	for(c = 0; c < count && !walk->stop; c++)
+	{
+		sprintf(&(path[pathlen]), "/%s.%s", list[c].key, CACHE_INFO_SUFFIX);
+		r = walk->cb(walk->userdata, thread, list[c].key, path);
+		if(r)
+		{
+			break;
+		}
+	}
+	path[pathlen] = 0;
+	free(list);
+	return r;
+}
+
+/* List the two-character hex-named subdirectories of path, in order; the
+ * list is terminated by an empty name if there are fewer than 256.
+ */
+static int
+cache_walk_list_(const char *path, char names[256][3])
+{
+	DIR *dir;
+	struct dirent *de;
+	size_t count;
+	
+	memset(names, 0, 256 * 3);
+	dir = opendir(path);
+	if(!dir)
+	{
+		return -1;
+	}
+	count = 0;
+	while(count < 256 && (de = readdir(dir)))
+	{
+		if(strlen(de->d_name) != 2 ||
+			!isxdigit(de->d_name[0]) || !isxdigit(de->d_name[1]))
+		{
+			continue;
+		}
+		names[count][0] = de->d_name[0];
+		names[count][1] = de->d_name[1];
+		count++;
+	}
+	closedir(dir);
+	qsort(names, count, 3, cache_walk_namecmp_);
+	return (int) count;
+}
+
+static int
+cache_walk_namecmp_(const void *a, const void *b)
+{
+	return strcmp((const char *) a, (const char *) b);
+}
+
+static int
+cache_walk_inocmp_(const void *a, const void *b)
+{
+	const struct cache_walk_entry_struct *ea, *eb;
+	
+	ea = (const struct cache_walk_entry_struct *) a;
+	eb = (const struct cache_walk_entry_struct *) b;
+	if(ea->ino < eb->ino)
+	{
+		return -1;
+	}
+	if(ea->ino > eb->ino)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Open and visit a single object on behalf of crawl_cache_foreach() */
+static int
+cache_foreach_visit_(struct cache_foreach_struct *fe, int thread, const CACHEKEY key)
+{
+	CRAWL *crawl;
+	CRAWLOBJ *obj;
+	int r;
+	
+	crawl = fe->contexts[thread];
+	if(fe->filter && fe->filter(crawl, key, crawl->userdata) < 1)
+	{
+		return 0;
+	}
+	obj = crawl_obj_locate_key_(crawl, key);
+	if(!obj)
+	{
+		/* The object may have been removed since it was indexed */
+		return 0;
+	}
+	r = fe->cb(crawl, obj, crawl->userdata);
+	crawl_obj_destroy(obj);
+	return r;
+}
+
+static int
+cache_foreach_walk_cb_(void *userdata, int thread, const CACHEKEY key, const char *path)
+{
+	(void) path;
+	
+	return cache_foreach_visit_((struct cache_foreach_struct *) userdata, thread, key);
+}
+
+/* Visit an object found in a leaf modified since the index was built,
+ * unless it was already visited because it's in the index
+ */
+static int
+cache_foreach_since_cb_(void *userdata, int thread, const CACHEKEY key, const char *path)
+{
+	struct cache_foreach_struct *fe;
+	
+	(void) path;
+	
+	fe = (struct cache_foreach_struct *) userdata;
+	if(crawl_index_lookup(fe->index, key))
+	{
+		return 0;
+	}
+	return cache_foreach_visit_(fe, thread, key);
+}
+
+/* Iterate the objects listed in an index in key order: each thread is given
+ * a contiguous range of the (sorted) index, so the threads between them
+ * proceed through the shards in order, but objects within a leaf are
+ * visited in key rather than inode order
+ */
+static int
+cache_foreach_index_(struct cache_foreach_struct *fe)
+{
+	struct cache_foreach_thread_struct *threads;
+	int c, started, r;
+	
+	if(fe->nthreads == 1)
+	{
+		threads = NULL;
+	}
+	else
+	{
+		threads = (struct cache_foreach_thread_struct *) calloc(fe->nthreads, sizeof(struct cache_foreach_thread_struct));
+		if(!threads)
+		{
+			return -1;
+		}
+	}
+	pthread_mutex_init(&(fe->lock), NULL);
+	r = 0;
+	if(!threads)
+	{
+		struct cache_foreach_thread_struct self;
+	
+		self.fe = fe;
+		self.index = 0;
+		cache_foreach_index_thread_(&self);
+	}
+	else
+	{
+		started = 0;
+		for(c = 0; c < fe->nthreads; c++)
+		{
+			threads[c].fe = fe;
+			threads[c].index = c;
+			if(pthread_create(&(threads[c].thread), NULL, cache_foreach_index_thread_, &(threads[c])))
+			{
+				pthread_mutex_lock(&(fe->lock));
+				fe->stop = 1;
+				pthread_mutex_unlock(&(fe->lock));
+				r = -1;
+				break;
+			}
+			started++;
+		}
+		for(c = 0; c < started; c++)
+		{
+			pthread_join(threads[c].thread, NULL);
+		}
+		free(threads);
+	}
+	pthread_mutex_destroy(&(fe->lock));
+	return r;
+}
+
+static void *
+cache_foreach_index_thread_(void *arg)
+{
+	struct cache_foreach_thread_struct *self;
+	struct cache_foreach_struct *fe;
+	const CRAWLINDEXENTRY *entry;
+	CACHEKEY key;
+	size_t c, end;
+	int stop;
+	
+	self = (struct cache_foreach_thread_struct *) arg;
+	fe = self->fe;
+	c = (fe->count * self->index) / fe->nthreads;
+	end = (fe->count * (self->index + 1)) / fe->nthreads;
+	for(; c < end; c++)
+	{
+		pthread_mutex_lock(&(fe->lock));
+		stop = fe->stop;
+		pthread_mutex_unlock(&(fe->lock));
+		if(stop)
+		{
+			break;
+		}
+		entry = crawl_index_entry(fe->index, c);
+		cache_key_hex_(entry->key, key);
+		if(cache_foreach_visit_(fe, self->index, key))
+		{
+			pthread_mutex_lock(&(fe->lock));
+			fe->stop = 1;
+			pthread_mutex_unlock(&(fe->lock));
+			break;
+		}
+	}
+	return NULL;
+}